@@ -0,0 +1,522 @@
+#include <limits.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "Log.hh"
+#include "Stats.hh"
+#include "Util.hh"
+
+static char usage[] =
+    "Usage: %s [OPTIONS] [sender file] [receiver file] ...\n"
+    "  Join the compact performance logs of a Sender and a Receiver by\n"
+    "  packet sequence number and print loss, duplication, reordering and\n"
+    "  the distributions of one-way delay, RTT and jitter. Several runs\n"
+    "  are analyzed at once by giving several pairs of files; a total is\n"
+    "  printed for them as well.\n"
+    "  One-way delays are relative to the smallest one of the run, as the\n"
+    "  clocks of both hosts are not assumed to be synchronized.\n"
+    "  -f [flow]\n"
+    "    Analyze flow [flow] of the sender files, i.e. the receiver the\n"
+    "    receiver files belong to.\n"
+    "    Default: 0\n"
+    "  -h\n"
+    "    Display this message and quit.\n"
+    "  -j [threads]\n"
+    "    Split the sequence space of every run across [threads] threads.\n"
+    "    Default: number of CPUs\n"
+    "  -v\n"
+    "    Display version information.\n";
+
+static int flow;
+static int threads;
+
+static int parseArguments(int argc, char **argv)
+{
+    char c;
+
+    while ((c = getopt(argc, argv, "f:hj:v")) != EOF)
+    {
+        switch (c)
+        {
+        case 'f':
+            flow = atoi(optarg);
+            break;
+        case 'h':
+            log.longMessage(usage, argv[0]);
+            return -1;
+            break;
+        case 'j':
+            threads = atoi(optarg);
+            break;
+        case 'v':
+            log.message("Version %s\n", VERSION);
+            return -1;
+            break;
+        default:
+            log.error("parseArguments: Unrecognized option %c", c);
+            return 2;
+            break;
+        }
+    }
+
+    if (optind >= argc || (argc - optind) % 2 != 0)
+    {
+        log.error("parseArguments: Sender and receiver files must be given "
+            "in pairs.");
+        return 3;
+    }
+    if (threads <= 0)
+    {
+        threads = std::thread::hardware_concurrency();
+        threads = threads > 0 ? threads : 1;
+    }
+
+    return 0;
+}
+
+// what happened to one packet on one side
+struct Event
+{
+    long seq;
+    long time;
+    int type;
+};
+
+struct Result
+{
+    long sent;
+    long received;
+    long lost;
+    long duplicates;
+    // received, but not to be ACKed
+    long ignored;
+    long acksSent;
+    long acked;
+    long acksLost;
+    long ackDuplicates;
+    long reordered;
+    // raw one-way delays, including the clock offset of both hosts
+    long minForward;
+    long minReverse;
+    Histogram forward;
+    Histogram reverse;
+    Histogram rtt;
+    Histogram dwell;
+    Histogram jitter;
+    Histogram reorder;
+
+    Result(): sent(0), received(0), lost(0), duplicates(0), ignored(0),
+        acksSent(0), acked(0), acksLost(0), ackDuplicates(0), reordered(0),
+        minForward(LONG_MAX), minReverse(LONG_MAX), forward(), reverse(),
+        rtt(), dwell(), jitter(), reorder()
+    {
+    }
+
+    void merge(const Result &other)
+    {
+        sent += other.sent;
+        received += other.received;
+        lost += other.lost;
+        duplicates += other.duplicates;
+        ignored += other.ignored;
+        acksSent += other.acksSent;
+        acked += other.acked;
+        acksLost += other.acksLost;
+        ackDuplicates += other.ackDuplicates;
+        reordered += other.reordered;
+        minForward = std::min(minForward, other.minForward);
+        minReverse = std::min(minReverse, other.minReverse);
+        forward.merge(other.forward);
+        reverse.merge(other.reverse);
+        rtt.merge(other.rtt);
+        dwell.merge(other.dwell);
+        jitter.merge(other.jitter);
+        reorder.merge(other.reorder);
+    }
+};
+
+// the packets [first, last) of a run, handled by one thread
+struct Part
+{
+    long first;
+    long last;
+    std::vector<Event> tx;
+    std::vector<Event> rx;
+    std::vector<long> forward;
+    std::vector<long> reverse;
+    Result res;
+};
+
+// the events of packets [first, last) in `rd`, ordered by packet and time.
+// the index of `rd` must have been built.
+static void collect(RecordReader &rd, long first, long last, int sender,
+    std::vector<Event> &out)
+{
+    auto range = rd.seqRange(first, last);
+
+    for (auto it = range.first; it != range.second; ++it)
+    {
+        const CompactRecorder::Record &rec = **it;
+        if (!sender || rec.getFlow() == flow)
+        {
+            out.push_back({rec.pakSeq, RecordReader::nanoTime(rec),
+                rec.getType()});
+        }
+    }
+}
+
+// the first time of an event of `type` of packet `seq` in `rd`, or -1 if
+// there is none.
+static long firstTime(RecordReader &rd, long seq, int sender,
+    CompactRecorder::Type type)
+{
+    std::vector<Event> events;
+
+    collect(rd, seq, seq + 1, sender, events);
+    for (const Event &e : events)
+    {
+        if (e.type == type)
+        {
+            return e.time;
+        }
+    }
+    return -1;
+}
+
+// merge join of both sides of the packets of `part`. one-way delays are
+// kept raw until the minimum of the whole run is known.
+static void joinMain(RecordReader *txRd, RecordReader *rxRd, Part *part)
+{
+    typedef CompactRecorder::Type Type;
+    Result &res = part->res;
+    // no packet before: seq - 1 never matches
+    long prevSeq = LONG_MIN;
+    long prevSent;
+    long prevRecv;
+
+    collect(*txRd, part->first, part->last, 1, part->tx);
+    collect(*rxRd, part->first, part->last, 0, part->rx);
+
+    // the IPDV of the first packet is against the last one of the part
+    // before, so that the jitter does not depend on the number of parts
+    prevSent = firstTime(*txRd, part->first - 1, 1, Type::SENT);
+    prevRecv = firstTime(*rxRd, part->first - 1, 0, Type::RECEIVED);
+    if (prevSent >= 0 && prevRecv >= 0)
+    {
+        prevSeq = part->first - 1;
+    }
+
+    auto tx = part->tx.cbegin();
+    auto rx = part->rx.cbegin();
+    while (tx != part->tx.cend() || rx != part->rx.cend())
+    {
+        long seq = LONG_MAX;
+        if (tx != part->tx.cend())
+        {
+            seq = tx->seq;
+        }
+        if (rx != part->rx.cend() && rx->seq < seq)
+        {
+            seq = rx->seq;
+        }
+
+        // first time of every event type of this packet, and counts
+        long sent = -1, recv = -1, ackSent = -1, acked = -1;
+        int nrecv = 0, nacked = 0, nackSent = 0;
+        for (; tx != part->tx.cend() && tx->seq == seq; ++tx)
+        {
+            if (tx->type == Type::SENT && sent < 0)
+            {
+                sent = tx->time;
+            }
+            else if (tx->type == Type::ACKED && nacked++ == 0)
+            {
+                acked = tx->time;
+            }
+        }
+        for (; rx != part->rx.cend() && rx->seq == seq; ++rx)
+        {
+            if (rx->type == Type::RECEIVED && nrecv++ == 0)
+            {
+                recv = rx->time;
+            }
+            else if (rx->type == Type::ACK_SENT && nackSent++ == 0)
+            {
+                ackSent = rx->time;
+            }
+            else if (rx->type == Type::IGNORED)
+            {
+                ++res.ignored;
+            }
+        }
+
+        if (sent >= 0)
+        {
+            ++res.sent;
+            res.lost += nrecv == 0;
+        }
+        res.received += nrecv > 0;
+        res.duplicates += nrecv > 1 ? nrecv - 1 : 0;
+        res.acksSent += nackSent > 0;
+        res.acked += nacked > 0;
+        res.acksLost += nackSent > 0 && nacked == 0;
+        res.ackDuplicates += nacked > 1 ? nacked - 1 : 0;
+
+        if (sent >= 0 && recv >= 0)
+        {
+            part->forward.push_back(recv - sent);
+            res.minForward = std::min(res.minForward, recv - sent);
+            // IPDV(RFC 3393) of consecutive packets
+            if (prevSeq == seq - 1)
+            {
+                long d = (recv - prevRecv) - (sent - prevSent);
+                res.jitter.record(d < 0 ? -d : d);
+            }
+            prevSeq = seq;
+            prevSent = sent;
+            prevRecv = recv;
+        }
+        if (ackSent >= 0 && acked >= 0)
+        {
+            part->reverse.push_back(acked - ackSent);
+            res.minReverse = std::min(res.minReverse, acked - ackSent);
+        }
+        if (sent >= 0 && acked >= 0)
+        {
+            res.rtt.record(acked - sent);
+        }
+        if (recv >= 0 && ackSent >= 0)
+        {
+            res.dwell.record(ackSent - recv);
+        }
+    }
+
+    // the events are not needed anymore
+    std::vector<Event>().swap(part->tx);
+    std::vector<Event>().swap(part->rx);
+}
+
+static void relativeMain(Part *part, long minForward, long minReverse)
+{
+    for (long v : part->forward)
+    {
+        part->res.forward.record(v - minForward);
+    }
+    for (long v : part->reverse)
+    {
+        part->res.reverse.record(v - minReverse);
+    }
+    std::vector<long>().swap(part->forward);
+    std::vector<long>().swap(part->reverse);
+}
+
+// packets arriving after one with a higher sequence number, in the order
+// of their receive timestamps. packets too far behind to be told from
+// duplicates are taken as reordered.
+static void reorderMain(RecordReader *rxRd, Result *res)
+{
+    typedef CompactRecorder::Type Type;
+    auto range = rxRd->timeRange(LONG_MIN, LONG_MAX);
+    UniqueSmart<SeqTracker> seen = std::make_unique<SeqTracker>();
+
+    for (auto it = range.first; it != range.second; ++it)
+    {
+        const CompactRecorder::Record &rec = **it;
+        long seq = rec.pakSeq;
+        long distance;
+
+        if (rec.getType() != Type::RECEIVED || seq < 0)
+        {
+            continue;
+        }
+        switch (seen->onArrival(seq, distance))
+        {
+        case SeqTracker::Arrival::LATE:
+            ++res->reordered;
+            res->reorder.record(distance);
+            break;
+        case SeqTracker::Arrival::TOO_OLD:
+            ++res->reordered;
+            res->reorder.record(seen->getHighest() - seq);
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+static void printDist(const char *name, const char *what,
+    const Histogram &h)
+{
+    if (h.count() == 0)
+    {
+        return;
+    }
+    log.message("analyze[%s]: %s(us) min %.1lf p50 %.1lf p90 %.1lf "
+        "p99 %.1lf p99.9 %.1lf max %.1lf mean %.1lf.", name, what,
+        h.getMin() / 1e3, h.percentile(0.5) / 1e3, h.percentile(0.9) / 1e3,
+        h.percentile(0.99) / 1e3, h.percentile(0.999) / 1e3,
+        h.getMax() / 1e3, h.mean() / 1e3);
+}
+
+static void print(const char *name, const Result &res)
+{
+    log.message("analyze[%s]: %ld sent, %ld received, %ld lost(%.3lf%%), "
+        "%ld duplicate, %ld reordered(extent p50 %ld max %ld).", name,
+        res.sent, res.received, res.lost,
+        res.sent == 0 ? 0.0 : res.lost * 100.0 / res.sent, res.duplicates,
+        res.reordered, res.reorder.percentile(0.5), res.reorder.getMax());
+    log.message("analyze[%s]: %ld ACKs sent, %ld ACKed, %ld lost(%.3lf%%), "
+        "%ld duplicate, %ld packets not ACKed by the receiver.", name,
+        res.acksSent, res.acked, res.acksLost,
+        res.acksSent == 0 ? 0.0 : res.acksLost * 100.0 / res.acksSent,
+        res.ackDuplicates, res.ignored);
+    printDist(name, "forward OWD(relative)", res.forward);
+    printDist(name, "reverse OWD(relative)", res.reverse);
+    printDist(name, "RTT", res.rtt);
+    printDist(name, "receiver dwell", res.dwell);
+    printDist(name, "jitter(IPDV)", res.jitter);
+}
+
+static void loadMain(RecordReader *rd, int *ret)
+{
+    *ret = rd->load();
+}
+
+static int analyze(const char *txPath, const char *rxPath, Result &res)
+{
+    RecordReader txRd, rxRd;
+    int txRet, rxRet;
+
+    if (txRd.init(txPath) != 0 || rxRd.init(rxPath) != 0)
+    {
+        return 1;
+    }
+    std::thread txLoader(loadMain, &txRd, &txRet);
+    std::thread rxLoader(loadMain, &rxRd, &rxRet);
+    txLoader.join();
+    rxLoader.join();
+    if (txRet != 0 || rxRet != 0)
+    {
+        log.error("analyze: Cannot read %s or %s.", txPath, rxPath);
+        return 1;
+    }
+
+    long lo = LONG_MAX, hi = LONG_MIN;
+    for (const CompactRecorder::Record &rec : txRd)
+    {
+        if (rec.getFlow() == flow)
+        {
+            lo = std::min(lo, rec.pakSeq);
+            hi = std::max(hi, rec.pakSeq);
+        }
+    }
+    for (const CompactRecorder::Record &rec : rxRd)
+    {
+        lo = std::min(lo, rec.pakSeq);
+        hi = std::max(hi, rec.pakSeq);
+    }
+    if (lo > hi)
+    {
+        log.warning("analyze: No records in %s and %s.", txPath, rxPath);
+        return 0;
+    }
+
+    // build the indexes before the threads share them
+    txRd.seqRange(0, 0);
+    rxRd.seqRange(0, 0);
+
+    // every thread joins a contiguous range of sequence numbers
+    std::vector<Part> parts(threads);
+    std::vector<std::thread> workers;
+    long step = (hi - lo) / threads + 1;
+    for (int i = 0; i < threads; ++i)
+    {
+        parts[i].first = lo + step * i;
+        parts[i].last = i == threads - 1 ? hi + 1 : lo + step * (i + 1);
+        workers.emplace_back(joinMain, &txRd, &rxRd, &parts[i]);
+    }
+    Result reorder;
+    std::thread reorderer(reorderMain, &rxRd, &reorder);
+    for (auto &t : workers)
+    {
+        t.join();
+    }
+
+    long minForward = LONG_MAX, minReverse = LONG_MAX;
+    for (Part &part : parts)
+    {
+        minForward = std::min(minForward, part.res.minForward);
+        minReverse = std::min(minReverse, part.res.minReverse);
+    }
+    workers.clear();
+    for (int i = 0; i < threads; ++i)
+    {
+        workers.emplace_back(relativeMain, &parts[i], minForward,
+            minReverse);
+    }
+    for (auto &t : workers)
+    {
+        t.join();
+    }
+    reorderer.join();
+
+    for (Part &part : parts)
+    {
+        res.merge(part.res);
+    }
+    res.merge(reorder);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int ret;
+
+    log.message("This is UDPNetProbe Analyzer, Version %s", VERSION);
+
+    ret = parseArguments(argc, argv);
+    if (ret < 0)
+    {
+        return 0;
+    }
+    else if (ret > 0)
+    {
+        log.error("main: Not recoverable, exit.");
+        return 1;
+    }
+
+    Result total;
+    int runs = (argc - optind) / 2;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < runs; ++i)
+    {
+        const char *txPath = argv[optind + i * 2];
+        const char *rxPath = argv[optind + i * 2 + 1];
+        char name[32];
+        Result res;
+
+        snprintf(name, sizeof(name), "run %d", i + 1);
+        log.message("analyze[%s]: Joining %s and %s.", name, txPath, rxPath);
+        if (analyze(txPath, rxPath, res) != 0)
+        {
+            log.error("main: Cannot analyze run %d.", i + 1);
+            return 1;
+        }
+        print(name, res);
+        total.merge(res);
+    }
+    if (runs > 1)
+    {
+        print("total", total);
+    }
+    log.message("main: Analyzed %d run(s) in %.3lfs with %d thread(s).",
+        runs, std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count(), threads);
+
+    return 0;
+}
@@ -0,0 +1,398 @@
+#include <errno.h>
+#include <string.h>
+#include <netinet/udp.h>
+#include <linux/net_tstamp.h>
+#include <sys/mman.h>
+
+#include "Batch.hh"
+#include "Log.hh"
+
+SendBatch::SendBatch(int capacity, int slotLen):
+    buf(), packets(), iovs(), msgs(), msgPackets(), sentPackets(), cmsgs(),
+    base(nullptr), count(0), messages(0), gso(0), txtime(0), pool(nullptr),
+    poolLen(0), frames(0), frame(0), frameFirst(), frameSends(),
+    framePending(), zcNext(0), zeroCopied(0), copied(0),
+    capacity(capacity), slotLen(slotLen)
+{
+    buf = std::make_unique<char[]>((long)capacity * slotLen);
+    base = buf.get();
+    packets = std::make_unique<Packet[]>(capacity);
+    iovs = std::make_unique<iovec[]>(capacity);
+    msgs = std::make_unique<mmsghdr[]>(capacity);
+    msgPackets = std::make_unique<int[]>(capacity);
+    sentPackets = std::make_unique<int[]>(capacity);
+    cmsgs = std::make_unique<char[]>(capacity * CMSG_LEN_MAX);
+}
+
+SendBatch::~SendBatch()
+{
+    if (pool != nullptr)
+    {
+        munmap(pool, poolLen);
+    }
+}
+
+int SendBatch::enableGSO(int fd)
+{
+    int val = 0;
+    char errbuf[64];
+
+    // probe only: the segment size is attached to every message instead
+    if (setsockopt(fd, SOL_UDP, UDP_SEGMENT, &val, sizeof(val)) < 0)
+    {
+        log.warning("SendBatch::enableGSO: UDP GSO unavailable(%s).",
+            Log::strerror(errbuf));
+        return 1;
+    }
+    gso = 1;
+    return 0;
+}
+
+int SendBatch::enableTxTime(int fd, clockid_t clock)
+{
+    sock_txtime cfg;
+    char errbuf[64];
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.clockid = clock;
+    // etf reports packets it drops to the error queue
+    cfg.flags = SOF_TXTIME_REPORT_ERRORS;
+    if (setsockopt(fd, SOL_SOCKET, SO_TXTIME, &cfg, sizeof(cfg)) < 0)
+    {
+        log.warning("SendBatch::enableTxTime: SO_TXTIME unavailable(%s).",
+            Log::strerror(errbuf));
+        return 1;
+    }
+    txtime = 1;
+    return 0;
+}
+
+int SendBatch::enableZeroCopy(int fd, int frames)
+{
+    long frameLen = (long)capacity * slotLen;
+    int one = 1;
+    char errbuf[64];
+
+    if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0)
+    {
+        log.warning("SendBatch::enableZeroCopy: SO_ZEROCOPY unavailable"
+            "(%s).", Log::strerror(errbuf));
+        return 1;
+    }
+
+    // page-aligned frames, so no two of them share a page the kernel holds
+    frameLen = (frameLen + 4095) & ~4095L;
+    poolLen = frameLen * frames;
+    pool = (char*)mmap(nullptr, poolLen, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (pool == MAP_FAILED)
+    {
+        log.warning("SendBatch::enableZeroCopy: Cannot map %ld bytes(%s).",
+            poolLen, Log::strerror(errbuf));
+        pool = nullptr;
+        return 1;
+    }
+    if (mlock(pool, poolLen) < 0)
+    {
+        log.warning("SendBatch::enableZeroCopy: Cannot lock send buffers"
+            "(%s), check RLIMIT_MEMLOCK(ulimit -l).", Log::strerror(errbuf));
+    }
+
+    // slot addresses follow the frame, see `at`
+    this->frames = frames;
+    frame = 0;
+    frameFirst = std::make_unique<uint32_t[]>(frames);
+    frameSends = std::make_unique<int[]>(frames);
+    framePending = std::make_unique<int[]>(frames);
+    buf.reset();
+    base = pool;
+    count = 0;
+    return 0;
+}
+
+void SendBatch::complete(uint32_t lo, uint32_t hi, int copied)
+{
+    // ids wrap around at 2^32; all ranges in flight are far shorter
+    long n = (long)(uint32_t)(hi - lo) + 1;
+
+    for (int f = 0; f < frames; ++f)
+    {
+        if (framePending[f] == 0)
+        {
+            continue;
+        }
+        long first = (int32_t)(frameFirst[f] - lo);
+        long last = first + frameSends[f] - 1;
+        if (first < 0)
+        {
+            first = 0;
+        }
+        if (last >= n)
+        {
+            last = n - 1;
+        }
+        if (last >= first)
+        {
+            framePending[f] -= last - first + 1;
+        }
+    }
+    if (copied)
+    {
+        this->copied += n;
+    }
+    else
+    {
+        zeroCopied += n;
+    }
+}
+
+char* SendBatch::add(const sockaddr_in &dst, int len, uint64_t txTime)
+{
+    if (count >= capacity || len > slotLen)
+    {
+        return nullptr;
+    }
+
+    packets[count].dst = dst;
+    packets[count].len = len;
+    packets[count].txTime = txTime;
+    return at(count++);
+}
+
+// group queued packets starting from `first` into messages. return the
+// number of messages.
+int SendBatch::build(int first)
+{
+    int nmsg = 0;
+
+    for (int i = first; i < count; )
+    {
+        Packet &head = packets[i];
+        int segs = 1;
+
+        iovs[i].iov_base = at(i);
+        iovs[i].iov_len = head.len;
+        if (gso)
+        {
+            int maxSegs = MAX_GSO_BYTES / head.len;
+            if (maxSegs > MAX_GSO_SEGS)
+            {
+                maxSegs = MAX_GSO_SEGS;
+            }
+            while (i + segs < count && segs < maxSegs &&
+                packets[i + segs].len == head.len &&
+                packets[i + segs].dst.sin_addr.s_addr ==
+                    head.dst.sin_addr.s_addr &&
+                packets[i + segs].dst.sin_port == head.dst.sin_port &&
+                (!txtime || packets[i + segs].txTime == head.txTime))
+            {
+                iovs[i + segs].iov_base = at(i + segs);
+                iovs[i + segs].iov_len = head.len;
+                ++segs;
+            }
+        }
+
+        msghdr &hdr = msgs[nmsg].msg_hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.msg_name = &head.dst;
+        hdr.msg_namelen = sizeof(head.dst);
+        hdr.msg_iov = &iovs[i];
+        hdr.msg_iovlen = segs;
+        if (segs > 1 || txtime)
+        {
+            char *control = cmsgs.get() + nmsg * CMSG_LEN_MAX;
+            hdr.msg_control = control;
+            hdr.msg_controllen = (segs > 1 ? CMSG_SPACE(sizeof(uint16_t)) : 0) +
+                (txtime ? CMSG_SPACE(sizeof(uint64_t)) : 0);
+            memset(control, 0, hdr.msg_controllen);
+
+            cmsghdr *cm = CMSG_FIRSTHDR(&hdr);
+            if (segs > 1)
+            {
+                cm->cmsg_level = SOL_UDP;
+                cm->cmsg_type = UDP_SEGMENT;
+                cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+                *(uint16_t*)CMSG_DATA(cm) = head.len;
+                cm = CMSG_NXTHDR(&hdr, cm);
+            }
+            if (txtime)
+            {
+                cm->cmsg_level = SOL_SOCKET;
+                cm->cmsg_type = SCM_TXTIME;
+                cm->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+                memcpy(CMSG_DATA(cm), &head.txTime, sizeof(uint64_t));
+            }
+        }
+        msgPackets[nmsg++] = segs;
+        i += segs;
+    }
+
+    return nmsg;
+}
+
+int SendBatch::flush(int fd)
+{
+    char errbuf[64];
+    int sent = 0;
+    // zero-copy sends of this frame so far
+    int zc = 0;
+    // errno of a GSO message rejected with transmit times on, while it is
+    // not known yet which of the two the kernel took issue with
+    int gsoSuspect = 0;
+
+    messages = 0;
+    while (sent < count)
+    {
+        int nmsg = build(sent);
+        int done = 0;
+
+        while (done < nmsg)
+        {
+            int flags = frames > 0 ? MSG_ZEROCOPY : 0;
+            int ret = sendmmsg(fd, &msgs[done], nmsg - done, flags);
+            if (ret < 0 && flags != 0 && errno == ENOBUFS)
+            {
+                // out of socket option memory to track the pinned pages.
+                // copy this time.
+                ret = sendmmsg(fd, &msgs[done], nmsg - done, 0);
+                flags = 0;
+                if (ret > 0)
+                {
+                    copied += ret;
+                }
+            }
+            if (ret < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                else if (gso && msgPackets[done] > 1 &&
+                    (errno == EIO || errno == EINVAL))
+                {
+                    // the egress device cannot segment. regroup the rest of
+                    // the batch as plain datagrams, and stay that way. with
+                    // transmit times, EINVAL may be theirs: the next send
+                    // tells.
+                    gso = 0;
+                    if (txtime && errno == EINVAL)
+                    {
+                        gsoSuspect = errno;
+                        break;
+                    }
+                    log.warning("SendBatch::flush: GSO rejected(%s), "
+                        "disabled.", Log::strerror(errbuf));
+                    break;
+                }
+                else if (txtime && errno == EINVAL)
+                {
+                    // e.g. a clock the qdisc does not accept. send the rest
+                    // right away; the caller paces by itself from now on.
+                    log.warning("SendBatch::flush: Transmit time rejected"
+                        "(%s), disabled.", Log::strerror(errbuf));
+                    txtime = 0;
+                    if (gsoSuspect)
+                    {
+                        // it was not GSO after all
+                        gso = 1;
+                        gsoSuspect = 0;
+                    }
+                    break;
+                }
+                count = 0;
+                return -1;
+            }
+            if (gsoSuspect)
+            {
+                // plain datagrams with transmit times do go through
+                errno = gsoSuspect;
+                log.warning("SendBatch::flush: GSO rejected(%s), "
+                    "disabled.", Log::strerror(errbuf));
+                gsoSuspect = 0;
+            }
+            if (flags != 0)
+            {
+                zc += ret;
+            }
+            for (int i = done; i < done + ret; ++i)
+            {
+                sent += msgPackets[i];
+                sentPackets[messages++] = msgPackets[i];
+            }
+            done += ret;
+        }
+    }
+
+    if (frames > 0)
+    {
+        // the kernel numbers zero-copy sends per socket, starting at 0
+        frameFirst[frame] = zcNext;
+        frameSends[frame] = framePending[frame] = zc;
+        zcNext += zc;
+        frame = (frame + 1) % frames;
+        base = pool + poolLen / frames * frame;
+    }
+    count = 0;
+    return sent;
+}
+
+RecvBatch::RecvBatch(int capacity, int slotLen):
+    buf(), control(), addrs(), iovs(), msgs(), count(0), capacity(capacity),
+    slotLen(slotLen)
+{
+    buf = std::make_unique<char[]>((long)capacity * slotLen);
+    control = std::make_unique<char[]>(capacity * CONTROL_LEN);
+    addrs = std::make_unique<sockaddr_in[]>(capacity);
+    iovs = std::make_unique<iovec[]>(capacity);
+    msgs = std::make_unique<mmsghdr[]>(capacity);
+
+    for (int i = 0; i < capacity; ++i)
+    {
+        iovs[i].iov_base = data(i);
+        iovs[i].iov_len = slotLen;
+    }
+}
+
+int RecvBatch::setTimeout(int fd, int ms)
+{
+    timeval tv = {ms / 1000, (ms % 1000) * 1000};
+    char errbuf[64];
+
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0)
+    {
+        log.error("RecvBatch::setTimeout: setsockopt() failed(%s).",
+            Log::strerror(errbuf));
+        return 1;
+    }
+    return 0;
+}
+
+int RecvBatch::receive(int fd)
+{
+    for (int i = 0; i < capacity; ++i)
+    {
+        msghdr &hdr = msgs[i].msg_hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.msg_name = &addrs[i];
+        hdr.msg_namelen = sizeof(sockaddr_in);
+        hdr.msg_iov = &iovs[i];
+        hdr.msg_iovlen = 1;
+        hdr.msg_control = control.get() + i * CONTROL_LEN;
+        hdr.msg_controllen = CONTROL_LEN;
+    }
+
+    // MSG_WAITFORONE: block for the first datagram only, then take whatever
+    // else is already queued.
+    count = recvmmsg(fd, msgs.get(), capacity, MSG_WAITFORONE, nullptr);
+    if (count < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        {
+            count = 0;
+            return 0;
+        }
+        count = 0;
+        return -1;
+    }
+    return count;
+}
@@ -0,0 +1,247 @@
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <linux/filter.h>
+#include <linux/if_packet.h>
+#include <linux/net_tstamp.h>
+#include <net/ethernet.h>
+#include <net/if.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include "Capture.hh"
+#include "Log.hh"
+
+PacketRing::PacketRing(): fd(-1), map(nullptr), mapLen(0), block(0),
+    held(0), frames(), count(0)
+{
+}
+
+PacketRing::~PacketRing()
+{
+    if (map != nullptr)
+    {
+        munmap(map, mapLen);
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+}
+
+int PacketRing::open(const char *ifname, const sockaddr_in &sender, int port,
+    CompactRecorder::Clock clock)
+{
+    // offsets are from the IPv4 header(SOCK_DGRAM). accept unfragmented
+    // UDP from the sender's address and port to `port`.
+    uint32_t ports = (uint32_t)ntohs(sender.sin_port) << 16 | port;
+    sock_filter code[] = {
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 9),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 0, 8),
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 6),
+        BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x1fff, 6, 0),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 12),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ntohl(sender.sin_addr.s_addr),
+            0, 4),
+        BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0),
+        BPF_STMT(BPF_LD | BPF_W | BPF_IND, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ports, 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, SNAP_LEN),
+        BPF_STMT(BPF_RET | BPF_K, 0)
+    };
+    sock_fprog prog = {sizeof(code) / sizeof(code[0]), code};
+    tpacket_req3 req;
+    sockaddr_ll ll;
+    int version = TPACKET_V3;
+    int one = 1;
+    char errbuf[64];
+
+    memset(&ll, 0, sizeof(ll));
+    ll.sll_family = AF_PACKET;
+    ll.sll_protocol = htons(ETH_P_IP);
+    if ((ll.sll_ifindex = if_nametoindex(ifname)) == 0)
+    {
+        log.error("PacketRing::open: Unknown interface %s.", ifname);
+        return 1;
+    }
+
+    // protocol 0: nothing is queued before the filter is in place
+    if ((fd = socket(AF_PACKET, SOCK_DGRAM, 0)) < 0)
+    {
+        log.error("PacketRing::open: Cannot create packet socket(%s).",
+            Log::strerror(errbuf));
+        return 1;
+    }
+    if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &version,
+            sizeof(version)) < 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog,
+            sizeof(prog)) < 0)
+    {
+        log.error("PacketRing::open: Cannot set up packet socket(%s).",
+            Log::strerror(errbuf));
+        return 1;
+    }
+    // since linux 4.20; packets are checked one by one otherwise
+    setsockopt(fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &one, sizeof(one));
+    if (clock == CompactRecorder::Clock::HARDWARE)
+    {
+        int flags = SOF_TIMESTAMPING_RAW_HARDWARE;
+        if (setsockopt(fd, SOL_PACKET, PACKET_TIMESTAMP, &flags,
+            sizeof(flags)) < 0)
+        {
+            log.warning("PacketRing::open: Hardware timestamps "
+                "unavailable(%s).", Log::strerror(errbuf));
+        }
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = BLOCK_SIZE;
+    req.tp_block_nr = BLOCK_NR;
+    req.tp_frame_size = FRAME_SIZE;
+    req.tp_frame_nr = (long)BLOCK_SIZE * BLOCK_NR / FRAME_SIZE;
+    // hand over partly filled blocks after 1ms(the shortest timeout), so
+    // a slow probe is not held back until a whole block is full. ACKs, and
+    // the receiver dwell time, still wait for it.
+    req.tp_retire_blk_tov = 1;
+    if (setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0)
+    {
+        log.error("PacketRing::open: Cannot set up TPACKET_V3 ring(%s).",
+            Log::strerror(errbuf));
+        return 1;
+    }
+    mapLen = (long)BLOCK_SIZE * BLOCK_NR;
+    map = (char*)mmap(nullptr, mapLen, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_LOCKED, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        // MAP_LOCKED is best effort
+        map = (char*)mmap(nullptr, mapLen, PROT_READ | PROT_WRITE,
+            MAP_SHARED, fd, 0);
+    }
+    if (map == MAP_FAILED)
+    {
+        log.error("PacketRing::open: Cannot map ring(%s).",
+            Log::strerror(errbuf));
+        map = nullptr;
+        return 1;
+    }
+    // a block holds at most this many(minimum sized) packets
+    frames = std::make_unique<Frame[]>(BLOCK_SIZE / 64);
+
+    if (bind(fd, (sockaddr*)&ll, sizeof(ll)) < 0)
+    {
+        log.error("PacketRing::open: Cannot bind to %s(%s).", ifname,
+            Log::strerror(errbuf));
+        return 1;
+    }
+    return 0;
+}
+
+int PacketRing::mute(int fd)
+{
+    sock_filter code[] = {
+        BPF_STMT(BPF_RET | BPF_K, 0)
+    };
+    sock_fprog prog = {1, code};
+    char errbuf[64];
+
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog,
+        sizeof(prog)) < 0)
+    {
+        log.warning("PacketRing::mute: setsockopt() failed(%s).",
+            Log::strerror(errbuf));
+        return 1;
+    }
+    return 0;
+}
+
+void PacketRing::release()
+{
+    if (held)
+    {
+        tpacket_block_desc *pbd =
+            (tpacket_block_desc*)(map + (long)block * BLOCK_SIZE);
+        __atomic_store_n(&pbd->hdr.bh1.block_status, TP_STATUS_KERNEL,
+            __ATOMIC_RELEASE);
+        block = (block + 1) % BLOCK_NR;
+        held = 0;
+    }
+    count = 0;
+}
+
+int PacketRing::receive(int ms)
+{
+    release();
+
+    tpacket_block_desc *pbd =
+        (tpacket_block_desc*)(map + (long)block * BLOCK_SIZE);
+    if (!(__atomic_load_n(&pbd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) &
+        TP_STATUS_USER))
+    {
+        pollfd pfd = {fd, POLLIN | POLLERR, 0};
+        if (poll(&pfd, 1, ms) < 0)
+        {
+            return errno == EINTR ? 0 : -1;
+        }
+        if (!(__atomic_load_n(&pbd->hdr.bh1.block_status,
+            __ATOMIC_ACQUIRE) & TP_STATUS_USER))
+        {
+            return 0;
+        }
+    }
+    held = 1;
+
+    tpacket3_hdr *ppd =
+        (tpacket3_hdr*)((char*)pbd + pbd->hdr.bh1.offset_to_first_pkt);
+    for (unsigned i = 0; i < pbd->hdr.bh1.num_pkts; ++i,
+        ppd = (tpacket3_hdr*)((char*)ppd + ppd->tp_next_offset))
+    {
+        sockaddr_ll *sll =
+            (sockaddr_ll*)((char*)ppd + TPACKET_ALIGN(sizeof(*ppd)));
+        const uint8_t *pkt = (const uint8_t*)ppd + ppd->tp_net;
+        int ihl = (pkt[0] & 0xf) * 4;
+        int snap = ppd->tp_snaplen;
+
+        if (sll->sll_pkttype == PACKET_OUTGOING || snap < ihl + 8)
+        {
+            continue;
+        }
+
+        const iphdr *ip = (const iphdr*)pkt;
+        const udphdr *udp = (const udphdr*)(pkt + ihl);
+        Frame &frame = frames[count++];
+        frame.data = (const char*)udp + sizeof(udphdr);
+        frame.len = ntohs(udp->len) - (int)sizeof(udphdr);
+        if (frame.len > snap - ihl - (int)sizeof(udphdr))
+        {
+            frame.len = snap - ihl - sizeof(udphdr);
+        }
+        frame.from.sin_family = AF_INET;
+        frame.from.sin_port = udp->source;
+        frame.from.sin_addr.s_addr = ip->saddr;
+        frame.ts.tv_sec = ppd->tp_sec;
+        frame.ts.tv_nsec = ppd->tp_nsec;
+        frame.clock = ppd->tp_status & TP_STATUS_TS_RAW_HARDWARE ?
+            CompactRecorder::Clock::HARDWARE :
+            CompactRecorder::Clock::SOFTWARE;
+    }
+    return count;
+}
+
+int PacketRing::getStats(long &packets, long &drops)
+{
+    tpacket_stats_v3 st;
+    socklen_t len = sizeof(st);
+
+    if (getsockopt(fd, SOL_PACKET, PACKET_STATISTICS, &st, &len) < 0)
+    {
+        return 1;
+    }
+    packets = st.tp_packets;
+    drops = st.tp_drops;
+    return 0;
+}
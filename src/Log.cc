@@ -1,3 +1,7 @@
+#include <errno.h>
+#include <sys/uio.h>
+
+#include <algorithm>
 #include <memory>
 
 #include "Log.hh"
@@ -7,14 +11,21 @@ Log log;
 const char Log::PREFIX_FMT[] = "[%9s]{%5u}(%14.6lf): ";
 
 Log::FixSizeMemoryPool::FixSizeMemoryPool(int lenLevel, int countLevel): 
-    buf(), seq(0), len(1 << lenLevel),
+    buf(), busy(), seq(0), len(1 << lenLevel),
     count(1 << countLevel) 
 {
     buf = std::make_unique<char[]>(1 << (lenLevel + countLevel));
+    busy = std::make_unique<std::atomic<char>[]>(count);
 }
 
 Log::~Log()
 {
+    long n = getDropped();
+
+    if (n > 0)
+    {
+        longWarning("Log: %ld messages dropped on full buffer pools.", n);
+    }
 	toExit = 1;
 	worker->join();
 }
@@ -22,63 +33,173 @@ Log::~Log()
 char* Log::FixSizeMemoryPool::get()
 {
     int pos = seq++ & (count - 1);
+
+    if (busy[pos].exchange(1, std::memory_order_acquire))
+    {
+        return nullptr;
+    }
     return buf.get() + (pos * len);
 }
 
-void Log::Worker::main(Log *log)
+char* Log::acquire(FixSizeMemoryPool *&pool)
 {
-    do
-	{
-        if (!log->sem.tryIssue(10000))
-		{
-			continue;
-		}
+    char *buf;
 
-        do
+    while ((buf = pool->get()) == nullptr)
+    {
+        switch (fullPolicy)
         {
-            log->pendLock.writeLock();
-            auto item = log->pending.front();
-            log->pending.pop_front();
-            log->pendLock.writeRelease();
+        case FullPolicy::BLOCK:
+            // the slot has been pushed already(or is about to be), so the
+            // worker is awake and will release it
+            std::this_thread::yield();
+            break;
+        case FullPolicy::FALLBACK:
+            if (pool != &longBuf)
+            {
+                pool = &longBuf;
+                break;
+            }
+            // fall through
+        case FullPolicy::DROP:
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+    }
+    return buf;
+}
+
+int Log::formatEntry(char *out, char *buf)
+{
+    DeferredEntry *entry = (DeferredEntry*)buf;
+    double ts = (entry->ts.tv_sec - tst.tv_sec) + 
+        (entry->ts.tv_nsec - tst.tv_nsec) / 1000000000.0;
+
+    sprintf(out, PREFIX_FMT, entry->prefix, entry->tid, ts);
+    entry->format(out + PREFIX_LEN, entry->len - PREFIX_LEN - 2, entry->fmt,
+        buf + sizeof(DeferredEntry));
 
-            int nleft = item.second;
-            char *bufp = item.first;
-            int nwritten;
+    int slen = strlen(out);
+    out[slen] = '\n';
+    return slen + 1;
+}
+
+void Log::writeAll(iovec *iov, int niov)
+{
+    while (niov > 0)
+    {
+        ssize_t nwritten = writev(fd, iov, niov);
 
-            while (nleft > 0)
+        if (nwritten < 0)
+        {
+            if (errno == EINTR || 
+                errno == EAGAIN || 
+                errno == EWOULDBLOCK)
+            {    
+                continue;
+            }
+            break;
+        }
+        while (niov > 0 && (size_t)nwritten >= iov->iov_len)
+        {
+            nwritten -= iov->iov_len;
+            ++iov;
+            --niov;
+        }
+        if (niov > 0)
+        {
+            iov->iov_base = (char*)iov->iov_base + nwritten;
+            iov->iov_len -= nwritten;
+        }
+    }
+}
+
+void Log::drain(std::vector<PendingEntry> &batch)
+{
+    iovec iov[IOV_BATCH];
+    int niov = 0;
+    int used = 0;
+    size_t first = 0;
+
+    PendingEntry next;
+
+    // what is issued while we write is left for the next round
+    while (pending.pop(next))
+    {
+        batch.push_back(next);
+    }
+
+    for (size_t i = 0; i <= batch.size(); ++i)
+    {
+        if (i == batch.size() || niov == IOV_BATCH ||
+            (batch[i].len < 0 && used + batch[i].pool->len > stagingLen))
+        {
+            writeAll(iov, niov);
+            for (; first < i; ++first)
             {
-                if ((nwritten = write(log->fd, item.first, nleft)) 
-                    <= 0)
+                if (batch[first].len >= 0)
                 {
-                    if (errno == EINTR || 
-                        errno == EAGAIN || 
-                        errno == EWOULDBLOCK)
-                    {    
-                        continue;
-                    }
-                    else
-                    {
-						nwritten = 0;
-                        break;
-                    }
+                    batch[first].pool->release(batch[first].buf);
                 }
-                nleft -= nwritten;
-                bufp += nwritten;
             }
+            niov = 0;
+            used = 0;
+            if (i == batch.size())
+            {
+                break;
+            }
+        }
+
+        PendingEntry &entry = batch[i];
+        if (entry.len < 0)
+        {
+            // the slot is free again as soon as the line is formatted
+            char *out = staging.get() + used;
+            int len = formatEntry(out, entry.buf);
+            entry.pool->release(entry.buf);
+            iov[niov++] = {out, (size_t)len};
+            used += len;
+        }
+        else
+        {
+            iov[niov++] = {entry.buf, (size_t)entry.len};
         }
-        while (log->sem.tryIssue(0));
+    }
+    batch.clear();
+}
+
+void Log::Worker::main(Log *log)
+{
+    std::vector<PendingEntry> batch;
+    PendingEntry first;
+
+    batch.reserve(log->shortBuf.count + log->longBuf.count);
+    do
+	{
+        if (log->pending.pop(first, 10000))
+		{
+            batch.push_back(first);
+            log->drain(batch);
+		}
     }
 	while (!log->toExit);
+
+    // catch what was issued while exiting
+    log->drain(batch);
 }
 
 Log::Log(int fd, int verboseLevel, int shortBufLenLevel, 
     int shortBufCountLevel, int longBufLenLevel, int longBufCountLevel): 
     fd(fd), verboseLevel(verboseLevel), 
     worker(nullptr), shortBuf(shortBufLenLevel, shortBufCountLevel),
-    longBuf(longBufLenLevel, longBufCountLevel), pendLock(), pending(), sem(0),
-    prefixLock(), prefixes(), toExit(0)
+    longBuf(longBufLenLevel, longBufCountLevel),
+    pending(std::max(shortBufCountLevel, longBufCountLevel) + 1),
+    prefixLock(), prefixes(), deferred(1), staging(),
+    stagingLen(std::max((int)STAGING_LEN, longBuf.len)),
+    fullPolicy(FullPolicy::FALLBACK), dropped(0), toExit(0)
 {
     clock_gettime(CLOCK_REALTIME_COARSE, &tst);
+    staging = std::make_unique<char[]>(stagingLen);
     
     time_t rawtime = tst.tv_sec;
     struct tm timeinfo;
@@ -1,14 +1,25 @@
+#include "Log.hh"
 #include "Util.hh"
 
 #include <map>
 
 std::map<int, const char*> typeText;
 
+static void print(const CompactRecorder::Record &rec)
+{
+    printf("%12ld%12s    %ld.%09d    %s\n", rec.pakSeq,
+        typeText[rec.getType()], rec.sec, rec.nanosec,
+        CompactRecorder::clockName(rec.getClock()));
+}
+
 int main(int argc, char **argv)
 {
     if (argc < 2)
     {
-        printf("Usage: %s [file]", argv[0]);
+        printf("Usage: %s [file] [[first seq] [last seq]]\n"
+            "  Print all records in file order, or the records of packets\n"
+            "  [first seq] to [last seq] ordered by sequence number.\n",
+            argv[0]);
         return 0;
     }
 
@@ -21,12 +32,41 @@ int main(int argc, char **argv)
     RecordReader rd;
     CompactRecorder::Record rec;
 
-    printf("%12s%12s    %s\n", "Seq", "Msg Type", "Timestamp");
-    rd.init(argv[1]);
-    while (rd.next(rec) == 0)
+    if (rd.init(argv[1]) != 0)
+    {
+        return 1;
+    }
+    if (rd.getHeader() != nullptr)
+    {
+        const CompactRecorder::FileHeader *hdr = rd.getHeader();
+        log.message("Record file v%d written on %s at %ld.%09ld, clock %s: "
+            "%s", hdr->version, hdr->host, (long)(hdr->created / 1000000000L),
+            (long)(hdr->created % 1000000000L),
+            CompactRecorder::clockName((CompactRecorder::Clock)hdr->clock),
+            hdr->params);
+    }
+    printf("%12s%12s    %-24s%s\n", "Seq", "Msg Type", "Timestamp", "Clock");
+    if (argc > 2)
+    {
+        long first = atol(argv[2]);
+        long last = argc > 3 ? atol(argv[3]) : first;
+
+        if (rd.load() != 0)
+        {
+            return 1;
+        }
+        auto range = rd.seqRange(first, last + 1);
+        for (auto it = range.first; it != range.second; ++it)
+        {
+            print(**it);
+        }
+    }
+    else
     {
-        printf("%12ld%12s    %ld.%09d\n", rec.pakSeq, typeText[rec.type],
-            rec.sec, rec.nanosec);
+        while (rd.next(rec) == 0)
+        {
+            print(rec);
+        }
     }
 
     return 0;
@@ -0,0 +1,173 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "Log.hh"
+#include "Metrics.hh"
+#include "Util.hh"
+
+const char Metrics::MAGIC[] = "UNPSTAT";
+
+// counters nobody watches, until `create` is called
+static Metrics::Segment privateSegment;
+
+Metrics::Metrics(): seg(&privateSegment), owner(0), name()
+{
+}
+
+Metrics::~Metrics()
+{
+    if (seg != &privateSegment)
+    {
+        munmap(seg, sizeof(Segment));
+    }
+    if (owner)
+    {
+        shm_unlink(name);
+    }
+}
+
+int Metrics::create(const char *name, const char *program)
+{
+    char errbuf[64];
+    int fd;
+    Segment *mapped;
+
+    snprintf(this->name, sizeof(this->name), "/%s", name);
+    // never take over the counters of another probe
+    if ((fd = shm_open(this->name, O_RDWR | O_CREAT | O_EXCL, 0644)) < 0)
+    {
+        if (errno == EEXIST)
+        {
+            log.error("Metrics::create: %s exists, in use by another probe "
+                "or left behind by one that crashed(remove /dev/shm%s).",
+                this->name, this->name);
+            return 1;
+        }
+        log.error("Metrics::create: Cannot open %s(%s).", this->name,
+            Log::strerror(errbuf));
+        return 1;
+    }
+    if (ftruncate(fd, sizeof(Segment)) < 0 ||
+        (mapped = (Segment*)mmap(nullptr, sizeof(Segment),
+            PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+    {
+        log.error("Metrics::create: Cannot map %s(%s).", this->name,
+            Log::strerror(errbuf));
+        close(fd);
+        shm_unlink(this->name);
+        return 1;
+    }
+    close(fd);
+    owner = 1;
+
+    // the object is zero-filled, which is what the atomics start from
+    Header &hdr = mapped->header;
+    hdr.version = VERSION_2;
+    hdr.pid = getpid();
+    hdr.created = getNanoTime();
+    strncpy(hdr.program, program, sizeof(hdr.program) - 1);
+    // readers check the magic last
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(hdr.magic, MAGIC, sizeof(hdr.magic));
+    seg = mapped;
+    return 0;
+}
+
+int Metrics::attach(const char *name)
+{
+    char errbuf[64];
+    int fd;
+    Segment *mapped;
+
+    snprintf(this->name, sizeof(this->name), "/%s", name);
+    if ((fd = shm_open(this->name, O_RDONLY, 0)) < 0)
+    {
+        log.error("Metrics::attach: Cannot open %s(%s).", this->name,
+            Log::strerror(errbuf));
+        return 1;
+    }
+    mapped = (Segment*)mmap(nullptr, sizeof(Segment), PROT_READ, MAP_SHARED,
+        fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED)
+    {
+        log.error("Metrics::attach: Cannot map %s(%s).", this->name,
+            Log::strerror(errbuf));
+        return 1;
+    }
+    if (memcmp(mapped->header.magic, MAGIC, sizeof(MAGIC)) != 0 ||
+        mapped->header.version != VERSION_2)
+    {
+        log.error("Metrics::attach: %s is not a metrics segment of this "
+            "version.", this->name);
+        munmap(mapped, sizeof(Segment));
+        return 1;
+    }
+    seg = mapped;
+    return 0;
+}
+
+Metrics::Slot* Metrics::getSlot()
+{
+    static thread_local Metrics *owner = nullptr;
+    static thread_local Slot *slot = nullptr;
+    static thread_local Slot unpublished;
+
+    if (owner != this)
+    {
+        int id = seg->header.slotCount.fetch_add(1);
+        if (id >= MAX_SLOTS)
+        {
+            log.warning("Metrics::getSlot: More than %d counting threads, "
+                "counts of this thread not published.", (int)MAX_SLOTS);
+            slot = &unpublished;
+        }
+        else
+        {
+            slot = &seg->slots[id];
+        }
+        owner = this;
+    }
+    return slot;
+}
+
+void Metrics::read(Snapshot &snap)
+{
+    int count = seg->header.slotCount.load(std::memory_order_acquire);
+
+    memset(&snap, 0, sizeof(snap));
+    for (int i = 0; i < count && i < MAX_SLOTS; ++i)
+    {
+        Slot &slot = seg->slots[i];
+        Snapshot copy;
+        unsigned before, after;
+
+        do
+        {
+            before = slot.seq.load(std::memory_order_acquire);
+            for (int j = 0; j < COUNTERS; ++j)
+            {
+                copy.counters[j] =
+                    slot.counters[j].load(std::memory_order_relaxed);
+            }
+            for (int j = 0; j < RTT_BUCKETS; ++j)
+            {
+                copy.rtt[j] = slot.rtt[j].load(std::memory_order_relaxed);
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            after = slot.seq.load(std::memory_order_relaxed);
+        } while ((before & 1) || before != after);
+
+        for (int j = 0; j < COUNTERS; ++j)
+        {
+            snap.counters[j] += copy.counters[j];
+        }
+        for (int j = 0; j < RTT_BUCKETS; ++j)
+        {
+            snap.rtt[j] += copy.rtt[j];
+        }
+    }
+}
@@ -0,0 +1,115 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+
+#include "Log.hh"
+#include "Pacer.hh"
+
+Pacer::Pacer(long spinNs): spinNs(spinNs), error()
+{
+    // wake up as close to the requested time as the kernel can
+    prctl(PR_SET_TIMERSLACK, 1UL, 0, 0, 0);
+}
+
+long Pacer::clockOffset(clockid_t clock)
+{
+    timespec ts;
+
+    // bracket the sample with two monotonic readings
+    long before = now();
+    clock_gettime(clock, &ts);
+    long after = now();
+    return ts.tv_sec * 1000000000L + ts.tv_nsec - (before + after) / 2;
+}
+
+int Pacer::setMaxRate(int fd, double bytesPerSec)
+{
+    unsigned long rate = bytesPerSec;
+    unsigned int rate32 = rate > 0xffffffffUL ? 0xffffffffU : rate;
+    char errbuf[64];
+
+    // 64-bit rates are accepted since linux 4.20
+    if (setsockopt(fd, SOL_SOCKET, SO_MAX_PACING_RATE, &rate, 
+            sizeof(rate)) < 0 &&
+        setsockopt(fd, SOL_SOCKET, SO_MAX_PACING_RATE, &rate32, 
+            sizeof(rate32)) < 0)
+    {
+        log.warning("Pacer::setMaxRate: SO_MAX_PACING_RATE unavailable"
+            "(%s).", Log::strerror(errbuf));
+        return 1;
+    }
+    return 0;
+}
+
+int Pacer::parseRate(const char *str, int pakSize, double &pps)
+{
+    static const struct
+    {
+        const char *suffix;
+        double scale;
+        int bits;
+    } units[] = {
+        {"", 1, 0}, {"pps", 1, 0}, {"kpps", 1e3, 0}, {"Mpps", 1e6, 0},
+        {"bps", 1, 1}, {"kbps", 1e3, 1}, {"Mbps", 1e6, 1}, {"Gbps", 1e9, 1}
+    };
+    char *end;
+    double val = strtod(str, &end);
+
+    if (end == str || !(val > 0))
+    {
+        return 1;
+    }
+    for (auto &unit : units)
+    {
+        if (strcmp(end, unit.suffix) == 0)
+        {
+            pps = val * unit.scale;
+            if (unit.bits)
+            {
+                pps /= pakSize * 8.0;
+            }
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void Pacer::waitUntil(long deadline)
+{
+    long left = deadline - now();
+
+    if (left > spinNs)
+    {
+        timespec ts;
+        long wake = deadline - spinNs;
+        ts.tv_sec = wake / 1000000000L;
+        ts.tv_nsec = wake % 1000000000L;
+        if (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 
+            nullptr) == EINTR)
+        {
+            // let the caller see what the signal changed
+            return;
+        }
+    }
+    while (now() < deadline)
+    {
+    #if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+    #endif
+    }
+}
+
+void Pacer::report(const char *name) const
+{
+    if (error.count() == 0)
+    {
+        return;
+    }
+    log.message("pacer[%s]: %ld sends, late by(us) p50 %.1lf p90 %.1lf "
+        "p99 %.1lf p99.9 %.1lf max %.1lf mean %.1lf.", name, error.count(),
+        error.percentile(0.5) / 1e3, error.percentile(0.9) / 1e3,
+        error.percentile(0.99) / 1e3, error.percentile(0.999) / 1e3,
+        error.getMax() / 1e3, error.mean() / 1e3);
+}
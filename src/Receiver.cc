@@ -1,4 +1,6 @@
 #include <arpa/inet.h>
+#include <limits.h>
+#include <linux/filter.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -8,11 +10,28 @@
 #include <chrono>
 #include <thread>
 
+#include "Batch.hh"
+#include "Capture.hh"
 #include "Log.hh"
+#include "Metrics.hh"
+#include "Runtime.hh"
+#include "SPSCQueue.hh"
+#include "Stats.hh"
+#include "Timestamp.hh"
+#include "Uring.hh"
 #include "Util.hh"
 
 static char usage[] = 
     "Usage: %s [OPTIONS] \n"
+    "  -a [packets][:us]\n"
+    "    Acknowledge every DATA packet, but in selective ACKs of up to\n"
+    "    [packets](at most 64) consecutive sequence numbers, carrying a\n"
+    "    receive bitmap and the times of every packet. An ACK is sent when\n"
+    "    it is full, [us] after its first packet was read, or when the\n"
+    "    next packet does not fit in. -n and the ACK ratios of a test plan\n"
+    "    are ignored. Only the first packet of an ACK gets a kernel\n"
+    "    timestamp in the compact performance log.\n"
+    "    Default: off; [packets] 64 and [us] 1000 if left out\n"
     "  -b [IP]\n"
     "    Set the source address to [IP].\n"
     "    Default: Let the system to determine.\n"
@@ -20,31 +39,107 @@ static char usage[] =
     "    Connect to [IP].\n"
     "  -h\n"
     "    Display this message and quit.\n"
+    "  -i [interface]\n"
+    "    Take DATA packets from a TPACKET_V3 capture ring on [interface]\n"
+    "    (e.g. lo or eth0) instead of the UDP socket, timestamped by the\n"
+    "    kernel(or the NIC with -t hardware). Packets are handed over in\n"
+    "    blocks, which adds up to 1 ms to the receiver dwell time. Needs\n"
+    "    CAP_NET_RAW.\n"
+    "  -m [workers][:steer]\n"
+    "    Receive DATA on [workers] SO_REUSEPORT sockets, one thread each.\n"
+    "    [steer] is seq(spread packets by sequence number, so that a\n"
+    "    single flow uses all workers) or cpu(every worker takes the\n"
+    "    packets of the CPU it runs on, pin with -O cpus=). Packets are\n"
+    "    merged back into order of arrival(of kernel timestamps, or of\n"
+    "    sequence number without them) before they are ACKed, which can\n"
+    "    hold an ACK for up to 50 us.\n"
+    "    Default: 1:seq\n"
+    "  -M [name]\n"
+    "    Publish live counters as shared memory object [name], for\n"
+    "    udpnetprobe-stat [name] to watch.\n"
+    "    Default: none(not published)\n"
     "  -n [num]\n"
-    "    ACK every [num]-th packet.\n"
+    "    ACK every [num]-th packet, unless the test plan of the Sender says\n"
+    "    otherwise.\n"
     "    Default: 1\n"
+    "  -O [profile]\n"
+    "    Tune the host for low jitter. [profile] is a comma separated list\n"
+    "    of cpus=[list](pin the probe threads in turn to the CPUs of [list],\n"
+    "    e.g. 2-3:6), node=[node](keep memory and unpinned threads on NUMA\n"
+    "    node [node]), fifo[=prio](SCHED_FIFO, priority 50 by default),\n"
+    "    busypoll=[us](SO_BUSY_POLL) and mlock(lock all memory). What took\n"
+    "    effect is logged at startup.\n"
     "  -p [port] (REQUIRED)\n"
     "    Connect to [port].\n"
+    "  -r [num]\n"
+    "    Receive up to [num] datagrams per system call.\n"
+    "    Default: 64\n"
+    "  -t [clock]\n"
+    "    Timestamp compact performance log records with [clock], one of\n"
+    "    coarse(CLOCK_REALTIME_COARSE), realtime(CLOCK_REALTIME), software\n"
+    "    (kernel SO_TIMESTAMPING) or hardware(NIC SO_TIMESTAMPING, falls\n"
+    "    back to software per packet). The clock of every record is logged.\n"
+    "    Default: coarse\n"
+    "  -u\n"
+    "    Receive, acknowledge and send START instructions from a single\n"
+    "    thread on an io_uring, with a multishot receive into registered\n"
+    "    buffers and an SQPOLL kernel thread where the kernel allows. Falls\n"
+    "    back to the socket threads if io_uring is unavailable.\n"
+    "  -V [level]\n"
+    "    Print verbose messages up to [level], including per-packet traces\n"
+    "    at level 1. Messages are formatted by the logging thread.\n"
+    "    Default: 0(disabled)\n"
     "  -v\n"
     "    Display version information.\n"
     "  -w [path] (default none(no output))\n"
     "    Print compact performance log to [path]. Print to stdout if [path]\n"
     "    is \"-\".\n";
 
+static const int MAX_WORKERS = 16;
+
 static sockaddr_in addr = {0};
 static sockaddr_in svaddr = {0};
 static CompactRecorder rec;
 static int num = 1;
+static int recvBatch = 64;
+static const char *capture;
+static int useUring;
+static int workers = 1;
+static int steerCpu;
+// packets per selective ACK, 0 if off
+static int aggregate;
+static long aggregateNs = 1000000;
+static Runtime runtime;
+static const char *metricsName;
+static Metrics metrics;
+static CompactRecorder::Clock recClock = CompactRecorder::Clock::COARSE;
 
 static int parseArguments(int argc, char **argv)
 {
     char c;
     int ret;
     
-    while ((c = getopt(argc, argv, "b:c:hn:p:vw:")) != EOF)
+    while ((c = getopt(argc, argv, "a:b:c:hi:M:m:n:O:p:r:t:uV:vw:")) != EOF)
     {
         switch (c)
         {
+        case 'a':
+        {
+            char *us = strchr(optarg, ':');
+            aggregate = us == optarg ? (int)SackMessage::MAX_PACKETS : 
+                atoi(optarg);
+            if (us != nullptr)
+            {
+                aggregateNs = atol(us + 1) * 1000;
+            }
+            if (aggregate < 1 || aggregate > SackMessage::MAX_PACKETS)
+            {
+                log.error("parseArguments: Packets per ACK %d out of range "
+                    "[1, %d].", aggregate, (int)SackMessage::MAX_PACKETS);
+                return 1;
+            }
+            break;
+        }
         case 'b':
             if (inet_aton(optarg, &addr.sin_addr) == 0)
             {
@@ -60,15 +155,58 @@ static int parseArguments(int argc, char **argv)
             }
             break;
         case 'h':
-            log.message(usage, argv[0]);
+            log.longMessage(usage, argv[0]);
             return -1;
             break;
+        case 'i':
+            capture = optarg;
+            break;
+        case 'M':
+            metricsName = optarg;
+            break;
+        case 'm':
+        {
+            char *steer = strchr(optarg, ':');
+            workers = atoi(optarg);
+            if (steer != nullptr && strcmp(steer + 1, "cpu") == 0)
+            {
+                steerCpu = 1;
+            }
+            else if (steer != nullptr && strcmp(steer + 1, "seq") != 0)
+            {
+                log.error("parseArguments: Unknown steering %s", steer + 1);
+                return 1;
+            }
+            break;
+        }
         case 'n':
             num = atoi(optarg);
             break;
+        case 'O':
+            if (runtime.parse(optarg) != 0)
+            {
+                return 1;
+            }
+            break;
         case 'p':
             svaddr.sin_port = htons(atoi(optarg));
             break;
+        case 'r':
+            recvBatch = atoi(optarg);
+            break;
+        case 't':
+            if (CompactRecorder::parseClock(optarg, recClock) != 0)
+            {
+                log.error("parseArguments: Unknown clock %s", optarg);
+                return 1;
+            }
+            break;
+        case 'u':
+            useUring = 1;
+            break;
+        case 'V':
+            log.setVerboseLevel(atoi(optarg));
+            break;
         case 'v':
             log.message("Version %s\n", VERSION);
             return -1;
@@ -97,66 +235,390 @@ static int parseArguments(int argc, char **argv)
         log.error("parseArguments: Server port not specified.");
         return 3;
     }
+    if (useUring && capture != nullptr)
+    {
+        log.error("parseArguments: -i and -u are mutually exclusive.");
+        return 4;
+    }
+    if (workers < 1 || workers > MAX_WORKERS)
+    {
+        log.error("parseArguments: Number of workers %d out of range "
+            "[1, %d].", workers, (int)MAX_WORKERS);
+        return 4;
+    }
+    if (workers > 1 && (useUring || capture != nullptr))
+    {
+        log.error("parseArguments: -m is for the socket threads only.");
+        return 4;
+    }
+    // receive time deltas must fit into an int
+    if (aggregateNs < 1000 || aggregateNs > 1000000000L)
+    {
+        log.error("parseArguments: ACK delay %ldus out of range "
+            "[1, 1000000].", aggregateNs / 1000);
+        return 4;
+    }
+    if (recvBatch < 1 || recvBatch > 1024)
+    {
+        log.error("parseArguments: Receive batch size %d out of range "
+            "[1, 1024].", recvBatch);
+        return 4;
+    }
 
     return 0;
 }
 
-static long recvBuf[65536 / sizeof(long)], sendBuf[65536 / sizeof(long)];
-static Message *rmsg = (Message*)recvBuf, *smsg = (Message*)sendBuf;
+static long sendBuf[65536 / sizeof(long)];
+static Message *smsg = (Message*)sendBuf;
+static AckMessage *sack = (AckMessage*)sendBuf;
 static int silent;
 static int toAbort;
 static int started;
-static RWLock queueLock;
-static std::list<long> recvQueue;
+// a DATA packet waiting to be acknowledged
+struct AckRequest
+{
+    long seq;
+    long echoTime;
+    long recvTime;
+    int phase;
+    int ackRatio;
+    // when the receive thread read it
+    long readTime;
+    // `recvTime` is the kernel timestamp of the packet alone
+    int stamped;
+};
 
-void sendMain(int fd)
+static SPSCQueue<AckRequest> recvQueue(16);
+
+// with -m, every worker queues to sendMain on its own. the first one
+// takes recvQueue.
+struct WorkerQueue
+{
+    SPSCQueue<AckRequest> queue;
+
+    WorkerQueue(): queue(12)
+    {
+    }
+};
+
+static WorkerQueue workerQueues[MAX_WORKERS - 1];
+static SPSCQueue<AckRequest> *queues[MAX_WORKERS] = {&recvQueue};
+
+// merge of the worker queues into order of arrival. every queue has at most
+// one request taken out(its head), and the first head goes first once
+// every queue has a head to compare it with, or its worker is blocked on an
+// empty socket, or it has waited MERGE_DELAY_NS for the others.
+static const long MERGE_DELAY_NS = 50000;
+
+// worker is waiting for its socket. whatever it gets next arrives later
+// than what is queued, barring packets arriving right now.
+static std::atomic<int> idle[MAX_WORKERS];
+
+static AckRequest heads[MAX_WORKERS];
+static int hasHead[MAX_WORKERS];
+static int mergeTurn;
+
+// order of the DATA packets, in the order they are ACKed
+static SeqTracker arrivals;
+
+// whether `a` arrived before `b`. without kernel timestamps every packet
+// of a recvmmsg() batch has the time of the call, which does not tell the
+// packets of two workers apart, so the sequence number decides.
+static inline int arrivedBefore(const AckRequest &a, const AckRequest &b)
+{
+    if (a.stamped && b.stamped && a.recvTime != b.recvTime)
+    {
+        return a.recvTime < b.recvTime;
+    }
+    return a.seq < b.seq;
+}
+
+// the next request in order of arrival. wait up to `us` microseconds for
+// one. return 0 if there is none.
+static int mergeNext(AckRequest &req, long us)
+{
+    if (workers == 1)
+    {
+        return queues[0]->pop(req, us);
+    }
+
+    long waited = 0;
+    while (1)
+    {
+        int best = -1;
+        int missing = -1;
+        for (int i = 0; i < workers; ++i)
+        {
+            if (!hasHead[i])
+            {
+                hasHead[i] = queues[i]->pop(heads[i]);
+            }
+            if (!hasHead[i])
+            {
+                if (!idle[i].load(std::memory_order_relaxed))
+                {
+                    missing = i;
+                }
+            }
+            else if (best < 0 || arrivedBefore(heads[i], heads[best]))
+            {
+                best = i;
+            }
+        }
+
+        if (best < 0)
+        {
+            // nothing queued. any queue may be next, so sleep on them in
+            // turn, briefly
+            if (waited >= us)
+            {
+                return 0;
+            }
+            int k = mergeTurn++ % workers;
+            hasHead[k] = queues[k]->pop(heads[k], MERGE_DELAY_NS / 1000);
+            waited += MERGE_DELAY_NS / 1000;
+            continue;
+        }
+        if (missing >= 0 && 
+            getNanoTime() - heads[best].readTime < MERGE_DELAY_NS)
+        {
+            hasHead[missing] = queues[missing]->pop(heads[missing],
+                MERGE_DELAY_NS / 1000);
+            continue;
+        }
+        req = heads[best];
+        hasHead[best] = 0;
+        return 1;
+    }
+}
+
+static void countIgnored()
+{
+    Metrics::Slot *counters = metrics.getSlot();
+    counters->begin();
+    counters->add(Metrics::IGNORED, 1);
+    counters->end();
+}
+
+// whether `req` is to be acknowledged, `cnt` requests after the last ACK.
+// if not, it is recorded as IGNORED.
+static int shouldAck(const AckRequest &req, int &cnt)
+{
+    // a test plan of the Sender may override -n per phase
+    if (++cnt < (req.ackRatio > 0 ? req.ackRatio : num))
+    {
+        rec.write(req.seq, CompactRecorder::Type::IGNORED);
+        countIgnored();
+        return 0;
+    }
+    cnt = 0;
+    return 1;
+}
+
+static void fillAck(AckMessage *ack, const AckRequest &req)
+{
+    ack->hdr.type = MessageType::ACK;
+    ack->hdr.value = req.seq;
+    ack->echoTime = req.echoTime;
+    ack->recvTime = req.recvTime;
+    ack->ackTime = getNanoTime();
+    ack->phase = req.phase;
+}
+
+// the selective ACK being filled(-a) by the thread sending ACKs, and when
+// its first packet was read
+static SackMessage pendingAck;
+static long sackOpened;
+
+// add `req` to `pendingAck`, opening it if empty. return 0 if `req` does not
+// fit in, and `pendingAck` is to be sent first.
+static int addSack(const AckRequest &req)
+{
+    if (pendingAck.packets == 0)
+    {
+        pendingAck.hdr.type = MessageType::SACK;
+        pendingAck.hdr.value = req.seq;
+        pendingAck.received = 0;
+        pendingAck.baseTime = req.recvTime;
+        pendingAck.phase = req.phase;
+        memset(pendingAck.entries, 0, sizeof(pendingAck.entries));
+        sackOpened = req.readTime;
+    }
+
+    long i = req.seq - pendingAck.hdr.value;
+    long delta = req.recvTime - pendingAck.baseTime;
+    if (i < 0 || i >= aggregate || req.phase != pendingAck.phase ||
+        ((pendingAck.received >> i) & 1) || delta < INT_MIN || delta > INT_MAX)
+    {
+        return 0;
+    }
+    pendingAck.received |= 1ul << i;
+    pendingAck.entries[i].echoTime = req.echoTime;
+    pendingAck.entries[i].recvDelta = delta;
+    ++pendingAck.packets;
+    return 1;
+}
+
+// whether `pendingAck` is to be sent at `now`.
+static inline int sackDue(long now)
+{
+    return pendingAck.packets > 0 && 
+        (pendingAck.packets == aggregate || now - sackOpened >= aggregateNs);
+}
+
+// record the packets of `pendingAck`, handed to the kernel as the `tx`'s next
+// send, and empty it. the kernel timestamp of the send goes to the first
+// packet only.
+static void sackSent(TxTimestamps &tx)
+{
+    Metrics::Slot *counters = metrics.getSlot();
+
+    tx.sent(pendingAck.hdr.value, 1, CompactRecorder::Type::ACK_SENT);
+    for (uint64_t rest = pendingAck.received & ~1ul; rest != 0; 
+        rest &= rest - 1)
+    {
+        rec.write(pendingAck.hdr.value + __builtin_ctzl(rest), 
+            CompactRecorder::Type::ACK_SENT);
+    }
+    log.verbose("sackSent: ACK of %d packets from %ld sent.", 
+        pendingAck.packets, pendingAck.hdr.value);
+    counters->begin();
+    counters->add(Metrics::ACK_SENT, pendingAck.packets);
+    counters->end();
+    pendingAck.packets = 0;
+}
+
+// record the packets of `pendingAck` as IGNORED, and empty it.
+static void sackDropped()
+{
+    for (uint64_t rest = pendingAck.received; rest != 0; rest &= rest - 1)
+    {
+        rec.write(pendingAck.hdr.value + __builtin_ctzl(rest), 
+            CompactRecorder::Type::IGNORED);
+        countIgnored();
+    }
+    pendingAck.packets = 0;
+}
+
+// send `pendingAck` on `fd`. return 0 on success.
+static int sendSack(int fd, TxTimestamps &tx)
+{
+    char errbuf[64];
+
+    pendingAck.ackTime = getNanoTime();
+    if (sendto(fd, &pendingAck, pendingAck.length(), 0, 
+        (struct sockaddr*)&svaddr, sizeof(svaddr)) == -1)
+    {
+        log.error("sendSack: Socket broken when sending(%s).", 
+            Log::strerror(errbuf));
+        sackDropped();
+        return 1;
+    }
+    sackSent(tx);
+    return 0;
+}
+
+// send `n` START instructions to the Sender on `fd`. return 0 on success.
+static int sendStart(int fd, TxTimestamps &tx, int n)
 {
-    long sent = 0;
     char errbuf[64];
-    socklen_t len = sizeof(svaddr);
 
     smsg->type = MessageType::INSTRUCTION;
     smsg->value = Instructions::START;
-    while (!started && !toAbort)
+    for (int i = 0; i < n; ++i)
     {
         if (sendto(fd, sendBuf, sizeof(Message), 0, 
-            (struct sockaddr*)&svaddr, len) == -1)
+            (struct sockaddr*)&svaddr, sizeof(svaddr)) == -1)
         {
             log.error("sendMain: Socket broken when sending(%s).", 
                 Log::strerror(errbuf));
-            toAbort = 1;
-            return;
+            return 1;
         }
-        log.message("sendMain: Start instruction sent.");
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        tx.sent(Instructions::START, 1, -1);
+    }
+    return 0;
+}
+
+void sendMain(int fd)
+{
+    // before anything is allocated, so that memory is local to the CPU
+    runtime.applyThread("sendMain");
+
+    long sent = 0;
+    char errbuf[64];
+    socklen_t len = sizeof(svaddr);
+    TxTimestamps tx(rec);
+    Metrics::Slot *counters = metrics.getSlot();
+
+    tx.init(fd, recClock);
+    if (sendStart(fd, tx, 1) != 0)
+    {
+        toAbort = 1;
+        return;
     }
+    log.message("sendMain: Start instruction sent.");
 
     auto st = std::chrono::system_clock::now();
     int cnt = 0;
+    AckRequest last = {LONG_MIN, 0, LONG_MIN, -1, 0, 0, 0};
+    long misordered = 0;
+    long sacks = 0;
+    long acked = 0;
     while (!toAbort)
     {
-        long seq;
-        queueLock.writeLock();
-        if (recvQueue.empty())
+        AckRequest req;
+        if (sackDue(getNanoTime()))
+        {
+            acked += pendingAck.packets;
+            ++sacks;
+            if (sendSack(fd, tx) != 0)
+            {
+                toAbort = 1;
+                return;
+            }
+        }
+        // until the open selective ACK may be due
+        if (!mergeNext(req, pendingAck.packets > 0 ? 50 : 1000))
         {
-            queueLock.writeRelease();
-            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            tx.reap(fd);
         }
         else
         {
-            seq = recvQueue.front();
-            recvQueue.pop_front();
-            queueLock.writeRelease();
-            if (++cnt < num)
+            long seq = req.seq;
+            long distance;
+            arrivals.onArrival(seq, distance);
+            if (arrivedBefore(req, last))
+            {
+                // another worker had it, but did not queue it in time
+                ++misordered;
+            }
+            else
+            {
+                last = req;
+            }
+            if (aggregate > 0)
+            {
+                if (!addSack(req))
+                {
+                    acked += pendingAck.packets;
+                    ++sacks;
+                    if (sendSack(fd, tx) != 0)
+                    {
+                        toAbort = 1;
+                        return;
+                    }
+                    addSack(req);
+                }
+                continue;
+            }
+            if (!shouldAck(req, cnt))
             {
-                rec.write(seq, CompactRecorder::Type::IGNORED);
                 continue;
             }
 
-            smsg->type = MessageType::ACK;
-            smsg->value = seq;
+            fillAck(sack, req);
             len = sizeof(svaddr);
-            if (sendto(fd, sendBuf, sizeof(Message), 0, 
+            if (sendto(fd, sendBuf, sizeof(AckMessage), 0, 
                 (struct sockaddr*)&svaddr, len) == -1)
             {
                 log.error("sendMain: Socket broken when sending(%s).", 
@@ -166,92 +628,749 @@ void sendMain(int fd)
             }
             log.verbose("sendMain: ACK of packet %ld sent.", seq);
             ++sent;
-            cnt = 0;
-            rec.write(seq, CompactRecorder::Type::ACK_SENT);
+            counters->begin();
+            counters->add(Metrics::ACK_SENT, 1);
+            counters->end();
+            tx.sent(seq, 1, CompactRecorder::Type::ACK_SENT);
+            if ((sent & 63) == 0)
+            {
+                tx.reap(fd);
+            }
         }
 
+        // START every 100ms until DATA arrives, then 5 every 3s
         auto current = std::chrono::system_clock::now();
-        if (current - st > std::chrono::milliseconds(3000))
+        auto period = started ? std::chrono::milliseconds(3000) : 
+            std::chrono::milliseconds(100);
+        if (current - st > period)
         {
-            smsg->type = MessageType::INSTRUCTION;
-            smsg->value = Instructions::START;
-            for (int i = 0; i < 5; ++i)
+            if (sendStart(fd, tx, started ? 5 : 1) != 0)
             {
-                if (sendto(fd, sendBuf, sizeof(Message), 0, 
-                    (struct sockaddr*)&svaddr, len) == -1)
-                {
-                    log.error("sendMain: Socket broken when sending(%s).", 
-                        Log::strerror(errbuf));
-                    toAbort = 1;
-                    return;
-                }
+                toAbort = 1;
+                return;
             }
-            log.message("sendMain: Periodic start instruction sent.");
+            log.message(started ? "sendMain: Periodic start instruction "
+                "sent." : "sendMain: Start instruction sent.");
             st = current;
         }
     }
 
-    log.message("sendMain: %ld ACKs sent.", sent);
+    int left = pendingAck.packets;
+    if (left > 0 && sendSack(fd, tx) == 0)
+    {
+        acked += left;
+        ++sacks;
+    }
+    tx.finish(fd);
+    if (aggregate > 0)
+    {
+        log.message("sendMain: %ld packets acknowledged in %ld selective "
+            "ACKs.", acked, sacks);
+    }
+    else
+    {
+        log.message("sendMain: %ld ACKs sent.", sent);
+    }
+
+    long overflow = 0;
+    for (int i = 0; i < workers; ++i)
+    {
+        overflow += queues[i]->getOverflow();
+    }
+    if (overflow > 0)
+    {
+        log.message("sendMain: %ld packets not queued, counted as lost.",
+            overflow);
+    }
+    if (workers > 1)
+    {
+        log.message("sendMain: %ld packets merged out of order of arrival.",
+            misordered);
+    }
+}
+
+// record DATA packet `rmsg` of `len` bytes from `from`, and fill in the
+// request to acknowledge it. `ts` is its kernel timestamp on `clock`, or
+// nullptr if it has none. return 1 if it came from the Sender.
+static int onData(const Message *rmsg, int len, const sockaddr_in &from,
+    const timespec *ts, CompactRecorder::Clock clock, long batchTime,
+    AckRequest &req)
+{
+    if (svaddr.sin_addr.s_addr != from.sin_addr.s_addr ||
+        svaddr.sin_port != from.sin_port)
+    {
+        log.warning("recvMain: Packet %ld from unknown Sender %s:%d.", 
+            rmsg->value, inet_ntoa(from.sin_addr), ntohs(from.sin_port));
+        return 0;
+    }
+
+    log.verbose("recvMain: Packet %ld received.", rmsg->value);
+    Metrics::Slot *counters = metrics.getSlot();
+    counters->begin();
+    counters->add(Metrics::RECEIVED, 1);
+    counters->end();
+    req = {rmsg->value, 0, batchTime, -1, 0, batchTime, 0};
+    if (ts != nullptr)
+    {
+        rec.write(rmsg->value, CompactRecorder::Type::RECEIVED, *ts, clock);
+        // the NIC clock cannot be compared with the Sender's times
+        if (clock != CompactRecorder::Clock::HARDWARE)
+        {
+            req.recvTime = toNanoTime(*ts);
+            req.stamped = 1;
+        }
+    }
+    else
+    {
+        rec.write(rmsg->value, CompactRecorder::Type::RECEIVED);
+    }
+    if (len >= (int)sizeof(DataMessage))
+    {
+        DataMessage *data = (DataMessage*)rmsg;
+        req.echoTime = data->sendTime;
+        req.phase = data->phase;
+        req.ackRatio = data->ackRatio;
+    }
+    started = 1;
+    return 1;
+}
+
+// hand `req` from receive thread `worker` to the ACK thread.
+static void queueAck(int worker, const AckRequest &req)
+{
+    if (!queues[worker]->push(req))
+    {
+        // the ACK thread is too far behind
+        rec.write(req.seq, CompactRecorder::Type::IGNORED);
+        countIgnored();
+    }
 }
 
-void recvMain(int fd)
+void recvMain(int fd, int worker)
 {
+    char name[32] = "recvMain";
+    if (workers > 1)
+    {
+        snprintf(name, sizeof(name), "recvMain[%d]", worker);
+    }
+    runtime.applyThread(name);
+
     long received = 0;
-    int size;
-    sockaddr_in recvInfo;
     char errbuf[64];
+    RecvBatch batch(recvBatch, 2048);
+    SPSCQueue<AckRequest> *queue = queues[worker];
 
+    if (steerCpu)
+    {
+        // the group prefers the socket of the CPU a packet came in on
+        // (linux 6.2)
+        int cpu = sched_getcpu();
+        if (setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, 
+            sizeof(cpu)) < 0)
+        {
+            log.warning("%s: Cannot steer CPU %d here(%s).", name, cpu,
+                Log::strerror(errbuf));
+        }
+        else
+        {
+            log.message("%s: Taking packets of CPU %d.", name, cpu);
+        }
+    }
+
+    RecvBatch::setTimeout(fd, 100);
     while (!toAbort)
     {
-        socklen_t len = sizeof(recvInfo);
-        if ((size = recvfrom(fd, recvBuf, 65536, MSG_DONTWAIT, 
-            (struct sockaddr*)&recvInfo, &len)) == -1)
+        idle[worker].store(1, std::memory_order_relaxed);
+        int ret = batch.receive(fd);
+        idle[worker].store(0, std::memory_order_relaxed);
+        if (ret < 0)
         {
-            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            log.error("%s: Socket broken when receiving(%s).", name,
+                Log::strerror(errbuf));
+            toAbort = 1;
+            return;
+        }
+
+        long batchTime = getNanoTime();
+        for (int i = 0; i < batch.size(); ++i)
+        {
+            Message *rmsg = (Message*)batch.data(i);
+            timespec ts;
+            CompactRecorder::Clock clock;
+
+            if (batch.length(i) < (int)sizeof(Message) ||
+                rmsg->type != MessageType::DATA)
             {
-                std::this_thread::sleep_for(std::chrono::milliseconds(1));
                 continue;
             }
-            else
+            int stamped = getRxTimestamp(batch.header(i), ts, clock) == 0;
+            AckRequest req;
+            if (!onData(rmsg, batch.length(i), batch.from(i), 
+                stamped ? &ts : nullptr, clock, batchTime, req))
             {
-                log.error("recvMain: Socket broken when receiving(%s).",
-                    Log::strerror(errbuf));
-                toAbort = 1;
-                return;
+                continue;
+            }
+            queueAck(worker, req);
+            if (received++ == 0)
+            {
+                log.verbose("%s: First packet received.", name);
             }
         }
+    }
+
+    log.message("%s: %ld packets received.", name, received);
+    log.message("%s: ACK queue peak occupancy %ld/%ld, %ld overflows.",
+        name, queue->getMaxOccupancy(), queue->capacity(), 
+        queue->getOverflow());
+}
+
+// recvMain on a capture ring. every packet carries the kernel time it was
+// captured at.
+void captureMain(PacketRing *ring)
+{
+    runtime.applyThread("captureMain");
 
-        switch (rmsg->type)
+    long received = 0;
+    long packets, drops;
+    char errbuf[64];
+
+    while (!toAbort)
+    {
+        if (ring->receive(100) < 0)
+        {
+            log.error("captureMain: Ring broken when receiving(%s).",
+                Log::strerror(errbuf));
+            toAbort = 1;
+            return;
+        }
+
+        long batchTime = getNanoTime();
+        for (int i = 0; i < ring->size(); ++i)
+        {
+            Message *rmsg = (Message*)ring->data(i);
+            CompactRecorder::Clock clock;
+            const timespec &ts = ring->timestamp(i, clock);
+
+            if (ring->length(i) < (int)sizeof(Message) ||
+                rmsg->type != MessageType::DATA)
+            {
+                continue;
+            }
+            AckRequest req;
+            if (!onData(rmsg, ring->length(i), ring->from(i), &ts, clock,
+                batchTime, req))
+            {
+                continue;
+            }
+            queueAck(0, req);
+            if (received++ == 0)
+            {
+                log.verbose("captureMain: First packet received.");
+            }
+        }
+    }
+
+    log.message("captureMain: %ld packets received.", received);
+    if (ring->getStats(packets, drops) == 0 && drops > 0)
+    {
+        log.warning("captureMain: The ring dropped %ld of the last %ld "
+            "packets.", drops, packets + drops);
+    }
+    log.message("captureMain: ACK queue peak occupancy %ld/%ld, %ld "
+        "overflows.", recvQueue.getMaxOccupancy(), recvQueue.capacity(), 
+        recvQueue.getOverflow());
+}
+
+// requests of uringMain. user_data is 0 for the multishot receive, or 1 +
+// the index of the slot a request uses: single-shot receives first, then
+// sends.
+static const int URING_RECVS = 32;
+static const int URING_SENDS = 128;
+static const int URING_BUFS = 256;
+static const int URING_BUF_LEN = 2048;
+static const int URING_CONTROL_LEN = 256;
+
+struct UringSlot
+{
+    msghdr hdr;
+    iovec iov;
+    sockaddr_in name;
+    long control[URING_CONTROL_LEN / sizeof(long)];
+    long data[URING_BUF_LEN / sizeof(long)];
+};
+
+// queue a receive into `slot`, or the multishot receive into provided
+// buffers if `slot` is nullptr. return 0 on success.
+static int armRecv(Uring *ring, int fd, msghdr *multishot, UringSlot *slot,
+    long userData)
+{
+    io_uring_sqe *sqe = ring->getSqe();
+    if (sqe == nullptr)
+    {
+        return 1;
+    }
+
+    sqe->opcode = IORING_OP_RECVMSG;
+    ring->setFile(sqe, fd);
+    sqe->len = 1;
+    sqe->user_data = userData;
+    if (slot == nullptr)
+    {
+        // since linux 6.0
+        sqe->addr = (uint64_t)multishot;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags |= IOSQE_BUFFER_SELECT;
+        sqe->buf_group = 0;
+        return 0;
+    }
+    memset(&slot->hdr, 0, sizeof(slot->hdr));
+    slot->iov.iov_base = slot->data;
+    slot->iov.iov_len = sizeof(slot->data);
+    slot->hdr.msg_name = &slot->name;
+    slot->hdr.msg_namelen = sizeof(slot->name);
+    slot->hdr.msg_iov = &slot->iov;
+    slot->hdr.msg_iovlen = 1;
+    slot->hdr.msg_control = slot->control;
+    slot->hdr.msg_controllen = sizeof(slot->control);
+    sqe->addr = (uint64_t)&slot->hdr;
+    return 0;
+}
+
+// queue sending the first `len` bytes of `slot` to the Sender. return 0 on
+// success.
+static int armSend(Uring *ring, int fd, UringSlot *slot, int len,
+    long userData)
+{
+    io_uring_sqe *sqe = ring->getSqe();
+    if (sqe == nullptr)
+    {
+        return 1;
+    }
+
+    memset(&slot->hdr, 0, sizeof(slot->hdr));
+    slot->iov.iov_base = slot->data;
+    slot->iov.iov_len = len;
+    slot->name = svaddr;
+    slot->hdr.msg_name = &slot->name;
+    slot->hdr.msg_namelen = sizeof(slot->name);
+    slot->hdr.msg_iov = &slot->iov;
+    slot->hdr.msg_iovlen = 1;
+    sqe->opcode = IORING_OP_SENDMSG;
+    ring->setFile(sqe, fd);
+    sqe->addr = (uint64_t)&slot->hdr;
+    sqe->len = 1;
+    sqe->user_data = userData;
+    return 0;
+}
+
+// queue `pendingAck` in a free send slot of uringMain. return 1 if queued;
+// otherwise its packets are recorded as IGNORED, and added to `overflow`.
+static int queueSack(Uring *ring, int fd, UringSlot *slots, int *freeSends,
+    int &nFree, TxTimestamps &tx, long &overflow)
+{
+    if (nFree > 0)
+    {
+        int k = freeSends[--nFree];
+        pendingAck.ackTime = getNanoTime();
+        memcpy(slots[k].data, &pendingAck, pendingAck.length());
+        if (armSend(ring, fd, &slots[k], pendingAck.length(), k + 1) == 0)
+        {
+            sackSent(tx);
+            return 1;
+        }
+        freeSends[nFree++] = k;
+    }
+    overflow += pendingAck.packets;
+    sackDropped();
+    return 0;
+}
+
+// sendMain and recvMain in one thread on an io_uring. a multishot
+// receive stays armed on the socket and fills provided buffers, ACKs and
+// START instructions are queued as they are due, and the thread only
+// enters the kernel to wait for completions when there is nothing left to
+// do. with SQPOLL, it does not even enter it to submit.
+//
+// kernels without provided buffer rings or multishot receives get
+// URING_RECVS single-shot receives, rearmed as they complete.
+void uringMain(Uring *ring, int fd)
+{
+    runtime.applyThread("uringMain");
+
+    long received = 0;
+    long sent = 0;
+    long completions = 0;
+    long overflow = 0;
+    long sacks = 0;
+    int cnt = 0;
+    int multishot = ring->setupBuffers(URING_BUFS, URING_BUF_LEN, 0) == 0;
+    // the multishot receive is armed
+    int armed = 0;
+    msghdr recvHdr;
+    UniqueSmart<UringSlot[]> slots = 
+        std::make_unique<UringSlot[]>(URING_RECVS + URING_SENDS);
+    int freeSends[URING_SENDS];
+    int nFree = 0;
+    TxTimestamps tx(rec);
+    Metrics::Slot *counters = metrics.getSlot();
+    char errbuf[64];
+
+    // what each buffer of the multishot receive holds before the payload
+    memset(&recvHdr, 0, sizeof(recvHdr));
+    recvHdr.msg_namelen = sizeof(sockaddr_in);
+    recvHdr.msg_controllen = URING_CONTROL_LEN;
+    for (int i = URING_SENDS - 1; i >= 0; --i)
+    {
+        freeSends[nFree++] = URING_RECVS + i;
+    }
+    if (multishot)
+    {
+        armed = armRecv(ring, fd, &recvHdr, nullptr, 0) == 0;
+    }
+    else
+    {
+        for (int i = 0; i < URING_RECVS; ++i)
         {
-        case MessageType::DATA:
-            if (svaddr.sin_addr.s_addr != recvInfo.sin_addr.s_addr ||
-                svaddr.sin_port != recvInfo.sin_port)
+            armRecv(ring, fd, nullptr, &slots[i], i + 1);
+        }
+    }
+    log.message("uringMain: Receiving with %s recvmsg, %s.", 
+        multishot ? "multishot" : "single-shot",
+        ring->isSqPoll() ? "SQPOLL" : "no SQPOLL");
+
+    tx.init(fd, recClock);
+    auto st = std::chrono::system_clock::now() - std::chrono::hours(1);
+    while (!toAbort)
+    {
+        long batchTime = getNanoTime();
+        int seen = 0;
+        io_uring_cqe *cqe;
+        while ((cqe = ring->peek()) != nullptr)
+        {
+            long id = cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            ring->seen();
+            ++seen;
+
+            if (id > URING_RECVS)
+            {
+                // a send
+                freeSends[nFree++] = id - 1;
+                if (res < 0)
+                {
+                    errno = -res;
+                    log.error("uringMain: Socket broken when sending(%s).",
+                        Log::strerror(errbuf));
+                    toAbort = 1;
+                }
+                continue;
+            }
+
+            if (res < 0)
+            {
+                if (id == 0)
+                {
+                    armed = 0;
+                }
+                if (flags & IORING_CQE_F_BUFFER)
+                {
+                    ring->recycle(flags >> IORING_CQE_BUFFER_SHIFT);
+                }
+                if (res == -ENOBUFS || res == -EINTR || res == -EAGAIN)
+                {
+                    // rearmed below
+                    if (id > 0)
+                    {
+                        armRecv(ring, fd, nullptr, &slots[id - 1], id);
+                    }
+                    continue;
+                }
+                if (id == 0 && (res == -EINVAL || res == -EOPNOTSUPP) &&
+                    received == 0)
+                {
+                    log.warning("uringMain: Multishot recvmsg unavailable, "
+                        "using single-shot recvmsg.");
+                    multishot = 0;
+                    for (int i = 0; i < URING_RECVS; ++i)
+                    {
+                        armRecv(ring, fd, nullptr, &slots[i], i + 1);
+                    }
+                    continue;
+                }
+                errno = -res;
+                log.error("uringMain: Socket broken when receiving(%s).",
+                    Log::strerror(errbuf));
+                toAbort = 1;
+                break;
+            }
+
+            msghdr hdr;
+            const char *data;
+            const sockaddr_in *from;
+            int len;
+            int bid = -1;
+            if (id == 0)
             {
-                log.warning("recvMain: Packet %ld from unknown Sender %s:%d.", 
-                    rmsg->value, inet_ntoa(recvInfo.sin_addr), 
-                    ntohs(recvInfo.sin_port));
+                if (!(flags & IORING_CQE_F_MORE))
+                {
+                    armed = 0;
+                }
+                if (!(flags & IORING_CQE_F_BUFFER))
+                {
+                    continue;
+                }
+                bid = flags >> IORING_CQE_BUFFER_SHIFT;
+
+                char *buf = ring->buffer(bid);
+                io_uring_recvmsg_out *out = (io_uring_recvmsg_out*)buf;
+                char *control = buf + sizeof(*out) + recvHdr.msg_namelen;
+                char *payload = control + recvHdr.msg_controllen;
+                memset(&hdr, 0, sizeof(hdr));
+                hdr.msg_control = control;
+                hdr.msg_controllen = out->controllen;
+                from = (const sockaddr_in*)(buf + sizeof(*out));
+                data = payload;
+                // what fit into the buffer
+                len = res - (payload - buf);
+                len = (int)out->payloadlen < len ? out->payloadlen : len;
+            }
+            else
+            {
+                hdr = slots[id - 1].hdr;
+                from = &slots[id - 1].name;
+                data = (const char*)slots[id - 1].data;
+                len = res;
+            }
+
+            const Message *rmsg = (const Message*)data;
+            timespec ts;
+            CompactRecorder::Clock clock;
+            AckRequest req;
+            int stamped = getRxTimestamp(&hdr, ts, clock) == 0;
+            int isData = len >= (int)sizeof(Message) &&
+                rmsg->type == MessageType::DATA &&
+                onData(rmsg, len, *from, stamped ? &ts : nullptr, clock,
+                    batchTime, req);
+            if (bid >= 0)
+            {
+                ring->recycle(bid);
             }
             else
             {
-                log.verbose("recvMain: Packet %ld received.", rmsg->value);
-                if (received++ == 0)
+                armRecv(ring, fd, nullptr, &slots[id - 1], id);
+            }
+            if (!isData)
+            {
+                continue;
+            }
+            if (received++ == 0)
+            {
+                log.verbose("uringMain: First packet received.");
+            }
+            long distance;
+            arrivals.onArrival(req.seq, distance);
+            if (aggregate > 0)
+            {
+                if (!addSack(req))
                 {
-                    log.verbose("recvMain: First packet received.");
+                    sacks += queueSack(ring, fd, slots.get(), freeSends, 
+                        nFree, tx, overflow);
+                    addSack(req);
                 }
-                rec.write(rmsg->value, CompactRecorder::Type::RECEIVED);
-                queueLock.writeLock();
-                recvQueue.push_back(rmsg->value);
-                queueLock.writeRelease();
-                started = 1;
+                if (sackDue(batchTime))
+                {
+                    sacks += queueSack(ring, fd, slots.get(), freeSends, 
+                        nFree, tx, overflow);
+                }
+                continue;
             }
-            break;
-        default:
-            // ignore
-            break;
+            if (!shouldAck(req, cnt))
+            {
+                continue;
+            }
+
+            if (nFree == 0)
+            {
+                // too many ACKs in flight
+                rec.write(req.seq, CompactRecorder::Type::IGNORED);
+                countIgnored();
+                ++overflow;
+                continue;
+            }
+            int k = freeSends[--nFree];
+            fillAck((AckMessage*)slots[k].data, req);
+            if (armSend(ring, fd, &slots[k], sizeof(AckMessage), k + 1) != 0)
+            {
+                freeSends[nFree++] = k;
+                rec.write(req.seq, CompactRecorder::Type::IGNORED);
+                countIgnored();
+                ++overflow;
+                continue;
+            }
+            // sends leave in the order they are queued
+            tx.sent(req.seq, 1, CompactRecorder::Type::ACK_SENT);
+            log.verbose("uringMain: ACK of packet %ld sent.", req.seq);
+            counters->begin();
+            counters->add(Metrics::ACK_SENT, 1);
+            counters->end();
+            if ((++sent & 63) == 0)
+            {
+                tx.reap(fd);
+            }
+        }
+        completions += seen;
+        if (sackDue(getNanoTime()))
+        {
+            sacks += queueSack(ring, fd, slots.get(), freeSends, nFree, tx,
+                overflow);
+        }
+        if (multishot && !armed)
+        {
+            armed = armRecv(ring, fd, &recvHdr, nullptr, 0) == 0;
+        }
+
+        // START every 100ms until DATA arrives, then 5 every 3s
+        auto current = std::chrono::system_clock::now();
+        auto period = started ? std::chrono::milliseconds(3000) : 
+            std::chrono::milliseconds(100);
+        if (current - st > period)
+        {
+            int n = started ? 5 : 1;
+            for (int i = 0; i < n && nFree > 0; ++i)
+            {
+                int k = freeSends[--nFree];
+                Message *msg = (Message*)slots[k].data;
+                msg->type = MessageType::INSTRUCTION;
+                msg->value = Instructions::START;
+                if (armSend(ring, fd, &slots[k], sizeof(Message), 
+                    k + 1) != 0)
+                {
+                    freeSends[nFree++] = k;
+                    break;
+                }
+                tx.sent(Instructions::START, 1, -1);
+            }
+            log.message(started ? "uringMain: Periodic start instruction "
+                "sent." : "uringMain: Start instruction sent.");
+            st = current;
+        }
+
+        // wait only if nothing came in, and not past the open selective
+        // ACK
+        long timeout = 100000000L;
+        if (pendingAck.packets > 0)
+        {
+            timeout = sackOpened + aggregateNs - getNanoTime();
+            timeout = timeout < 1000 ? 1000 : timeout;
+        }
+        int ret = ring->submit(seen == 0, timeout);
+        if (ret == -ETIME)
+        {
+            tx.reap(fd);
+        }
+        else if (ret < 0 && ret != -EINTR && ret != -EBUSY)
+        {
+            errno = -ret;
+            log.error("uringMain: io_uring_enter() failed(%s).",
+                Log::strerror(errbuf));
+            toAbort = 1;
+        }
+    }
+
+    if (pendingAck.packets > 0)
+    {
+        sacks += queueSack(ring, fd, slots.get(), freeSends, nFree, tx,
+            overflow);
+        ring->submit(0, 0);
+    }
+    // let the sends in flight complete, so their timestamps are not lost
+    for (int i = 0; i < 10 && nFree < URING_SENDS; ++i)
+    {
+        io_uring_cqe *cqe;
+        if (ring->submit(1, 10000000L) < 0 && ring->peek() == nullptr)
+        {
+            continue;
+        }
+        while ((cqe = ring->peek()) != nullptr)
+        {
+            if (cqe->user_data > URING_RECVS)
+            {
+                ++nFree;
+            }
+            ring->seen();
+        }
+    }
+    tx.finish(fd);
+    log.message("uringMain: %ld packets received.", received);
+    if (aggregate > 0)
+    {
+        log.message("uringMain: %ld selective ACKs sent, %ld packets not "
+            "acknowledged for lack of send slots.", sacks, overflow);
+    }
+    else
+    {
+        log.message("uringMain: %ld ACKs sent, %ld dropped for lack of send "
+            "slots.", sent, overflow);
+    }
+    log.message("uringMain: %ld io_uring_enter() calls for %ld completions.",
+        ring->getEnters(), completions);
+}
+
+// open the sockets of workers 1 and on in the SO_REUSEPORT group of `fd`,
+// and steer packets between them. `fds` gets all of them, `fd` first.
+// return 0 on success.
+static int openWorkers(int fd, int *fds)
+{
+    sockaddr_in local;
+    socklen_t len = sizeof(local);
+    int one = 1;
+    char errbuf[64];
+
+    fds[0] = fd;
+    if (getsockname(fd, (sockaddr*)&local, &len) < 0)
+    {
+        log.error("openWorkers: getsockname() failed(%s).", 
+            Log::strerror(errbuf));
+        return 1;
+    }
+    for (int i = 1; i < workers; ++i)
+    {
+        // sockets join the group in order, so socket i is index i
+        if ((fds[i] = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ||
+            setsockopt(fds[i], SOL_SOCKET, SO_REUSEPORT, &one, 
+                sizeof(one)) < 0 ||
+            bind(fds[i], (sockaddr*)&local, sizeof(local)) < 0)
+        {
+            log.error("openWorkers: Cannot open socket of worker %d(%s).",
+                i, Log::strerror(errbuf));
+            return 1;
         }
+        enableTimestamping(fds[i], recClock);
+        runtime.applySocket(fds[i]);
+        queues[i] = &workerQueues[i - 1].queue;
+    }
+    if (steerCpu)
+    {
+        return 0;
     }
 
-    log.message("recvMain: %ld packets received.", received);
+    // the low byte of the sequence number(on a little-endian Sender)
+    // picks the socket. offsets are from the UDP payload.
+    sock_filter code[] = {
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, offsetof(Message, value)),
+        BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, (unsigned)workers),
+        BPF_STMT(BPF_RET | BPF_A, 0)
+    };
+    sock_fprog prog = {sizeof(code) / sizeof(code[0]), code};
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog,
+        sizeof(prog)) < 0)
+    {
+        log.warning("openWorkers: Cannot steer by sequence number(%s), "
+            "packets of a flow all go to one worker.", 
+            Log::strerror(errbuf));
+    }
+    return 0;
 }
 
 void sigHandler(int sig, siginfo_t *info, void *ptr)
@@ -263,7 +1382,9 @@ void sigHandler(int sig, siginfo_t *info, void *ptr)
 int main(int argc, char **argv)
 {
     int fd;
+    int fds[MAX_WORKERS];
     int ret;
+    int one = 1;
     char errbuf[64];
 
     signalNoRestart(SIGINT, sigHandler);
@@ -286,8 +1407,24 @@ int main(int argc, char **argv)
         return 2;
     }
 
+    rec.setClock(recClock);
+    rec.setRunInfo(argc, argv);
+    if (enableTimestamping(fd, recClock) != 0)
+    {
+        log.warning("main: Kernel timestamps unavailable, using realtime "
+            "clock.");
+        recClock = CompactRecorder::Clock::REALTIME;
+        rec.setClock(recClock);
+    }
+
     addr.sin_family = AF_INET;
     svaddr.sin_family = AF_INET;
+    if (workers > 1 && 
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)
+    {
+        log.error("main: Cannot share port(%s).", Log::strerror(errbuf));
+        return 3;
+    }
     if ((ret = bind(fd, (sockaddr*)&addr, sizeof(addr))) < 0)
     {
         log.error("main: Cannot bind to specified address %s:%d(%s).", 
@@ -296,10 +1433,94 @@ int main(int argc, char **argv)
         return 3;
     }
 
-    std::thread sender(sendMain, fd), receiver(recvMain, fd);
+    if (metricsName != nullptr)
+    {
+        sockaddr_in local;
+        socklen_t len = sizeof(local);
+        if (metrics.create(metricsName, "Receiver") != 0)
+        {
+            return 2;
+        }
+        if (getsockname(fd, (sockaddr*)&local, &len) == 0)
+        {
+            metrics.setPort(ntohs(local.sin_port));
+        }
+    }
+
+    PacketRing ring;
+    if (capture != nullptr)
+    {
+        sockaddr_in local;
+        socklen_t len = sizeof(local);
+        if (getsockname(fd, (sockaddr*)&local, &len) < 0 ||
+            ring.open(capture, svaddr, ntohs(local.sin_port), recClock) != 0)
+        {
+            log.error("main: Cannot capture on %s.", capture);
+            return 3;
+        }
+        PacketRing::mute(fd);
+        log.message("main: Capturing on %s, port %d.", capture, 
+            ntohs(local.sin_port));
+    }
 
-    sender.join();
-    receiver.join();
+    Uring uring;
+    if (useUring)
+    {
+        if (uring.init(Uring::DEF_ENTRIES, 1) != 0)
+        {
+            log.warning("main: io_uring unavailable, using sockets.");
+            useUring = 0;
+        }
+        else
+        {
+            uring.registerFile(fd);
+        }
+    }
+
+    if (workers > 1)
+    {
+        if (openWorkers(fd, fds) != 0)
+        {
+            return 3;
+        }
+        log.message("main: Receiving with %d workers, steered by %s.",
+            workers, steerCpu ? "CPU" : "sequence number");
+    }
+
+    runtime.applySocket(fd);
+    runtime.applyProcess();
+    if (useUring)
+    {
+        std::thread worker(uringMain, &uring, fd);
+        worker.join();
+    }
+    else if (workers > 1)
+    {
+        std::thread sender(sendMain, fd);
+        std::thread receivers[MAX_WORKERS];
+        for (int i = 0; i < workers; ++i)
+        {
+            receivers[i] = std::thread(recvMain, fds[i], i);
+        }
+
+        sender.join();
+        for (int i = 0; i < workers; ++i)
+        {
+            receivers[i].join();
+        }
+    }
+    else
+    {
+        std::thread sender(sendMain, fd);
+        std::thread receiver = capture == nullptr ? 
+            std::thread(recvMain, fd, 0) : std::thread(captureMain, &ring);
+
+        sender.join();
+        receiver.join();
+    }
+    arrivals.finish();
+    arrivals.report("Receiver", "lost");
+    rec.close();
 
     return 0;
 }
@@ -0,0 +1,297 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include "Log.hh"
+#include "Runtime.hh"
+
+Runtime::Runtime(): cpus(), node(-1), fifoPrio(0), busyPollUs(0), lock(0),
+    threads(0)
+{
+    CPU_ZERO(&nodeCpus);
+}
+
+int Runtime::parseCpus(const char *str)
+{
+    char *end;
+
+    cpus.clear();
+    while (*str != 0)
+    {
+        long from = strtol(str, &end, 10), to = from;
+        if (end == str)
+        {
+            return 1;
+        }
+        if (*end == '-')
+        {
+            str = end + 1;
+            to = strtol(str, &end, 10);
+            if (end == str)
+            {
+                return 1;
+            }
+        }
+        if (from < 0 || to < from || to >= CPU_SETSIZE)
+        {
+            return 1;
+        }
+        for (long i = from; i <= to; ++i)
+        {
+            cpus.push_back(i);
+        }
+        if (*end == ':')
+        {
+            ++end;
+        }
+        else if (*end != 0)
+        {
+            return 1;
+        }
+        str = end;
+    }
+    return cpus.empty();
+}
+
+// read the CPUs of `node` from sysfs into `nodeCpus`.
+int Runtime::loadNode()
+{
+    char path[64];
+    char list[1024];
+    FILE *fin;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+        node);
+    if ((fin = fopen(path, "r")) == nullptr)
+    {
+        return 1;
+    }
+    if (fgets(list, sizeof(list), fin) == nullptr)
+    {
+        fclose(fin);
+        return 1;
+    }
+    fclose(fin);
+
+    // same format as cpus=, with ',' instead of ':'
+    std::vector<int> saved;
+    saved.swap(cpus);
+    list[strcspn(list, "\n")] = 0;
+    for (char *p = list; *p != 0; ++p)
+    {
+        if (*p == ',')
+        {
+            *p = ':';
+        }
+    }
+    int ret = parseCpus(list);
+    CPU_ZERO(&nodeCpus);
+    for (int cpu : cpus)
+    {
+        CPU_SET(cpu, &nodeCpus);
+    }
+    cpus.swap(saved);
+    return ret;
+}
+
+int Runtime::parse(char *str)
+{
+    enum
+    {
+        CPUS,
+        NODE,
+        FIFO,
+        BUSYPOLL,
+        MLOCK
+    };
+    static char *const keys[] = {
+        (char*)"cpus", (char*)"node", (char*)"fifo", (char*)"busypoll",
+        (char*)"mlock", nullptr
+    };
+    char *val;
+
+    while (*str != 0)
+    {
+        switch (getsubopt(&str, keys, &val))
+        {
+        case CPUS:
+            if (val == nullptr || parseCpus(val) != 0)
+            {
+                log.error("Runtime::parse: Invalid CPU list %s.",
+                    val == nullptr ? "" : val);
+                return 1;
+            }
+            break;
+        case NODE:
+            node = val == nullptr ? -1 : atoi(val);
+            if (node < 0 || node >= 64 || loadNode() != 0)
+            {
+                log.error("Runtime::parse: Invalid NUMA node %s.",
+                    val == nullptr ? "" : val);
+                return 1;
+            }
+            break;
+        case FIFO:
+            fifoPrio = val == nullptr ? DEF_FIFO_PRIO : atoi(val);
+            if (fifoPrio < sched_get_priority_min(SCHED_FIFO) ||
+                fifoPrio > sched_get_priority_max(SCHED_FIFO))
+            {
+                log.error("Runtime::parse: SCHED_FIFO priority %d out of "
+                    "range.", fifoPrio);
+                return 1;
+            }
+            break;
+        case BUSYPOLL:
+            busyPollUs = val == nullptr ? 0 : atoi(val);
+            if (busyPollUs <= 0)
+            {
+                log.error("Runtime::parse: Invalid busy poll time %s.",
+                    val == nullptr ? "" : val);
+                return 1;
+            }
+            break;
+        case MLOCK:
+            lock = 1;
+            break;
+        default:
+            log.error("Runtime::parse: Unknown setting %s.", val);
+            return 1;
+        }
+    }
+
+    if (node >= 0)
+    {
+        for (int cpu : cpus)
+        {
+            if (!CPU_ISSET(cpu, &nodeCpus))
+            {
+                log.warning("Runtime::parse: CPU %d is not on node %d.",
+                    cpu, node);
+            }
+        }
+    }
+    return 0;
+}
+
+void Runtime::applyProcess()
+{
+    char errbuf[64];
+
+    if (node >= 0)
+    {
+        // threads started afterwards inherit the policy
+        unsigned long mask = 1UL << node;
+        if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask,
+            sizeof(mask) * 8) < 0)
+        {
+            log.warning("Runtime::applyProcess: Cannot prefer memory of "
+                "node %d(%s).", node, Log::strerror(errbuf));
+        }
+        else
+        {
+            log.message("Runtime::applyProcess: Preferring memory of node "
+                "%d.", node);
+        }
+    }
+    if (lock)
+    {
+        if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+        {
+            log.warning("Runtime::applyProcess: mlockall() failed(%s), "
+                "check RLIMIT_MEMLOCK(ulimit -l).", Log::strerror(errbuf));
+        }
+        else
+        {
+            log.message("Runtime::applyProcess: Memory locked.");
+        }
+    }
+}
+
+void Runtime::applySocket(int fd)
+{
+    char errbuf[64];
+    int val = busyPollUs;
+    socklen_t len = sizeof(val);
+
+    if (busyPollUs == 0)
+    {
+        return;
+    }
+    // raising the busy poll time above net.core.busy_read takes
+    // CAP_NET_ADMIN
+    if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &val, sizeof(val)) < 0 ||
+        getsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &val, &len) < 0)
+    {
+        log.warning("Runtime::applySocket: Cannot busy poll(%s).",
+            Log::strerror(errbuf));
+        return;
+    }
+    log.message("Runtime::applySocket: Busy polling socket %d for %d us.",
+        fd, val);
+}
+
+void Runtime::applyThread(const char *name)
+{
+    char errbuf[64];
+    char cpu[32] = "any CPU";
+    char sched[32] = "SCHED_OTHER";
+    int k = threads.fetch_add(1);
+    int err;
+
+    if (!cpus.empty() || node >= 0)
+    {
+        cpu_set_t set;
+        if (!cpus.empty())
+        {
+            CPU_ZERO(&set);
+            CPU_SET(cpus[k % cpus.size()], &set);
+        }
+        else
+        {
+            set = nodeCpus;
+        }
+        if ((err = pthread_setaffinity_np(pthread_self(), sizeof(set),
+            &set)) != 0)
+        {
+            errno = err;
+            log.warning("Runtime::applyThread: Cannot pin %s(%s).", name,
+                Log::strerror(errbuf));
+        }
+        else if (!cpus.empty())
+        {
+            snprintf(cpu, sizeof(cpu), "CPU %d", cpus[k % cpus.size()]);
+        }
+        else
+        {
+            snprintf(cpu, sizeof(cpu), "node %d", node);
+        }
+    }
+    if (fifoPrio > 0)
+    {
+        sched_param param;
+        param.sched_priority = fifoPrio;
+        if ((err = pthread_setschedparam(pthread_self(), SCHED_FIFO,
+            &param)) != 0)
+        {
+            errno = err;
+            log.warning("Runtime::applyThread: Cannot run %s SCHED_FIFO"
+                "(%s).", name, Log::strerror(errbuf));
+        }
+        else
+        {
+            snprintf(sched, sizeof(sched), "SCHED_FIFO %d", fifoPrio);
+        }
+    }
+    if (!isEmpty())
+    {
+        log.message("Runtime::applyThread: %s on %s, %s.", name, cpu,
+            sched);
+    }
+}
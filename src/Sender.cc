@@ -1,50 +1,209 @@
+#include <poll.h>
 #include <signal.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 
-#include <chrono>
 #include <thread>
 
+#include "Batch.hh"
 #include "Log.hh"
+#include "Metrics.hh"
+#include "Pacer.hh"
+#include "Runtime.hh"
+#include "Stats.hh"
+#include "TestPlan.hh"
+#include "Timestamp.hh"
+#include "Uring.hh"
 #include "Util.hh"
 
 static char usage[] = 
     "Usage: %s [OPTIONS] \n"
+    "  -B [burst]\n"
+    "    Send data packets in bursts of [burst] packets per system call. The\n"
+    "    interval is applied per packet, i.e. bursts are [burst] * [interval]\n"
+    "    microseconds apart.\n"
+    "    Default: 1\n"
     "  -b [IP]\n"
     "    Set the source address to [IP].\n"
     "    Default: Let the system to determine.\n"
+    "  -d [path]\n"
+    "    Dump a binary summary of the run statistics(counters and RTT\n"
+    "    histogram) to [path] on exit.\n"
+    "  -g\n"
+    "    Coalesce bursts into UDP GSO (UDP_SEGMENT) messages if the system\n"
+    "    supports it.\n"
     "  -h\n"
     "    Display this message and quit.\n"
+    "  -j [workers]\n"
+    "    Serve receivers with [workers] pairs of threads, each on its own\n"
+    "    SO_REUSEPORT socket bound to the listening port. The kernel\n"
+    "    assigns every receiver to one worker. At most 32.\n"
+    "    Default: 1\n"
     "  -i [interval]\n"
     "    Set the [interval] in microseconds between two data packets.\n"
     "    Default: 100\n"
     "  -l [port] (REQUIRED)\n"
     "    Listen on [port].\n"
+    "  -M [name]\n"
+    "    Publish live counters as shared memory object [name], for\n"
+    "    udpnetprobe-stat [name] to watch.\n"
+    "    Default: none(not published)\n"
+    "  -N [count]\n"
+    "    Stop after sending [count] data packets to every receiver, 0 for no\n"
+    "    limit. Ignored with -P.\n"
+    "    Default: 1000000\n"
+    "  -O [profile]\n"
+    "    Tune the host for low jitter. [profile] is a comma separated list\n"
+    "    of cpus=[list](pin the probe threads in turn to the CPUs of [list],\n"
+    "    e.g. 2-3:6), node=[node](keep memory and unpinned threads on NUMA\n"
+    "    node [node]), fifo[=prio](SCHED_FIFO, priority 50 by default),\n"
+    "    busypoll=[us](SO_BUSY_POLL) and mlock(lock all memory). What took\n"
+    "    effect is logged at startup.\n"
+    "  -P [path]\n"
+    "    Run every receiver through the test plan in [path] instead of a\n"
+    "    single run, and print statistics for each of its phases. Every line\n"
+    "    of the plan is a phase of key=value pairs out of name, rate(as -R),\n"
+    "    interval(as -i), size(as -s), count(packets), duration(seconds),\n"
+    "    ack(ACK ratio, as -n of the Receiver), warmup and cooldown\n"
+    "    (seconds), e.g.\n"
+    "      name=slow rate=10kpps size=200 duration=5 warmup=1 cooldown=1\n"
+    "    Packets sent during warm-up are not measured. Unset rates and sizes\n"
+    "    are taken from the options.\n"
+    "  -R [rate]\n"
+    "    Send data packets at [rate] to every receiver instead of using\n"
+    "    -i. [rate] is a number of packets per second, optionally with the\n"
+    "    suffix pps, kpps or Mpps, or of payload bits per second with the\n"
+    "    suffix bps, kbps, Mbps or Gbps, e.g. 200kpps or 1.5Gbps.\n"
+    "  -r [num]\n"
+    "    Receive up to [num] datagrams per system call.\n"
+    "    Default: 64\n"
+    "  -S [seconds]\n"
+    "    Print live statistics every [seconds] seconds. Statistics are\n"
+    "    always printed on exit.\n"
+    "    Default: 0(disabled)\n"
     "  -s [size]\n"
     "    Set the size of data packets.\n"
     "    Default: 1400\n"
+    "  -T [mode][,lookahead]\n"
+    "    Choose who holds packets back until they are due: user(this\n"
+    "    program), fq or etf(the qdisc, through per-packet SO_TXTIME\n"
+    "    transmit times in CLOCK_MONOTONIC for fq or CLOCK_TAI for etf),\n"
+    "    or rate(fq, through SO_MAX_PACING_RATE on every socket, which then\n"
+    "    serves a single receiver at a time per worker). In the\n"
+    "    kernel modes packets are handed over up to [lookahead]\n"
+    "    microseconds(default 1000) early. The egress qdisc must be set up\n"
+    "    accordingly, otherwise packets leave as soon as they are handed\n"
+    "    over. Falls back to user if the kernel rejects the mode.\n"
+    "    Default: user\n"
+    "  -t [clock]\n"
+    "    Timestamp compact performance log records with [clock], one of\n"
+    "    coarse(CLOCK_REALTIME_COARSE), realtime(CLOCK_REALTIME), software\n"
+    "    (kernel SO_TIMESTAMPING) or hardware(NIC SO_TIMESTAMPING, falls\n"
+    "    back to software per packet). The clock of every record is logged.\n"
+    "    Default: coarse\n"
+    "  -u\n"
+    "    Receive ACKs and START instructions with a multishot receive on an\n"
+    "    io_uring per worker, into registered buffers. Sending and pacing\n"
+    "    are unchanged. Falls back to the socket if the kernel cannot do\n"
+    "    this(linux 6.0 and on can).\n"
+    "  -V [level]\n"
+    "    Print verbose messages up to [level], including per-packet traces\n"
+    "    at level 1. Messages are formatted by the logging thread.\n"
+    "    Default: 0(disabled)\n"
     "  -v\n"
     "    Display version information.\n"
+    "  -W [us]\n"
+    "    Busy-wait for the last [us] microseconds before a send is due\n"
+    "    instead of sleeping, trading CPU time for pacing precision. The\n"
+    "    pacing error is printed on exit.\n"
+    "    Default: 20\n"
     "  -w [path] (default none(no output))\n"
     "    Print compact performance log to [path]. Print to stdout if [path]\n"
-    "    is \"-\".\n";
+    "    is \"-\".\n"
+    "  -z [frames]\n"
+    "    Send data packets with MSG_ZEROCOPY out of [frames] page-locked\n"
+    "    copies of the send batch, each reused once the kernel reports it\n"
+    "    done. Pays off for packets of about 10 KB and more. The numbers of\n"
+    "    zero-copy and copied sends are printed on exit.\n"
+    "    Default: 0(disabled)\n";
+
+// both threads of every worker write records, each on a lane of its own
+static const int MAX_WORKERS = CompactRecorder::MAX_LANES / 2;
 
 static sockaddr_in addr = {0};
 static CompactRecorder rec;
 static int pakSize = 1400;
 static int interval = 100;
+static int burst = 1;
+static int useGSO;
+static int useUring;
+static int zeroCopyFrames;
+static int recvBatch = 64;
+static CompactRecorder::Clock recClock = CompactRecorder::Clock::COARSE;
+static int workers = 1;
+static int statsInterval;
+static const char *dumpPath;
+static const char *rateSpec;
+static const char *planPath;
+static long maxPackets = 1000000;
+static TestPlan plan;
+static Runtime runtime;
+static const char *metricsName;
+static Metrics metrics;
+static long spinNs = Pacer::DEF_SPIN_NS;
+
+// who holds packets back until they are due
+enum PacingMode
+{
+    USER,
+    FQ,
+    ETF,
+    RATE
+};
+
+static PacingMode pacing = PacingMode::USER;
+static long lookaheadNs = 1000000;
+
+static int parsePacing(const char *str)
+{
+    static const char *names[] = {"user", "fq", "etf", "rate"};
+    const char *comma = strchr(str, ',');
+    int len = comma == nullptr ? strlen(str) : comma - str;
+
+    if (comma != nullptr)
+    {
+        lookaheadNs = atol(comma + 1) * 1000;
+        if (lookaheadNs <= 0)
+        {
+            return 1;
+        }
+    }
+    for (int i = USER; i <= RATE; ++i)
+    {
+        if ((int)strlen(names[i]) == len && strncmp(str, names[i], len) == 0)
+        {
+            pacing = (PacingMode)i;
+            return 0;
+        }
+    }
+    return 1;
+}
 
 static int parseArguments(int argc, char **argv)
 {
     char c;
     int ret;
     
-    while ((c = getopt(argc, argv, "b:hi:l:s:vw:")) != EOF)
+    while ((c = getopt(argc, argv, 
+        "B:b:d:ghi:j:l:M:N:O:P:R:r:S:s:T:t:uV:vW:w:z:")) != EOF)
     {
         switch (c)
         {
+        case 'B':
+            burst = atoi(optarg);
+            break;
         case 'b':
             if (inet_aton(optarg, &addr.sin_addr) == 0)
             {
@@ -52,23 +211,79 @@ static int parseArguments(int argc, char **argv)
                 return 1;
             }
             break;
+        case 'd':
+            dumpPath = optarg;
+            break;
+        case 'g':
+            useGSO = 1;
+            break;
         case 'h':
-            log.message(usage, argv[0]);
+            log.longMessage(usage, argv[0]);
             return -1;
             break;
         case 'i':
             interval = atoi(optarg);
             break;
+        case 'j':
+            workers = atoi(optarg);
+            break;
         case 'l':
             addr.sin_port = htons(atoi(optarg));
             break;
+        case 'M':
+            metricsName = optarg;
+            break;
+        case 'N':
+            maxPackets = atol(optarg);
+            break;
+        case 'O':
+            if (runtime.parse(optarg) != 0)
+            {
+                return 1;
+            }
+            break;
+        case 'P':
+            planPath = optarg;
+            break;
+        case 'R':
+            rateSpec = optarg;
+            break;
+        case 'r':
+            recvBatch = atoi(optarg);
+            break;
+        case 'S':
+            statsInterval = atoi(optarg);
+            break;
         case 's':
             pakSize = atoi(optarg);
             break;
+        case 'T':
+            if (parsePacing(optarg) != 0)
+            {
+                log.error("parseArguments: Invalid pacing mode %s", optarg);
+                return 1;
+            }
+            break;
+        case 't':
+            if (CompactRecorder::parseClock(optarg, recClock) != 0)
+            {
+                log.error("parseArguments: Unknown clock %s", optarg);
+                return 1;
+            }
+            break;
+        case 'u':
+            useUring = 1;
+            break;
+        case 'V':
+            log.setVerboseLevel(atoi(optarg));
+            break;
         case 'v':
             log.message("Version: %s\n", VERSION);
             return -1;
             break;
+        case 'W':
+            spinNs = atol(optarg) * 1000;
+            break;
         case 'w':
             if ((ret = rec.init(optarg)) != 0)
             {
@@ -76,6 +291,9 @@ static int parseArguments(int argc, char **argv)
                 return -1;
             }
             break;
+        case 'z':
+            zeroCopyFrames = atoi(optarg);
+            break;
         default:
             log.error("parseArguments: Unrecognized option %c(%d)", c, c);
             return 2;
@@ -87,119 +305,1001 @@ static int parseArguments(int argc, char **argv)
         log.error("parseArguments: Port to listen on not specified.");
         return 3;
     }
+    if (workers < 1 || workers > MAX_WORKERS)
+    {
+        log.error("parseArguments: Number of workers %d out of range "
+            "[1, %d].", workers, (int)MAX_WORKERS);
+        return 4;
+    }
+    if (recvBatch < 1 || recvBatch > 1024)
+    {
+        log.error("parseArguments: Receive batch size %d out of range "
+            "[1, 1024].", recvBatch);
+        return 4;
+    }
+    if (burst < 1 || burst > 1024)
+    {
+        log.error("parseArguments: Burst size %d out of range [1, 1024].",
+            burst);
+        return 4;
+    }
+    if (pakSize < (int)sizeof(DataMessage) || pakSize > 65507)
+    {
+        log.error("parseArguments: Packet size %d out of range [%d, 65507].",
+            pakSize, (int)sizeof(DataMessage));
+        return 4;
+    }
+    if (zeroCopyFrames < 0 || zeroCopyFrames > 64)
+    {
+        log.error("parseArguments: Number of zero-copy frames %d out of "
+            "range [0, 64].", zeroCopyFrames);
+        return 4;
+    }
+    if (spinNs < 0)
+    {
+        log.error("parseArguments: Negative busy-wait time.");
+        return 4;
+    }
+
+    if (maxPackets < 0)
+    {
+        log.error("parseArguments: Negative packet count.");
+        return 4;
+    }
+
+    // without a plan, the options make up a single phase
+    TestPlan::Phase phase;
+    memset(&phase, 0, sizeof(phase));
+    snprintf(phase.name, sizeof(phase.name), "run");
+    phase.intervalNs = interval * 1000.0;
+    phase.size = pakSize;
+    phase.count = maxPackets;
+    if (rateSpec != nullptr)
+    {
+        double pps;
+        if (Pacer::parseRate(rateSpec, pakSize, pps) != 0)
+        {
+            log.error("parseArguments: Invalid rate %s.", rateSpec);
+            return 4;
+        }
+        phase.intervalNs = 1e9 / pps;
+        if (planPath == nullptr)
+        {
+            log.message("parseArguments: Sending %.0lf packets per second "
+                "(%.2lf Mbit/s) to every receiver.", pps, 
+                pps * pakSize * 8 / 1e6);
+        }
+    }
+    if (planPath == nullptr)
+    {
+        plan.add(phase);
+    }
+    else if (plan.load(planPath, phase) != 0)
+    {
+        log.error("parseArguments: Invalid test plan %s.", planPath);
+        return 4;
+    }
+    if (pacing == PacingMode::RATE && plan.size() > 1)
+    {
+        log.error("parseArguments: The pacing rate of a socket cannot follow "
+            "the phases of a test plan, use -T fq instead.");
+        return 4;
+    }
 
     return 0;
 }
 
-static long recvBuf[65536 / sizeof(long)], sendBuf[65536 / sizeof(long)];
-static Message *rmsg = (Message*)recvBuf, *smsg = (Message*)sendBuf;
+// statistics of a flow in one phase of a -P test plan. `stats` is started
+// by the sending thread when measuring begins, and `end` set when it stops;
+// both are published by `Flow::phasesDone`.
+struct PhaseStats
+{
+    RunStats stats;
+    long end;
+};
+
+// per-receiver state.
+// a flow is created by the receiving thread of its shard on the first START
+// instruction from an address, and published to the sending thread by
+// incrementing `Shard::flowCount`. a flow whose receiver has been silent
+// for FLOW_TIMEOUT seconds is no longer served: the sending thread parks
+// it and leaves it alone. once the table is full, the receiving thread
+// gives the slot of a parked flow to the next new receiver, and publishes
+// it again through `lastHeard`.
+struct Flow
+{
+    // immutable while served
+    sockaddr_in client;
+    int id;
+    char name[32];
+
+    // sending thread only
+    long seq;
+    long sent;
+    // current phase of the plan, and packets sent and measured in it
+    int phase;
+    long phaseSent;
+    long measured;
+    // start of the schedule of the phase and due time of the next burst
+    // (CLOCK_MONOTONIC ns). due times are computed from the start, so
+    // rounding does not accumulate.
+    long start;
+    long next;
+    // when the phase starts to be measured, and when it stopped sending(0
+    // while it is sending)
+    long measureFrom;
+    long stopped;
+    int init;
+
+    // receiving thread only
+    long acked;
+    long lastReport;
+    int phasesReported;
+
+    // last time(ns) anything was heard from the receiver
+    std::atomic<long> lastHeard;
+    // set by the sending thread when it stops serving the flow, cleared
+    // when it serves it again
+    std::atomic<int> parked;
+    RunStats stats;
+    // one per phase, with -P only
+    UniqueSmart<PhaseStats[]> phases;
+    // phases whose cool-down is over
+    std::atomic<int> phasesDone;
+};
+
+// one socket with its pair of threads
+struct Shard
+{
+    static const int MAX_FLOWS = 64;
+
+    int id;
+    int fd;
+    UniqueSmart<Flow[]> flows;
+    std::atomic<int> flowCount;
+    // receiving thread only: open-addressing index of `flows` by address
+    int index[MAX_FLOWS * 2];
+    // receiving thread only: flows whose slots were given away
+    RunStats retired;
+    int retiredCount;
+};
+
+static const int FLOW_TIMEOUT = 10;
+
 static int silent;
-static sockaddr_in currentClient;
 static int toAbort;
+static UniqueSmart<Shard[]> shards;
+
+// print the summary of phase `p` of `flow`, measured until `end`.
+static void reportPhase(Flow &flow, int p, long end)
+{
+    char name[80];
+
+    snprintf(name, sizeof(name), "%s/%s", flow.name, plan[p].name);
+    flow.phases[p].stats.finish(name, end);
+}
+
+// print what is left of the summaries of `flow` at `now`(ns): the phases
+// not reported yet and the whole run. the sending thread must be done with
+// the flow.
+static void retireFlow(Flow &flow, long now)
+{
+    if (planPath != nullptr)
+    {
+        // phases cut short
+        for (int p = flow.phasesReported; p < plan.size(); ++p)
+        {
+            if (p < flow.phase)
+            {
+                reportPhase(flow, p, flow.phases[p].end);
+            }
+            else if (p == flow.phase && flow.measured > 0)
+            {
+                reportPhase(flow, p, flow.stopped == 0 ? now : 
+                    flow.phases[p].end);
+            }
+        }
+    }
+    flow.stats.finish(flow.name, now);
+}
+
+static inline unsigned long flowKey(const sockaddr_in &client)
+{
+    return ((unsigned long)client.sin_addr.s_addr << 16) | client.sin_port;
+}
+
+// position of `key` in the index of `shard`: the one holding it, or the
+// empty one it would go to.
+static int indexOf(Shard &shard, unsigned long key)
+{
+    int mask = Shard::MAX_FLOWS * 2 - 1;
+    int pos = (key * 0x9e3779b97f4a7c15ul) >> 57 & mask;
+
+    for (int i = 0; i <= mask; ++i, pos = (pos + 1) & mask)
+    {
+        if (shard.index[pos] < 0 || 
+            flowKey(shard.flows[shard.index[pos]].client) == key)
+        {
+            break;
+        }
+    }
+    return pos;
+}
+
+// the flow of `client`. if there is none and `create`, a new one in a free
+// slot, or in the slot of the parked flow silent for the longest time at
+// `now`(ns) once the table is full; nullptr if there is neither. a slot
+// given away is published again when the caller stores `lastHeard`.
+static Flow* findFlow(Shard &shard, const sockaddr_in &client, int create,
+    long now)
+{
+    int pos = indexOf(shard, flowKey(client));
+
+    if (shard.index[pos] >= 0)
+    {
+        return &shard.flows[shard.index[pos]];
+    }
+    if (!create)
+    {
+        return nullptr;
+    }
+
+    int n = shard.flowCount.load(std::memory_order_relaxed);
+    int reuse = n >= Shard::MAX_FLOWS;
+    if (reuse)
+    {
+        long oldest = now - FLOW_TIMEOUT * 1000000000L;
+        n = -1;
+        for (int f = 0; f < Shard::MAX_FLOWS; ++f)
+        {
+            Flow &flow = shard.flows[f];
+            long heard = flow.lastHeard.load(std::memory_order_relaxed);
+            if (heard < oldest && 
+                flow.parked.load(std::memory_order_acquire))
+            {
+                oldest = heard;
+                n = f;
+            }
+        }
+        if (n < 0)
+        {
+            return nullptr;
+        }
+        Flow &old = shard.flows[n];
+        log.message("recvMain: Flow %d of %s timed out, slot given to "
+            "%s:%d.", old.id, old.name, inet_ntoa(client.sin_addr), 
+            ntohs(client.sin_port));
+        retireFlow(old, now);
+        shard.retired.merge(old.stats);
+        ++shard.retiredCount;
+    }
 
-void sendMain(int fd)
+    // records of a reused slot carry the id of the flow that had it before
+    Flow &flow = shard.flows[n];
+    flow.client = client;
+    flow.id = shard.id * Shard::MAX_FLOWS + n;
+    snprintf(flow.name, sizeof(flow.name), "%s:%d", 
+        inet_ntoa(client.sin_addr), ntohs(client.sin_port));
+    flow.seq = flow.sent = flow.acked = 0;
+    flow.phase = flow.phasesReported = 0;
+    flow.measured = 0;
+    flow.phasesDone.store(0, std::memory_order_relaxed);
+    if (planPath != nullptr)
+    {
+        flow.phases = std::make_unique<PhaseStats[]>(plan.size());
+    }
+    flow.init = 1;
+    if (!reuse)
+    {
+        shard.index[pos] = n;
+        shard.flowCount.store(n + 1, std::memory_order_release);
+        return &flow;
+    }
+
+    // linear probing cannot delete the old address, index all over again
+    flow.stats.reset();
+    memset(shard.index, -1, sizeof(shard.index));
+    for (int f = 0; f < Shard::MAX_FLOWS; ++f)
+    {
+        shard.index[indexOf(shard, flowKey(shard.flows[f].client))] = f;
+    }
+    return &flow;
+}
+
+// whether any flow of `shard` is served, or about to be, at `now`(ns).
+static int hasLiveFlow(Shard &shard, long now)
 {
+    int n = shard.flowCount.load(std::memory_order_relaxed);
+
+    for (int f = 0; f < n; ++f)
+    {
+        Flow &flow = shard.flows[f];
+        if (!flow.parked.load(std::memory_order_relaxed) || 
+            now - flow.lastHeard.load(std::memory_order_relaxed) <= 
+            FLOW_TIMEOUT * 1000000000L)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// start sending the current phase of `flow` at `now`(CLOCK_MONOTONIC ns),
+// which is `nowNs` on CLOCK_REALTIME.
+static void beginPhase(Flow *flow, long now, long nowNs)
+{
+    const TestPlan::Phase &phase = plan[flow->phase];
+
+    flow->start = flow->next = now;
+    flow->phaseSent = flow->measured = 0;
+    flow->measureFrom = now + phase.warmupNs;
+    flow->stopped = 0;
+    if (flow->phases != nullptr)
+    {
+        flow->phases[flow->phase].stats.start(nowNs + phase.warmupNs);
+        log.message("sendMain: %s enters phase %s.", flow->name, 
+            phase.name);
+    }
+}
+
+// serve `flow` again at `now`(CLOCK_MONOTONIC ns) after it was parked.
+// the schedule starts over from `now`, so that the packets due while the
+// receiver was silent are not sent back to back, and the time spent parked
+// does not count towards the measured duration.
+static void resumeFlow(Flow *flow, long now)
+{
+    long gap = now - flow->next;
+
+    if (gap <= 0)
+    {
+        return;
+    }
+    if (flow->stopped == 0)
+    {
+        flow->measureFrom += gap;
+    }
+    flow->start = flow->next = now;
+    flow->phaseSent = 0;
+}
+
+// whether the current phase of `flow` has been measured long enough
+static int phaseOver(const Flow *flow)
+{
+    const TestPlan::Phase &phase = plan[flow->phase];
+
+    return (phase.count > 0 && flow->measured >= phase.count) ||
+        (phase.durationNs > 0 && 
+        flow->next >= flow->measureFrom + phase.durationNs);
+}
+
+void sendMain(Shard *shard)
+{
+    char name[16];
+    snprintf(name, sizeof(name), "sendMain %d", shard->id);
+    // before anything is allocated, so that memory is local to the CPU
+    runtime.applyThread(name);
+
+    int fd = shard->fd;
     long sent = 0;
     char errbuf[64];
-    int init = 1;
-    auto st = std::chrono::system_clock::now();
+    Metrics::Slot *counters = metrics.getSlot();
+    SendBatch batch(burst < 64 ? 64 : burst, plan.maxSize());
+    TxTimestamps tx(rec);
+    // owner of every packet in `batch`
+    UniqueSmart<Flow*[]> owners = std::make_unique<Flow*[]>(batch.capacity);
+    UniqueSmart<long[]> seqs = std::make_unique<long[]>(batch.capacity);
+    // due time of every burst in `batch` paced in userspace
+    UniqueSmart<long[]> dues = std::make_unique<long[]>(batch.capacity);
+    int paced = 0;
 
-    smsg->type = MessageType::DATA;
-    smsg->value = 0;
-    while (!toAbort)
+    Pacer pacer(spinNs);
+    // how early packets are handed to the kernel, and the offset of the
+    // qdisc clock for transmit times
+    long ahead = 0;
+    long txOffset = 0;
+    int invalidReported = 0;
+
+    tx.init(fd, recClock);
+    if (useGSO)
+    {
+        batch.enableGSO(fd);
+    }
+    if (zeroCopyFrames > 0 && batch.enableZeroCopy(fd, zeroCopyFrames) == 0)
     {
-        socklen_t len = sizeof(currentClient);
-        if (currentClient.sin_addr.s_addr == 0|| sent >= 1000000)
+        tx.setZeroCopy(&batch);
+    }
+    if (pacing == PacingMode::FQ || pacing == PacingMode::ETF)
+    {
+        clockid_t clock = pacing == PacingMode::FQ ? 
+            CLOCK_MONOTONIC : CLOCK_TAI;
+        if (batch.enableTxTime(fd, clock) == 0)
         {
-            std::this_thread::sleep_for(std::chrono::milliseconds(20));
-            continue;
+            ahead = lookaheadNs;
+            txOffset = clock == CLOCK_MONOTONIC ? 0 : 
+                Pacer::clockOffset(clock);
+            tx.setWatchTxTime(1);
         }
-        else if (init)
+    }
+    else if (pacing == PacingMode::RATE)
+    {
+        // the rate of a single flow: recvMain keeps the socket to one
+        if (Pacer::setMaxRate(fd, (plan[0].size + Pacer::WIRE_OVERHEAD) * 
+            1e9 / plan[0].intervalNs) == 0)
         {
-            st = std::chrono::system_clock::now();
-            init = 0;
+            ahead = lookaheadNs;
         }
-        
-		if (sendto(fd, sendBuf, pakSize, 0, 
-			(struct sockaddr*)&currentClient, len) == -1)
-		{
-			log.error("sendMain: Socket broken when sending(%s).", 
-                Log::strerror(errbuf));
-			toAbort = 1;
-			return;
-		}
+    }
+    if (pacing != PacingMode::USER && ahead == 0)
+    {
+        log.warning("sendMain: Kernel pacing unavailable, pacing in "
+            "userspace.");
+    }
+
+    while (!toAbort)
+    {
+        int nflow = shard->flowCount.load(std::memory_order_acquire);
+        long now = Pacer::now();
+        long wake = now + 20000000L;
+        long nowNs = getNanoTime();
 
-        log.verbose("sendMain: Packet %ld sent.", smsg->value);
-		++sent;
-            if (sent == 1000000)
+        for (int f = 0; f <= nflow; ++f)
+        {
+            Flow *flow = f < nflow ? &shard->flows[f] : nullptr;
+            const TestPlan::Phase *phase = nullptr;
+            int n = 0;
+            int measuring = 0;
+
+            if (flow != nullptr)
             {
-                log.message("SENT");
+                if (nowNs - flow->lastHeard.load(std::memory_order_acquire) 
+                    > FLOW_TIMEOUT * 1000000000L)
+                {
+                    // from here on the receiving thread may reuse the slot
+                    if (!flow->parked.load(std::memory_order_relaxed))
+                    {
+                        flow->parked.store(1, std::memory_order_release);
+                    }
+                    continue;
+                }
+                if (flow->parked.load(std::memory_order_relaxed))
+                {
+                    flow->parked.store(0, std::memory_order_relaxed);
+                    if (!flow->init)
+                    {
+                        resumeFlow(flow, now);
+                    }
+                }
+                if (flow->phase >= plan.size())
+                {
+                    continue;
+                }
+                if (flow->init)
+                {
+                    beginPhase(flow, now, nowNs);
+                    flow->init = 0;
+                }
+                if (flow->stopped == 0 && phaseOver(flow))
+                {
+                    flow->stopped = flow->next > now ? flow->next : now;
+                    if (flow->phases != nullptr)
+                    {
+                        flow->phases[flow->phase].end = 
+                            nowNs + (flow->stopped - now);
+                    }
+                }
+                if (flow->stopped != 0)
+                {
+                    // cool down, then move on to the next phase
+                    long until = flow->stopped + 
+                        plan[flow->phase].cooldownNs;
+                    if (until > now)
+                    {
+                        if (until < wake)
+                        {
+                            wake = until;
+                        }
+                        continue;
+                    }
+                    flow->phasesDone.store(++flow->phase, 
+                        std::memory_order_release);
+                    if (flow->phase == plan.size())
+                    {
+                        log.message("SENT");
+                        continue;
+                    }
+                    beginPhase(flow, now, nowNs);
+                }
+                if (flow->next - ahead > now)
+                {
+                    if (flow->next - ahead < wake)
+                    {
+                        wake = flow->next - ahead;
+                    }
+                    continue;
+                }
+
+                phase = &plan[flow->phase];
+                measuring = flow->next >= flow->measureFrom;
+                n = burst;
+                if (measuring && phase->count > 0 && 
+                    n > phase->count - flow->measured)
+                {
+                    n = phase->count - flow->measured;
+                }
             }
-        rec.write(smsg->value++, CompactRecorder::Type::SENT);
-        std::this_thread::sleep_until(
-            st += std::chrono::microseconds(interval));
-	}
+
+            // make room for this burst, or send the rest after the last flow
+            if (batch.size() > 0 && 
+                (flow == nullptr || batch.size() + n > batch.capacity))
+            {
+                int base = 0;
+                // the bursts leave now, however late the loop got to them
+                long flushed = Pacer::now();
+                for (int i = 0; i < paced; ++i)
+                {
+                    pacer.record(dues[i], flushed);
+                }
+                if (paced > 0)
+                {
+                    counters->begin();
+                    counters->add(Metrics::PACED, paced);
+                    for (int i = 0; i < paced; ++i)
+                    {
+                        counters->add(Metrics::PACE_ERROR_NS, 
+                            flushed - dues[i]);
+                    }
+                    counters->end();
+                    paced = 0;
+                }
+                if (batch.flush(fd) < 0)
+                {
+                    log.error("sendMain: Socket broken when sending(%s).", 
+                        Log::strerror(errbuf));
+                    toAbort = 1;
+                    return;
+                }
+                for (int i = 0; i < batch.messageCount(); ++i)
+                {
+                    int k = batch.messagePackets(i);
+                    tx.sent(seqs[base], k, CompactRecorder::Type::SENT,
+                        owners[base]->id);
+                    for (int j = 0; j < k; ++j)
+                    {
+                        log.verbose("sendMain: Packet %ld to %s sent.",
+                            seqs[base + j], owners[base + j]->name);
+                    }
+                    base += k;
+                }
+                tx.reap(fd);
+                // the next frame may still be in the hands of the kernel
+                while (batch.isBusy() && !toAbort)
+                {
+                    pollfd pfd = {fd, 0, 0};
+                    poll(&pfd, 1, 10);
+                    tx.reap(fd);
+                }
+                sent += base;
+                counters->begin();
+                counters->add(Metrics::SENT, base);
+                counters->end();
+                if (ahead > 0 && pacing != PacingMode::RATE && 
+                    !batch.isTxTime())
+                {
+                    log.warning("sendMain: Pacing in userspace from now "
+                        "on.");
+                    ahead = 0;
+                }
+                if (tx.getTxTimeInvalid() > 0 && !invalidReported)
+                {
+                    log.error("sendMain: The qdisc drops packets with "
+                        "invalid transmit times, check -T against its "
+                        "clock.");
+                    invalidReported = 1;
+                }
+            }
+            if (flow == nullptr)
+            {
+                break;
+            }
+
+            // the whole burst leaves in one system call. packets handed
+            // over early carry the time they are due.
+            long due = flow->next > now ? flow->next : now;
+            if (ahead == 0 && n > 0)
+            {
+                dues[paced++] = flow->next;
+            }
+            int tag = measuring && flow->phases != nullptr ? flow->phase : -1;
+            for (int i = 0; i < n; ++i)
+            {
+                owners[batch.size()] = flow;
+                seqs[batch.size()] = flow->seq;
+                DataMessage *msg = (DataMessage*)batch.add(flow->client, 
+                    phase->size, due + txOffset);
+                msg->hdr.type = MessageType::DATA;
+                msg->hdr.value = flow->seq++;
+                msg->sendTime = nowNs + (due - now);
+                msg->phase = tag;
+                msg->ackRatio = phase->ackRatio;
+            }
+            flow->sent += n;
+            flow->phaseSent += n;
+            flow->stats.onSent(n, phase->size);
+            if (measuring)
+            {
+                flow->measured += n;
+            }
+            if (tag >= 0)
+            {
+                flow->phases[tag].stats.onSent(n, phase->size);
+            }
+            flow->next = flow->start + (long)(flow->phaseSent * 
+                phase->intervalNs);
+            if (flow->next < wake)
+            {
+                wake = flow->next;
+            }
+        }
+
+        pacer.waitUntil(wake);
+    }
     
+    tx.finish(fd);
     log.message("sendMain: %ld packets sent.", sent);
+    if (tx.getTxTimeMissed() + tx.getTxTimeInvalid() > 0)
+    {
+        log.warning("sendMain: The qdisc dropped %ld packets that missed "
+            "their transmit time and %ld with invalid ones.", 
+            tx.getTxTimeMissed(), tx.getTxTimeInvalid());
+    }
+    snprintf(name, sizeof(name), "shard %d", shard->id);
+    pacer.report(name);
+    if (batch.isZeroCopy())
+    {
+        log.message("sendMain: %ld sends zero-copy, %ld copied.", 
+            batch.getZeroCopied(), batch.getCopied());
+    }
 }
 
-void recvMain(int fd)
+// count the ACK of packet `seq` of `flow` in `phase`(-1 if none). `rtt`
+// and `dwell` are -1 if unknown.
+static void onAck(Flow *flow, long seq, long rtt, long dwell, int phase,
+    Metrics::Slot *counters)
 {
-    long acked = 0;
-    int size;
-    sockaddr_in clientInfo;
-    char errbuf[64];
+    flow->stats.onAck(seq, rtt, dwell);
+    counters->begin();
+    counters->add(Metrics::ACKED, 1);
+    if (rtt >= 0)
+    {
+        counters->addRtt(rtt);
+    }
+    counters->end();
+    if (flow->phases != nullptr && phase >= 0 && phase < plan.size())
+    {
+        flow->phases[phase].stats.onAck(seq, rtt, dwell);
+    }
+}
 
-    while (!toAbort)
+// handle message `rmsg` of `len` bytes from `client`, read at `batchTime`
+// with ancillary data `hdr`. `acked` counts the packets ACKed.
+static void onMessage(Shard *shard, const Message *rmsg, int len, 
+    const sockaddr_in &client, const msghdr *hdr, long batchTime, 
+    long &acked, Metrics::Slot *counters)
+{
+    Flow *flow;
+
+    if (len < (int)sizeof(Message))
+    {
+        return;
+    }
+
+    switch (rmsg->type)
     {
-        socklen_t len = sizeof(currentClient);
-        if ((size = recvfrom(fd, recvBuf, 65536, MSG_DONTWAIT, 
-            (struct sockaddr*)&clientInfo, &len)) == -1)
+    case MessageType::INSTRUCTION:
+        if (rmsg->value != Instructions::START)
+        {
+            break;
+        }
+        if ((flow = findFlow(*shard, client, 0, batchTime)) != nullptr)
+        {
+            log.verbose("recvMain: Start instruction from %s.", flow->name);
+            flow->lastHeard.store(batchTime, std::memory_order_relaxed);
+            break;
+        }
+        if (pacing == PacingMode::RATE && hasLiveFlow(*shard, batchTime))
+        {
+            log.warning("recvMain: Socket paced at the rate of a single "
+                "receiver, start instruction from %s:%d ignored.", 
+                inet_ntoa(client.sin_addr), ntohs(client.sin_port));
+            break;
+        }
+        if ((flow = findFlow(*shard, client, 1, batchTime)) == nullptr)
+        {
+            log.warning("recvMain: Flow table full of live flows, start "
+                "instruction from %s:%d ignored.", 
+                inet_ntoa(client.sin_addr), ntohs(client.sin_port));
+            break;
+        }
+        log.message("recvMain: Received start instruction from %s, flow "
+            "%d.", flow->name, flow->id);
+        flow->stats.start(batchTime);
+        flow->lastReport = batchTime;
+        // publishes a reused slot to the sending thread
+        flow->lastHeard.store(batchTime, std::memory_order_release);
+        break;
+    case MessageType::ACK:
+        if ((flow = findFlow(*shard, client, 0, batchTime)) == nullptr)
         {
-            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            log.warning("recvMain: ACK of packet %ld from unknown "
+                "receiver %s:%d.", rmsg->value, inet_ntoa(client.sin_addr), 
+                ntohs(client.sin_port));
+        }
+        else
+        {
+            log.verbose("recvMain: ACK of packet %ld from %s received.", 
+                rmsg->value, flow->name);
+            ++acked;
+            ++flow->acked;
+            flow->lastHeard.store(batchTime, std::memory_order_relaxed);
+            recordRx(rec, rmsg->value, CompactRecorder::Type::ACKED, hdr, 
+                flow->id);
+            long rtt = -1, dwell = -1;
+            int phase = -1;
+            if (len >= (int)sizeof(AckMessage))
             {
-                std::this_thread::sleep_for(std::chrono::milliseconds(1));
-                continue;
+                const AckMessage *ack = (const AckMessage*)rmsg;
+                long recvTime = getRxTime(hdr, batchTime);
+                rtt = recvTime - ack->echoTime;
+                dwell = ack->ackTime - ack->recvTime;
+                phase = ack->phase;
+
+                log.verbose("recvMain: Packet %ld RTT %ld ns, receiver "
+                    "dwell %ld ns.", rmsg->value, rtt, dwell);
             }
-            else
+            onAck(flow, rmsg->value, rtt, dwell, phase, counters);
+        }
+        break;
+    case MessageType::SACK:
+    {
+        const SackMessage *sack = (const SackMessage*)rmsg;
+        if ((flow = findFlow(*shard, client, 0, batchTime)) == nullptr)
+        {
+            log.warning("recvMain: ACK of packets from %ld from unknown "
+                "receiver %s:%d.", rmsg->value, inet_ntoa(client.sin_addr), 
+                ntohs(client.sin_port));
+            break;
+        }
+        if (len < (int)offsetof(SackMessage, entries) ||
+            sack->received == 0 || len < sack->length())
+        {
+            log.warning("recvMain: Truncated ACK from %s.", flow->name);
+            break;
+        }
+        log.verbose("recvMain: ACK of %d packets from %ld from %s "
+            "received.", sack->packets, rmsg->value, flow->name);
+        flow->lastHeard.store(batchTime, std::memory_order_relaxed);
+
+        long recvTime = getRxTime(hdr, batchTime);
+        for (uint64_t rest = sack->received; rest != 0; rest &= rest - 1)
+        {
+            int k = __builtin_ctzl(rest);
+            long seq = rmsg->value + k;
+            const SackMessage::Entry &entry = sack->entries[k];
+            long rtt = recvTime - entry.echoTime;
+            long dwell = sack->ackTime - sack->baseTime - entry.recvDelta;
+
+            ++acked;
+            ++flow->acked;
+            recordRx(rec, seq, CompactRecorder::Type::ACKED, hdr, flow->id);
+            onAck(flow, seq, rtt, dwell, sack->phase, counters);
+        }
+        break;
+    }
+    default:
+        // ignore
+        break;
+    }
+}
+
+// print the live statistics and the finished phases of the flows of
+// `shard` that are due at `now`.
+static void reportFlows(Shard *shard, long now)
+{
+    int nflow = shard->flowCount.load(std::memory_order_relaxed);
+
+    for (int f = 0; statsInterval > 0 && f < nflow; ++f)
+    {
+        Flow &flow = shard->flows[f];
+        if (now - flow.lastReport >= statsInterval * 1000000000L)
+        {
+            flow.stats.report(flow.name, now);
+            flow.lastReport = now;
+        }
+    }
+    for (int f = 0; planPath != nullptr && f < nflow; ++f)
+    {
+        Flow &flow = shard->flows[f];
+        int done = flow.phasesDone.load(std::memory_order_acquire);
+        for (; flow.phasesReported < done; ++flow.phasesReported)
+        {
+            reportPhase(flow, flow.phasesReported, 
+                flow.phases[flow.phasesReported].end);
+        }
+    }
+}
+
+// recvMain on the socket, with recvmmsg().
+static void recvSocket(Shard *shard, long &acked, Metrics::Slot *counters)
+{
+    int fd = shard->fd;
+    char errbuf[64];
+    RecvBatch batch(recvBatch, 2048);
+
+    RecvBatch::setTimeout(fd, 100);
+    while (!toAbort)
+    {
+        if (batch.receive(fd) < 0)
+        {
+            log.error("recvMain: Socket broken when receiving(%s).",
+                Log::strerror(errbuf));
+            toAbort = 1;
+            return;
+        }
+
+        long batchTime = getNanoTime();
+        for (int i = 0; i < batch.size(); ++i)
+        {
+            onMessage(shard, (Message*)batch.data(i), batch.length(i), 
+                batch.from(i), batch.header(i), batchTime, acked, counters);
+        }
+        reportFlows(shard, batchTime);
+    }
+}
+
+// provided buffers of recvUring
+static const int URING_BUFS = 256;
+static const int URING_BUF_LEN = 2048;
+static const int URING_CONTROL_LEN = 256;
+
+// recvMain on an io_uring: a multishot receive stays armed on the socket
+// and fills provided buffers, and the thread enters the kernel once per
+// batch of completions. the sending thread is not involved. return 1,
+// before anything is received, if the kernel cannot do this.
+static int recvUring(Shard *shard, long &acked, Metrics::Slot *counters)
+{
+    int fd = shard->fd;
+    char errbuf[64];
+    Uring ring;
+    msghdr recvHdr;
+    int armed = 0;
+    long received = 0;
+
+    // multishot recvmsg into provided buffers needs linux 6.0
+    if (ring.init(Uring::DEF_ENTRIES, 0) != 0 || 
+        ring.setupBuffers(URING_BUFS, URING_BUF_LEN, 0) != 0)
+    {
+        return 1;
+    }
+    ring.registerFile(fd);
+
+    // what each buffer holds before the payload
+    memset(&recvHdr, 0, sizeof(recvHdr));
+    recvHdr.msg_namelen = sizeof(sockaddr_in);
+    recvHdr.msg_controllen = URING_CONTROL_LEN;
+
+    while (!toAbort)
+    {
+        if (!armed)
+        {
+            io_uring_sqe *sqe = ring.getSqe();
+            if (sqe == nullptr)
             {
-                log.error("recvMain: Socket broken when receiving(%s).",
-                    Log::strerror(errbuf));
-                toAbort = 1;
-                return;
+                return received == 0;
             }
+            sqe->opcode = IORING_OP_RECVMSG;
+            ring.setFile(sqe, fd);
+            sqe->addr = (uint64_t)&recvHdr;
+            sqe->len = 1;
+            sqe->ioprio = IORING_RECV_MULTISHOT;
+            sqe->flags |= IOSQE_BUFFER_SELECT;
+            sqe->buf_group = 0;
+            armed = 1;
         }
 
-        switch (rmsg->type)
+        // as the socket timeout: come back for the reports every 100ms
+        int ret = ring.submit(1, 100000000L);
+        if (ret < 0 && ret != -ETIME && ret != -EINTR && ret != -EBUSY)
         {
-        case MessageType::INSTRUCTION:
-            if (rmsg->value == Instructions::START)
+            errno = -ret;
+            log.error("recvMain: io_uring_enter() failed(%s).",
+                Log::strerror(errbuf));
+            toAbort = 1;
+            break;
+        }
+
+        long batchTime = getNanoTime();
+        io_uring_cqe *cqe;
+        while ((cqe = ring.peek()) != nullptr)
+        {
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            ring.seen();
+
+            if (!(flags & IORING_CQE_F_MORE))
             {
-                log.message("recvMain: Received start instruction from %s:%d.", 
-                    inet_ntoa(clientInfo.sin_addr), ntohs(clientInfo.sin_port));
-                currentClient = clientInfo;
+                armed = 0;
             }
-            break;
-        case MessageType::ACK:
-            if (currentClient.sin_addr.s_addr != clientInfo.sin_addr.s_addr ||
-                currentClient.sin_port != clientInfo.sin_port)
+            if (res < 0)
             {
-                log.warning("recvMain: ACK of packet %ld from unknown receiver"
-                    "%s:%d.", rmsg->value, inet_ntoa(clientInfo.sin_addr), 
-                    ntohs(clientInfo.sin_port));
+                if (flags & IORING_CQE_F_BUFFER)
+                {
+                    ring.recycle(flags >> IORING_CQE_BUFFER_SHIFT);
+                }
+                if (res == -ENOBUFS || res == -EINTR || res == -EAGAIN)
+                {
+                    // rearmed above
+                    continue;
+                }
+                if ((res == -EINVAL || res == -EOPNOTSUPP) && received == 0)
+                {
+                    return 1;
+                }
+                errno = -res;
+                log.error("recvMain: Socket broken when receiving(%s).",
+                    Log::strerror(errbuf));
+                toAbort = 1;
+                break;
             }
-            else
+            if (!(flags & IORING_CQE_F_BUFFER))
             {
-                log.verbose("recvMain: ACK of packet %ld received.", 
-                    rmsg->value);
-                ++acked;
-                rec.write(rmsg->value, CompactRecorder::Type::ACKED);
+                continue;
             }
-            break;
-        default:
-            // ignore
-            break;
+
+            int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+            char *buf = ring.buffer(bid);
+            io_uring_recvmsg_out *out = (io_uring_recvmsg_out*)buf;
+            char *control = buf + sizeof(*out) + recvHdr.msg_namelen;
+            char *payload = control + recvHdr.msg_controllen;
+            msghdr hdr;
+            memset(&hdr, 0, sizeof(hdr));
+            hdr.msg_control = control;
+            hdr.msg_controllen = out->controllen;
+            // what fit into the buffer
+            int len = res - (payload - buf);
+            len = (int)out->payloadlen < len ? out->payloadlen : len;
+
+            if (received++ == 0)
+            {
+                log.message("recvMain: Receiving with multishot recvmsg on "
+                    "an io_uring.");
+            }
+            onMessage(shard, (Message*)payload, len, 
+                *(sockaddr_in*)(buf + sizeof(*out)), &hdr, batchTime, 
+                acked, counters);
+            ring.recycle(bid);
+        }
+        reportFlows(shard, batchTime);
+    }
+    return 0;
+}
+
+void recvMain(Shard *shard)
+{
+    char name[16];
+    snprintf(name, sizeof(name), "recvMain %d", shard->id);
+    runtime.applyThread(name);
+
+    long acked = 0;
+    Metrics::Slot *counters = metrics.getSlot();
+
+    if (!useUring || recvUring(shard, acked, counters) != 0)
+    {
+        if (useUring)
+        {
+            log.warning("recvMain: Multishot recvmsg on an io_uring "
+                "unavailable, receiving from the socket.");
         }
+        recvSocket(shard, acked, counters);
     }
 
     log.message("recvMain: %ld packets ACKed.", acked);
@@ -211,12 +1311,53 @@ void sigHandler(int sig, siginfo_t *info, void *ptr)
     toAbort = 1;
 }
 
-int main(int argc, char **argv)
+static int openSocket()
 {
     int fd;
-    int ret;
+    int one = 1;
     char errbuf[64];
 
+    if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+    {
+        log.error("openSocket: Cannot create socket(%s).", 
+            Log::strerror(errbuf));
+        return -1;
+    }
+
+    if (workers > 1 && 
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)
+    {
+        log.error("openSocket: Cannot set SO_REUSEPORT(%s).", 
+            Log::strerror(errbuf));
+        close(fd);
+        return -1;
+    }
+
+    if (enableTimestamping(fd, recClock) != 0)
+    {
+        log.warning("openSocket: Kernel timestamps unavailable, using "
+            "realtime clock.");
+        recClock = CompactRecorder::Clock::REALTIME;
+        rec.setClock(recClock);
+    }
+
+    runtime.applySocket(fd);
+    if (bind(fd, (sockaddr*)&addr, sizeof(addr)) < 0)
+    {
+        log.error("openSocket: Cannot bind to specified address %s:%d(%s).", 
+            inet_ntoa(addr.sin_addr), ntohs(addr.sin_port), 
+			Log::strerror(errbuf));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int main(int argc, char **argv)
+{
+    int ret;
+
     signalNoRestart(SIGINT, sigHandler);
     log.message("This is UDPNetProbe Sender, Version %s", VERSION);
 
@@ -231,27 +1372,70 @@ int main(int argc, char **argv)
         return 1;
     }
 
-    if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+    rec.setClock(recClock);
+    rec.setRunInfo(argc, argv);
+    if (metricsName != nullptr)
     {
-        log.error("main: Cannot create socket(%s).", Log::strerror(errbuf));
-        return 2;
+        if (metrics.create(metricsName, "Sender") != 0)
+        {
+            return 2;
+        }
+        metrics.setPort(ntohs(addr.sin_port));
     }
-
+    runtime.applyProcess();
     addr.sin_family = AF_INET;
-    if ((ret = bind(fd, (sockaddr*)&addr, sizeof(addr))) < 0)
+    shards = std::make_unique<Shard[]>(workers);
+    for (int i = 0; i < workers; ++i)
     {
-        log.error("main: Cannot bind to specified address %s:%d(%s).", 
-            inet_ntoa(addr.sin_addr), ntohs(addr.sin_port), 
-			Log::strerror(errbuf));
-        return 3;
+        Shard &shard = shards[i];
+        shard.id = i;
+        shard.flows = std::make_unique<Flow[]>(Shard::MAX_FLOWS);
+        shard.flowCount = 0;
+        memset(shard.index, -1, sizeof(shard.index));
+        shard.retiredCount = 0;
+        if ((shard.fd = openSocket()) < 0)
+        {
+            return 3;
+        }
     }
 
-	log.message("main: Listening...");
+	log.message("main: Listening with %d worker(s)...", workers);
 
-    std::thread sender(sendMain, fd), receiver(recvMain, fd);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < workers; ++i)
+    {
+        threads.emplace_back(sendMain, &shards[i]);
+        threads.emplace_back(recvMain, &shards[i]);
+    }
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+    rec.close();
 
-    sender.join();
-    receiver.join();
+    RunStats total;
+    long now = getNanoTime();
+    int nflow = 0;
+    for (int i = 0; i < workers; ++i)
+    {
+        for (int f = 0; f < shards[i].flowCount; ++f)
+        {
+            Flow &flow = shards[i].flows[f];
+            retireFlow(flow, now);
+            total.merge(flow.stats);
+            ++nflow;
+        }
+        total.merge(shards[i].retired);
+        nflow += shards[i].retiredCount;
+    }
+    if (nflow > 1)
+    {
+        total.finish("total", now);
+    }
+    if (dumpPath != nullptr)
+    {
+        total.dump(dumpPath, now);
+    }
 
     return toAbort * 4;
 }
@@ -0,0 +1,209 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <thread>
+
+#include "Log.hh"
+#include "Metrics.hh"
+#include "Util.hh"
+
+static char usage[] =
+    "Usage: %s [OPTIONS] [name]\n"
+    "  Attach to the live counters a Sender or Receiver started with -M\n"
+    "  [name] publishes, and print their rates until it exits. Drops are\n"
+    "  datagrams the kernel dropped on the UDP sockets of the probe port\n"
+    "  (/proc/net/udp). RTT percentiles are upper bounds of power-of-two\n"
+    "  buckets.\n"
+    "  -h\n"
+    "    Display this message and quit.\n"
+    "  -i [seconds]\n"
+    "    Print every [seconds].\n"
+    "    Default: 1\n"
+    "  -v\n"
+    "    Display version information.\n";
+
+static double interval = 1;
+static int toAbort;
+
+static int parseArguments(int argc, char **argv)
+{
+    char c;
+
+    while ((c = getopt(argc, argv, "hi:v")) != EOF)
+    {
+        switch (c)
+        {
+        case 'h':
+            log.longMessage(usage, argv[0]);
+            return -1;
+            break;
+        case 'i':
+            interval = atof(optarg);
+            break;
+        case 'v':
+            log.message("Version %s\n", VERSION);
+            return -1;
+            break;
+        default:
+            log.error("parseArguments: Unrecognized option %c", c);
+            return 2;
+            break;
+        }
+    }
+
+    if (optind >= argc)
+    {
+        log.error("parseArguments: Segment name not specified.");
+        return 3;
+    }
+    if (interval < 0.1)
+    {
+        log.error("parseArguments: Interval %.3fs too short.", interval);
+        return 4;
+    }
+
+    return 0;
+}
+
+// datagrams dropped on all UDP sockets bound to local port `port`, or -1.
+static long socketDrops(int port)
+{
+    char line[512];
+    long drops = 0;
+    FILE *fin;
+
+    if (port == 0 || (fin = fopen("/proc/net/udp", "r")) == nullptr)
+    {
+        return -1;
+    }
+    // skip the column titles
+    fgets(line, sizeof(line), fin);
+    while (fgets(line, sizeof(line), fin) != nullptr)
+    {
+        char *local = strchr(line, ':');
+        char *last = strrchr(line, ' ');
+        if (local == nullptr || last == nullptr ||
+            (local = strchr(local + 1, ':')) == nullptr)
+        {
+            continue;
+        }
+        if (strtol(local + 1, nullptr, 16) == port)
+        {
+            drops += atol(last + 1);
+        }
+    }
+    fclose(fin);
+    return drops;
+}
+
+// upper bound in us of the bucket the `q`-th quantile of `rtt` falls into,
+// or 0 if there are no samples.
+static long rttQuantile(const long *rtt, double q)
+{
+    long total = 0, seen = 0;
+
+    for (int i = 0; i < Metrics::RTT_BUCKETS; ++i)
+    {
+        total += rtt[i];
+    }
+    if (total == 0)
+    {
+        return 0;
+    }
+    for (int i = 0; i < Metrics::RTT_BUCKETS; ++i)
+    {
+        seen += rtt[i];
+        if (seen >= q * total)
+        {
+            return 2L << i;
+        }
+    }
+    return 2L << (Metrics::RTT_BUCKETS - 1);
+}
+
+void sigHandler(int sig, siginfo_t *info, void *ptr)
+{
+    toAbort = 1;
+}
+
+int main(int argc, char **argv)
+{
+    int ret;
+    Metrics metrics;
+    Metrics::Snapshot last, cur;
+    long lastDrops;
+
+    log.message("This is UDPNetProbe Stat, Version %s", VERSION);
+
+    ret = parseArguments(argc, argv);
+    if (ret < 0)
+    {
+        return 0;
+    }
+    else if (ret > 0)
+    {
+        log.error("main: Not recoverable, exit.");
+        return 1;
+    }
+
+    if (metrics.attach(argv[optind]) != 0)
+    {
+        return 2;
+    }
+    const Metrics::Header &hdr = metrics.getHeader();
+    log.message("main: Watching %s, pid %ld, port %d.", hdr.program,
+        (long)hdr.pid, hdr.port);
+
+    signalNoRestart(SIGINT, sigHandler);
+    metrics.read(last);
+    lastDrops = socketDrops(hdr.port);
+    auto next = std::chrono::steady_clock::now();
+    for (long line = 0; !toAbort; ++line)
+    {
+        next += std::chrono::microseconds((long)(interval * 1000000));
+        std::this_thread::sleep_until(next);
+        if (kill(hdr.pid, 0) < 0 && errno == ESRCH)
+        {
+            log.message("main: %s exited.", hdr.program);
+            break;
+        }
+
+        metrics.read(cur);
+        long drops = socketDrops(hdr.port);
+        long rtt[Metrics::RTT_BUCKETS];
+        long *c = cur.counters, *l = last.counters;
+        for (int i = 0; i < Metrics::RTT_BUCKETS; ++i)
+        {
+            rtt[i] = cur.rtt[i] - last.rtt[i];
+        }
+        long paced = c[Metrics::PACED] - l[Metrics::PACED];
+        double paceErr = paced == 0 ? 0 :
+            (c[Metrics::PACE_ERROR_NS] - l[Metrics::PACE_ERROR_NS]) /
+            1000.0 / paced;
+
+        if (line % 20 == 0)
+        {
+            printf("%10s%10s%10s%10s%10s%10s%10s%10s%10s\n", "Sent/s",
+                "Recv/s", "AckSent/s", "Acked/s", "Ignored/s", "Drops",
+                "Pace(us)", "p50(us)", "p99(us)");
+        }
+        printf("%10.0f%10.0f%10.0f%10.0f%10.0f%10ld%10.1f%10ld%10ld\n",
+            (c[Metrics::SENT] - l[Metrics::SENT]) / interval,
+            (c[Metrics::RECEIVED] - l[Metrics::RECEIVED]) / interval,
+            (c[Metrics::ACK_SENT] - l[Metrics::ACK_SENT]) / interval,
+            (c[Metrics::ACKED] - l[Metrics::ACKED]) / interval,
+            (c[Metrics::IGNORED] - l[Metrics::IGNORED]) / interval,
+            drops >= 0 && lastDrops >= 0 ? drops - lastDrops : 0,
+            paceErr, rttQuantile(rtt, 0.5), rttQuantile(rtt, 0.99));
+        fflush(stdout);
+        last = cur;
+        lastDrops = drops;
+    }
+
+    return 0;
+}
@@ -0,0 +1,310 @@
+#include <string.h>
+
+#include "Log.hh"
+#include "Stats.hh"
+#include "Util.hh"
+
+Histogram::Histogram()
+{
+    reset();
+}
+
+long Histogram::percentile(double q) const
+{
+    if (total == 0)
+    {
+        return 0;
+    }
+
+    long target = (long)(q * total + 0.5);
+    long seen = 0;
+    if (target < 1)
+    {
+        target = 1;
+    }
+    for (int i = 0; i < BUCKETS; ++i)
+    {
+        seen += counts[i];
+        if (seen >= target)
+        {
+            long lo = valueOf(i);
+            long hi = i + 1 < BUCKETS ? valueOf(i + 1) : lo + 1;
+            long mid = lo + (hi - lo - 1) / 2;
+            return mid > maxValue ? maxValue : mid;
+        }
+    }
+    return maxValue;
+}
+
+void Histogram::merge(const Histogram &other)
+{
+    for (int i = 0; i < BUCKETS; ++i)
+    {
+        counts[i] += other.counts[i];
+    }
+    if (other.total > 0)
+    {
+        if (other.minValue < minValue)
+        {
+            minValue = other.minValue;
+        }
+        if (other.maxValue > maxValue)
+        {
+            maxValue = other.maxValue;
+        }
+    }
+    total += other.total;
+    sum += other.sum;
+}
+
+void Histogram::reset()
+{
+    memset(counts, 0, sizeof(counts));
+    total = 0;
+    minValue = 1L << MAX_BITS;
+    maxValue = 0;
+    sum = 0;
+}
+
+SeqTracker::SeqTracker(): first(-1), highest(-1), lost(0), run(0),
+    lossRuns(), reorder()
+{
+    memset(window, 0, sizeof(window));
+    memset(counts, 0, sizeof(counts));
+}
+
+void SeqTracker::slide(long seq)
+{
+    if (first < 0)
+    {
+        first = seq;
+        highest = seq - 1;
+    }
+
+    long from = highest + 1;
+    if (seq - from >= WINDOW)
+    {
+        // the whole window leaves, and the numbers up to seq - WINDOW never
+        // enter it
+        for (long s = highest - WINDOW + 1; s <= highest; ++s)
+        {
+            evict(s, isSet(s));
+        }
+        run += seq - WINDOW - from + 1;
+        memset(window, 0, sizeof(window));
+    }
+    else
+    {
+        for (long s = from; s <= seq; ++s)
+        {
+            // s takes the bit of s - WINDOW
+            uint64_t &word = window[(s & (WINDOW - 1)) >> 6];
+            evict(s - WINDOW, (word >> (s & 63)) & 1);
+            word &= ~(1ul << (s & 63));
+        }
+    }
+    window[(seq & (WINDOW - 1)) >> 6] |= 1ul << (seq & 63);
+    highest = seq;
+}
+
+void SeqTracker::finish()
+{
+    if (first < 0)
+    {
+        return;
+    }
+    for (long s = highest - WINDOW + 1; s <= highest; ++s)
+    {
+        evict(s, isSet(s));
+    }
+    // the highest is there, so no run is left open
+}
+
+void SeqTracker::merge(const SeqTracker &other)
+{
+    for (int i = 0; i < ARRIVALS; ++i)
+    {
+        counts[i] += other.counts[i];
+    }
+    lost += other.lost;
+    lossRuns.merge(other.lossRuns);
+    reorder.merge(other.reorder);
+}
+
+void SeqTracker::report(const char *name, const char *lossName) const
+{
+    log.message("stats[%s]: %ld new, %ld duplicate, %ld late(by p50 %ld "
+        "p99 %ld max %ld), %ld too old; %ld %s in %ld runs(of p50 %ld p99 "
+        "%ld max %ld).", name, counts[NEW], counts[DUPLICATE], counts[LATE],
+        reorder.percentile(0.5), reorder.percentile(0.99), reorder.getMax(),
+        counts[TOO_OLD], lost, lossName, lossRuns.count(),
+        lossRuns.percentile(0.5), lossRuns.percentile(0.99),
+        lossRuns.getMax());
+}
+
+RunStats::RunStats(): sent(0), bytes(0), acked(0), acks(), rtt(), dwell(),
+    startTime(0), lastTime(0), lastSent(0), lastBytes(0), lastAcked(0)
+{
+}
+
+void RunStats::start(long now)
+{
+    startTime = lastTime = now;
+}
+
+void RunStats::reset()
+{
+    sent.store(0, std::memory_order_relaxed);
+    bytes.store(0, std::memory_order_relaxed);
+    acked = 0;
+    acks = SeqTracker();
+    rtt = Histogram();
+    dwell = Histogram();
+    startTime = lastTime = lastSent = lastBytes = lastAcked = 0;
+}
+
+void RunStats::onAck(long seq, long rttNs, long dwellNs)
+{
+    long distance;
+    SeqTracker::Arrival arrival = acks.onArrival(seq, distance);
+
+    if (arrival == SeqTracker::DUPLICATE || arrival == SeqTracker::TOO_OLD)
+    {
+        return;
+    }
+    ++acked;
+    if (rttNs >= 0)
+    {
+        rtt.record(rttNs);
+    }
+    if (dwellNs >= 0)
+    {
+        dwell.record(dwellNs);
+    }
+}
+
+void RunStats::merge(const RunStats &other)
+{
+    sent.fetch_add(other.sent.load(std::memory_order_relaxed),
+        std::memory_order_relaxed);
+    bytes.fetch_add(other.bytes.load(std::memory_order_relaxed),
+        std::memory_order_relaxed);
+    acked += other.acked;
+    acks.merge(other.acks);
+    rtt.merge(other.rtt);
+    dwell.merge(other.dwell);
+    if (startTime == 0 || (other.startTime != 0 && 
+        other.startTime < startTime))
+    {
+        startTime = other.startTime;
+    }
+}
+
+void RunStats::report(const char *name, long now)
+{
+    long curSent = sent.load(std::memory_order_relaxed);
+    long curBytes = bytes.load(std::memory_order_relaxed);
+    double dt = (now - lastTime) / 1e9;
+
+    if (dt <= 0)
+    {
+        return;
+    }
+
+    double sentRate = (curSent - lastSent) / dt;
+    log.message("stats[%s]: %.1lfs sent %ld(%.0lf pps, %.2lf Mbit/s) "
+        "acked %ld(%.0lf pps) dup %ld reorder %ld "
+        "RTT p50 %.1lf p99 %.1lf p99.9 %.1lf max %.1lf us",
+        name, (now - startTime) / 1e9, curSent, sentRate,
+        (curBytes - lastBytes) * 8 / dt / 1e6, acked,
+        (acked - lastAcked) / dt,
+        acks.count(SeqTracker::DUPLICATE), acks.count(SeqTracker::LATE),
+        rtt.percentile(0.5) / 1e3,
+        rtt.percentile(0.99) / 1e3, rtt.percentile(0.999) / 1e3,
+        rtt.getMax() / 1e3);
+
+    lastTime = now;
+    lastSent = curSent;
+    lastBytes = curBytes;
+    lastAcked = acked;
+}
+
+void RunStats::finish(const char *name, long now)
+{
+    long curSent = sent.load(std::memory_order_relaxed);
+    long curBytes = bytes.load(std::memory_order_relaxed);
+    double dt = (now - startTime) / 1e9;
+
+    if (dt <= 0)
+    {
+        dt = 1e-9;
+    }
+
+    log.message("stats[%s]: Run of %.3lfs: %ld sent(%.0lf pps, "
+        "%.2lf Mbit/s), %ld acked, %ld unacked, %ld duplicate, "
+        "%ld reordered, %ld stale.", name, dt, curSent, curSent / dt,
+        curBytes * 8 / dt / 1e6, acked, curSent - acked,
+        acks.count(SeqTracker::DUPLICATE), acks.count(SeqTracker::LATE),
+        acks.count(SeqTracker::TOO_OLD));
+    log.message("stats[%s]: RTT(us) min %.1lf p50 %.1lf p90 %.1lf "
+        "p99 %.1lf p99.9 %.1lf p99.99 %.1lf max %.1lf mean %.1lf, "
+        "receiver dwell mean %.1lf.", name,
+        rtt.getMin() / 1e3, rtt.percentile(0.5) / 1e3,
+        rtt.percentile(0.9) / 1e3, rtt.percentile(0.99) / 1e3,
+        rtt.percentile(0.999) / 1e3, rtt.percentile(0.9999) / 1e3,
+        rtt.getMax() / 1e3, rtt.mean() / 1e3, dwell.mean() / 1e3);
+    acks.finish();
+    acks.report(name, "not ACKed");
+}
+
+int RunStats::dump(const char *path, long now)
+{
+    Summary sum;
+    char errbuf[64];
+    int fd;
+
+    memset(&sum, 0, sizeof(sum));
+    memcpy(sum.magic, "UNPSTAT1", 8);
+    sum.version = 1;
+    sum.subBits = Histogram::SUB_BITS;
+    sum.elapsedNs = now - startTime;
+    sum.sent = sent.load();
+    sum.acked = acked;
+    sum.duplicates = acks.count(SeqTracker::DUPLICATE);
+    sum.reordered = acks.count(SeqTracker::LATE);
+    sum.stale = acks.count(SeqTracker::TOO_OLD);
+    sum.rttMin = rtt.getMin();
+    sum.rttMax = rtt.getMax();
+    sum.rttMean = rtt.mean();
+    sum.dwellMean = dwell.mean();
+    for (int i = 0; i < Histogram::BUCKETS; ++i)
+    {
+        sum.buckets += rtt.bucket(i) != 0;
+    }
+
+    if ((fd = open(path, O_WRONLY | O_TRUNC | O_CREAT, 0644)) < 0)
+    {
+        log.error("RunStats::dump: Cannot open file %s for output(%s).",
+            path, Log::strerror(errbuf));
+        return 1;
+    }
+
+    int ret = write(fd, &sum, sizeof(sum)) != sizeof(sum);
+    for (int i = 0; i < Histogram::BUCKETS && ret == 0; ++i)
+    {
+        if (rtt.bucket(i) != 0)
+        {
+            int32_t idx = i;
+            int64_t cnt = rtt.bucket(i);
+            ret = write(fd, &idx, sizeof(idx)) != sizeof(idx) ||
+                write(fd, &cnt, sizeof(cnt)) != sizeof(cnt);
+        }
+    }
+    if (ret != 0)
+    {
+        log.error("RunStats::dump: write() failed(%s).",
+            Log::strerror(errbuf));
+    }
+    close(fd);
+    return ret;
+}
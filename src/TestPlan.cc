@@ -0,0 +1,209 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Log.hh"
+#include "Pacer.hh"
+#include "TestPlan.hh"
+#include "Util.hh"
+
+// parse a non-negative number of seconds into ns. return 0 on success.
+static int parseSeconds(const char *str, long &ns)
+{
+    char *end;
+    double val = strtod(str, &end);
+
+    if (end == str || *end != 0 || !(val >= 0))
+    {
+        return 1;
+    }
+    ns = (long)(val * 1e9);
+    return 0;
+}
+
+static int parseCount(const char *str, long &num)
+{
+    char *end;
+
+    num = strtol(str, &end, 10);
+    return end == str || *end != 0 || num < 0;
+}
+
+int TestPlan::load(const char *path, const Phase &defaults)
+{
+    FILE *fin;
+    char line[1024];
+    char errbuf[64];
+    int lineno = 0;
+    int ret = 0;
+
+    if ((fin = fopen(path, "r")) == nullptr)
+    {
+        log.error("TestPlan::load: Cannot open %s(%s).", path,
+            Log::strerror(errbuf));
+        return 1;
+    }
+
+    phases.clear();
+    while (ret == 0 && fgets(line, sizeof(line), fin) != nullptr)
+    {
+        Phase phase = defaults;
+        const char *rate = nullptr;
+        char *save;
+        int keys = 0;
+
+        ++lineno;
+        if (char *hash = strchr(line, '#'))
+        {
+            *hash = 0;
+        }
+        snprintf(phase.name, sizeof(phase.name), "phase%d", size());
+        phase.count = phase.durationNs = 0;
+        phase.ackRatio = 0;
+        phase.warmupNs = phase.cooldownNs = 0;
+
+        for (char *tok = strtok_r(line, " \t\r\n", &save); tok != nullptr;
+            tok = strtok_r(nullptr, " \t\r\n", &save))
+        {
+            char *val = strchr(tok, '=');
+            long num;
+            int bad = 0;
+
+            ++keys;
+            if (val == nullptr)
+            {
+                log.error("TestPlan::load: %s:%d: Expected key=value, got "
+                    "%s.", path, lineno, tok);
+                ret = 1;
+                break;
+            }
+            *val++ = 0;
+
+            if (strcmp(tok, "name") == 0)
+            {
+                snprintf(phase.name, sizeof(phase.name), "%s", val);
+            }
+            else if (strcmp(tok, "rate") == 0)
+            {
+                rate = val;
+            }
+            else if (strcmp(tok, "interval") == 0)
+            {
+                bad = parseCount(val, num) || num == 0;
+                phase.intervalNs = num * 1000.0;
+                rate = nullptr;
+            }
+            else if (strcmp(tok, "size") == 0)
+            {
+                bad = parseCount(val, num) ||
+                    num < (long)sizeof(DataMessage) || num > 65507;
+                phase.size = num;
+            }
+            else if (strcmp(tok, "count") == 0)
+            {
+                bad = parseCount(val, phase.count);
+            }
+            else if (strcmp(tok, "duration") == 0)
+            {
+                bad = parseSeconds(val, phase.durationNs);
+            }
+            else if (strcmp(tok, "ack") == 0)
+            {
+                bad = parseCount(val, num) || num > 1000000;
+                phase.ackRatio = num;
+            }
+            else if (strcmp(tok, "warmup") == 0)
+            {
+                bad = parseSeconds(val, phase.warmupNs);
+            }
+            else if (strcmp(tok, "cooldown") == 0)
+            {
+                bad = parseSeconds(val, phase.cooldownNs);
+            }
+            else
+            {
+                log.error("TestPlan::load: %s:%d: Unknown key %s.", path,
+                    lineno, tok);
+                ret = 1;
+                break;
+            }
+            if (bad)
+            {
+                log.error("TestPlan::load: %s:%d: Invalid %s %s.", path,
+                    lineno, tok, val);
+                ret = 1;
+                break;
+            }
+        }
+        if (ret != 0 || keys == 0)
+        {
+            continue;
+        }
+
+        // a rate in bits per second depends on the size of the phase
+        double pps;
+        if (rate != nullptr)
+        {
+            if (Pacer::parseRate(rate, phase.size, pps) != 0)
+            {
+                log.error("TestPlan::load: %s:%d: Invalid rate %s.", path,
+                    lineno, rate);
+                ret = 1;
+                break;
+            }
+            phase.intervalNs = 1e9 / pps;
+        }
+        if (phase.count == 0 && phase.durationNs == 0)
+        {
+            log.error("TestPlan::load: %s:%d: Phase %s has neither count "
+                "nor duration.", path, lineno, phase.name);
+            ret = 1;
+            break;
+        }
+        if (size() == MAX_PHASES)
+        {
+            log.error("TestPlan::load: %s: More than %d phases.", path,
+                (int)MAX_PHASES);
+            ret = 1;
+            break;
+        }
+        phases.push_back(phase);
+    }
+    fclose(fin);
+
+    if (ret == 0 && phases.empty())
+    {
+        log.error("TestPlan::load: %s: No phases.", path);
+        ret = 1;
+    }
+    if (ret != 0)
+    {
+        return ret;
+    }
+
+    for (const Phase &phase : phases)
+    {
+        double pps = 1e9 / phase.intervalNs;
+        log.message("TestPlan::load: Phase %s: %.0lf pps(%.2lf Mbit/s) of "
+            "%d bytes, count %ld, duration %.3lfs, ACK ratio %d, warm-up "
+            "%.3lfs, cool-down %.3lfs.", phase.name, pps,
+            pps * phase.size * 8 / 1e6, phase.size, phase.count,
+            phase.durationNs / 1e9, phase.ackRatio, phase.warmupNs / 1e9,
+            phase.cooldownNs / 1e9);
+    }
+    return 0;
+}
+
+int TestPlan::maxSize() const
+{
+    int ret = 0;
+
+    for (const Phase &phase : phases)
+    {
+        if (phase.size > ret)
+        {
+            ret = phase.size;
+        }
+    }
+    return ret;
+}
@@ -0,0 +1,305 @@
+#include <errno.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+
+#include <chrono>
+#include <thread>
+
+#include "Batch.hh"
+#include "Log.hh"
+#include "Timestamp.hh"
+
+int enableTimestamping(int fd, CompactRecorder::Clock clock)
+{
+    int flags = SOF_TIMESTAMPING_SOFTWARE |
+        SOF_TIMESTAMPING_RX_SOFTWARE |
+        SOF_TIMESTAMPING_TX_SOFTWARE |
+        SOF_TIMESTAMPING_OPT_ID |
+        SOF_TIMESTAMPING_OPT_TSONLY;
+    char errbuf[64];
+
+    if (clock != CompactRecorder::Clock::SOFTWARE &&
+        clock != CompactRecorder::Clock::HARDWARE)
+    {
+        return 0;
+    }
+    if (clock == CompactRecorder::Clock::HARDWARE)
+    {
+        // the NIC must have been switched to timestamping mode beforehand
+        // (SIOCSHWTSTAMP, e.g. with hwstamp_ctl). software timestamps are
+        // still requested and used for packets the NIC did not stamp.
+        flags |= SOF_TIMESTAMPING_RAW_HARDWARE |
+            SOF_TIMESTAMPING_RX_HARDWARE |
+            SOF_TIMESTAMPING_TX_HARDWARE;
+    }
+
+    if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags,
+        sizeof(flags)) < 0)
+    {
+        log.error("enableTimestamping: setsockopt() failed(%s).",
+            Log::strerror(errbuf));
+        return 1;
+    }
+    return 0;
+}
+
+// pick the best timestamp out of a SCM_TIMESTAMPING control message.
+static int pickTimestamp(cmsghdr *cm, timespec &ts,
+    CompactRecorder::Clock &clock)
+{
+    scm_timestamping *tss = (scm_timestamping*)CMSG_DATA(cm);
+
+    if (tss->ts[2].tv_sec != 0 || tss->ts[2].tv_nsec != 0)
+    {
+        ts = tss->ts[2];
+        clock = CompactRecorder::Clock::HARDWARE;
+        return 0;
+    }
+    if (tss->ts[0].tv_sec != 0 || tss->ts[0].tv_nsec != 0)
+    {
+        ts = tss->ts[0];
+        clock = CompactRecorder::Clock::SOFTWARE;
+        return 0;
+    }
+    return 1;
+}
+
+int getRxTimestamp(const msghdr *hdr, timespec &ts,
+    CompactRecorder::Clock &clock)
+{
+    if (hdr->msg_controllen == 0)
+    {
+        return 1;
+    }
+    for (cmsghdr *cm = CMSG_FIRSTHDR(hdr); cm != nullptr;
+        cm = CMSG_NXTHDR((msghdr*)hdr, cm))
+    {
+        if (cm->cmsg_level == SOL_SOCKET &&
+            cm->cmsg_type == SCM_TIMESTAMPING)
+        {
+            return pickTimestamp(cm, ts, clock);
+        }
+    }
+    return 1;
+}
+
+long getRxTime(const msghdr *hdr, long fallback)
+{
+    timespec ts;
+    CompactRecorder::Clock clock;
+
+    if (getRxTimestamp(hdr, ts, clock) != 0 || 
+        clock == CompactRecorder::Clock::HARDWARE)
+    {
+        return fallback;
+    }
+    return toNanoTime(ts);
+}
+
+void recordRx(CompactRecorder &rec, long pakSeq, CompactRecorder::Type type,
+    const msghdr *hdr, int flow)
+{
+    timespec ts;
+    CompactRecorder::Clock clock;
+
+    if (getRxTimestamp(hdr, ts, clock) == 0)
+    {
+        rec.write(pakSeq, type, ts, clock, flow);
+    }
+    else
+    {
+        rec.write(pakSeq, type, flow);
+    }
+}
+
+TxTimestamps::TxTimestamps(CompactRecorder &rec):
+    rec(rec), ring(), key(0), enabled(0), watchTxTime(0), zeroCopy(nullptr),
+    missed(0), txTimeMissed(0), txTimeInvalid(0)
+{
+}
+
+int TxTimestamps::init(int fd, CompactRecorder::Clock clock)
+{
+    if (clock != CompactRecorder::Clock::SOFTWARE &&
+        clock != CompactRecorder::Clock::HARDWARE)
+    {
+        enabled = 0;
+        return 0;
+    }
+
+    // e.g. enableTimestamping() failed on `fd`: nothing would ever come
+    // out of its error queue
+    int flags = 0;
+    socklen_t len = sizeof(flags);
+    if (getsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, &len) < 0 ||
+        !(flags & SOF_TIMESTAMPING_TX_SOFTWARE))
+    {
+        log.warning("TxTimestamps::init: Kernel timestamps not enabled on "
+            "the socket, recording send times in userspace.");
+        enabled = 0;
+        return 1;
+    }
+
+    ring = std::make_unique<Pending[]>(1 << RING_LEVEL);
+    key = 0;
+    enabled = 1;
+    return 0;
+}
+
+void TxTimestamps::settle(Pending &p, const timespec &ts,
+    CompactRecorder::Clock clock)
+{
+    if (p.type >= 0)
+    {
+        for (int i = 0; i < p.packets; ++i)
+        {
+            rec.write(p.pakSeq + i, (CompactRecorder::Type)p.type, ts, clock,
+                p.flow);
+        }
+    }
+    p.valid = 0;
+}
+
+void TxTimestamps::sent(long pakSeq, int packets, int type, int flow)
+{
+    if (!enabled)
+    {
+        if (type >= 0)
+        {
+            for (int i = 0; i < packets; ++i)
+            {
+                rec.write(pakSeq + i, (CompactRecorder::Type)type, flow);
+            }
+        }
+        return;
+    }
+
+    Pending &p = ring[key & ((1 << RING_LEVEL) - 1)];
+    if (p.valid)
+    {
+        // the kernel is way behind(or dropped the timestamp).
+        ++missed;
+        settle(p, p.sent, CompactRecorder::Clock::REALTIME);
+    }
+    p.key = key++;
+    p.packets = packets;
+    p.type = type;
+    p.flow = flow;
+    p.pakSeq = pakSeq;
+    p.valid = 1;
+    clock_gettime(CLOCK_REALTIME, &p.sent);
+}
+
+int TxTimestamps::reap(int fd)
+{
+    char control[512];
+    char errbuf[64];
+    int settled = 0;
+
+    if (!enabled && !watchTxTime && zeroCopy == nullptr)
+    {
+        return 0;
+    }
+
+    while (1)
+    {
+        msghdr hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.msg_control = control;
+        hdr.msg_controllen = sizeof(control);
+
+        if (recvmsg(fd, &hdr, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                log.warning("TxTimestamps::reap: recvmsg() failed(%s).",
+                    Log::strerror(errbuf));
+            }
+            break;
+        }
+
+        timespec ts;
+        CompactRecorder::Clock clock;
+        sock_extended_err *err = nullptr;
+        int found = 1;
+
+        for (cmsghdr *cm = CMSG_FIRSTHDR(&hdr); cm != nullptr;
+            cm = CMSG_NXTHDR(&hdr, cm))
+        {
+            if (cm->cmsg_level == SOL_SOCKET &&
+                cm->cmsg_type == SCM_TIMESTAMPING)
+            {
+                found = pickTimestamp(cm, ts, clock);
+            }
+            else if (cm->cmsg_level == IPPROTO_IP &&
+                cm->cmsg_type == IP_RECVERR)
+            {
+                err = (sock_extended_err*)CMSG_DATA(cm);
+            }
+        }
+        if (err != nullptr && err->ee_origin == SO_EE_ORIGIN_TXTIME)
+        {
+            if (err->ee_code == SO_EE_CODE_TXTIME_MISSED)
+            {
+                ++txTimeMissed;
+            }
+            else
+            {
+                ++txTimeInvalid;
+            }
+            continue;
+        }
+        if (err != nullptr && err->ee_origin == SO_EE_ORIGIN_ZEROCOPY)
+        {
+            // one message covers the range of sends ee_info to ee_data
+            if (zeroCopy != nullptr)
+            {
+                zeroCopy->complete(err->ee_info, err->ee_data,
+                    err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED);
+            }
+            continue;
+        }
+        if (!enabled || err == nullptr || found != 0 ||
+            err->ee_origin != SO_EE_ORIGIN_TIMESTAMPING)
+        {
+            continue;
+        }
+
+        Pending &p = ring[err->ee_data & ((1 << RING_LEVEL) - 1)];
+        if (p.valid && p.key == err->ee_data)
+        {
+            settle(p, ts, clock);
+            ++settled;
+        }
+    }
+
+    return settled;
+}
+
+void TxTimestamps::finish(int fd)
+{
+    if (!enabled)
+    {
+        return;
+    }
+
+    // give the last timestamps a chance to arrive
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    reap(fd);
+
+    for (int i = 0; i < (1 << RING_LEVEL); ++i)
+    {
+        if (ring[i].valid)
+        {
+            ++missed;
+            settle(ring[i], ring[i].sent, CompactRecorder::Clock::REALTIME);
+        }
+    }
+    if (missed > 0)
+    {
+        log.warning("TxTimestamps::finish: %ld messages recorded without "
+            "kernel timestamps.", missed);
+    }
+}
@@ -0,0 +1,260 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/time_types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "Log.hh"
+#include "Uring.hh"
+
+Uring::Uring(): fd(-1), features(0), sqpoll(0), file(-1), enters(0),
+    sqMap(nullptr), sqMapLen(0), cqMap(nullptr), cqMapLen(0), sqes(nullptr),
+    sqesLen(0), sqHead(nullptr), sqTail(nullptr), sqFlags(nullptr),
+    sqMask(0), sqEntries(0), sqArray(nullptr), sqLocal(0), cqHead(nullptr),
+    cqTail(nullptr), cqMask(0), cqes(nullptr), bufRing(nullptr),
+    bufRingLen(0), bufs(nullptr), bufCount(0), bufLen(0), bufGroup(0)
+{
+}
+
+Uring::~Uring()
+{
+    if (bufs != nullptr)
+    {
+        munmap(bufs, (long)bufCount * bufLen);
+    }
+    if (bufRing != nullptr)
+    {
+        munmap(bufRing, bufRingLen);
+    }
+    if (sqes != nullptr)
+    {
+        munmap(sqes, sqesLen);
+    }
+    if (cqMap != nullptr && cqMap != sqMap)
+    {
+        munmap(cqMap, cqMapLen);
+    }
+    if (sqMap != nullptr)
+    {
+        munmap(sqMap, sqMapLen);
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+}
+
+int Uring::init(unsigned entries, int sqpoll)
+{
+    io_uring_params p;
+    char errbuf[64];
+
+    memset(&p, 0, sizeof(p));
+    if (sqpoll)
+    {
+        p.flags = IORING_SETUP_SQPOLL;
+        // the kernel thread goes to sleep after 100ms without requests
+        p.sq_thread_idle = 100;
+        if ((fd = syscall(__NR_io_uring_setup, entries, &p)) < 0)
+        {
+            log.warning("Uring::init: SQPOLL unavailable(%s).",
+                Log::strerror(errbuf));
+            memset(&p, 0, sizeof(p));
+        }
+    }
+    if (fd < 0 && (fd = syscall(__NR_io_uring_setup, entries, &p)) < 0)
+    {
+        log.warning("Uring::init: io_uring unavailable(%s).",
+            Log::strerror(errbuf));
+        return 1;
+    }
+    this->sqpoll = (p.flags & IORING_SETUP_SQPOLL) != 0;
+    features = p.features;
+    // timed waits need IORING_ENTER_EXT_ARG(linux 5.11)
+    if (!(features & IORING_FEAT_EXT_ARG))
+    {
+        log.warning("Uring::init: io_uring of this kernel too old.");
+        return 1;
+    }
+
+    sqMapLen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cqMapLen = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    if (features & IORING_FEAT_SINGLE_MMAP)
+    {
+        sqMapLen = cqMapLen = sqMapLen > cqMapLen ? sqMapLen : cqMapLen;
+    }
+    sqMap = mmap(nullptr, sqMapLen, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sqMap == MAP_FAILED)
+    {
+        sqMap = nullptr;
+        log.warning("Uring::init: Cannot map rings(%s).",
+            Log::strerror(errbuf));
+        return 1;
+    }
+    if (features & IORING_FEAT_SINGLE_MMAP)
+    {
+        cqMap = sqMap;
+    }
+    else if ((cqMap = mmap(nullptr, cqMapLen, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING)) == MAP_FAILED)
+    {
+        cqMap = nullptr;
+        log.warning("Uring::init: Cannot map rings(%s).",
+            Log::strerror(errbuf));
+        return 1;
+    }
+    sqesLen = p.sq_entries * sizeof(io_uring_sqe);
+    sqes = (io_uring_sqe*)mmap(nullptr, sqesLen, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+    {
+        sqes = nullptr;
+        log.warning("Uring::init: Cannot map rings(%s).",
+            Log::strerror(errbuf));
+        return 1;
+    }
+
+    char *sq = (char*)sqMap, *cq = (char*)cqMap;
+    sqHead = (unsigned*)(sq + p.sq_off.head);
+    sqTail = (unsigned*)(sq + p.sq_off.tail);
+    sqFlags = (unsigned*)(sq + p.sq_off.flags);
+    sqMask = *(unsigned*)(sq + p.sq_off.ring_mask);
+    sqEntries = p.sq_entries;
+    sqArray = (unsigned*)(sq + p.sq_off.array);
+    sqLocal = *sqTail;
+    cqHead = (unsigned*)(cq + p.cq_off.head);
+    cqTail = (unsigned*)(cq + p.cq_off.tail);
+    cqMask = *(unsigned*)(cq + p.cq_off.ring_mask);
+    cqes = (io_uring_cqe*)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+io_uring_sqe* Uring::getSqe()
+{
+    if (sqLocal - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries)
+    {
+        return nullptr;
+    }
+
+    unsigned idx = sqLocal++ & sqMask;
+    sqArray[idx] = idx;
+    memset(&sqes[idx], 0, sizeof(io_uring_sqe));
+    return &sqes[idx];
+}
+
+int Uring::submit(unsigned wait, long timeoutNs)
+{
+    unsigned queued = sqLocal - *sqTail;
+    unsigned flags = 0;
+    unsigned toSubmit = queued;
+    __kernel_timespec ts;
+    io_uring_getevents_arg arg;
+
+    __atomic_store_n(sqTail, sqLocal, __ATOMIC_RELEASE);
+    if (sqpoll)
+    {
+        // the thread takes the entries by itself, unless it fell asleep
+        toSubmit = 0;
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (queued > 0 &&
+            (__atomic_load_n(sqFlags, __ATOMIC_RELAXED) &
+            IORING_SQ_NEED_WAKEUP))
+        {
+            flags |= IORING_ENTER_SQ_WAKEUP;
+        }
+    }
+    if (wait > 0)
+    {
+        flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        ts.tv_sec = timeoutNs / 1000000000L;
+        ts.tv_nsec = timeoutNs % 1000000000L;
+        memset(&arg, 0, sizeof(arg));
+        arg.ts = (uint64_t)&ts;
+    }
+    if (toSubmit == 0 && flags == 0)
+    {
+        return queued;
+    }
+
+    ++enters;
+    if (syscall(__NR_io_uring_enter, fd, toSubmit, wait, flags,
+        wait > 0 ? &arg : nullptr, sizeof(arg)) < 0)
+    {
+        return -errno;
+    }
+    return queued;
+}
+
+int Uring::registerFile(int fd)
+{
+    char errbuf[64];
+
+    if (syscall(__NR_io_uring_register, this->fd, IORING_REGISTER_FILES,
+        &fd, 1) < 0)
+    {
+        log.warning("Uring::registerFile: Cannot register socket %d(%s).",
+            fd, Log::strerror(errbuf));
+        return 1;
+    }
+    file = fd;
+    return 0;
+}
+
+int Uring::setupBuffers(int count, int len, int group)
+{
+    io_uring_buf_reg reg;
+    char errbuf[64];
+
+    bufRingLen = ((long)count * sizeof(io_uring_buf) + 4095) & ~4095L;
+    bufRing = (io_uring_buf_ring*)mmap(nullptr, bufRingLen,
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    bufs = (char*)mmap(nullptr, (long)count * len, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (bufRing == MAP_FAILED || bufs == MAP_FAILED)
+    {
+        log.warning("Uring::setupBuffers: mmap() failed(%s).",
+            Log::strerror(errbuf));
+        bufRing = bufRing == MAP_FAILED ? nullptr : bufRing;
+        bufs = bufs == MAP_FAILED ? nullptr : bufs;
+        return 1;
+    }
+    bufCount = count;
+    bufLen = len;
+    bufGroup = group;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)bufRing;
+    reg.ring_entries = count;
+    reg.bgid = group;
+    // since linux 5.19
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING,
+        &reg, 1) < 0)
+    {
+        log.warning("Uring::setupBuffers: Provided buffer rings unavailable"
+            "(%s).", Log::strerror(errbuf));
+        return 1;
+    }
+
+    for (int i = 0; i < count; ++i)
+    {
+        io_uring_buf &buf = entry(i);
+        buf.addr = (uint64_t)buffer(i);
+        buf.len = len;
+        buf.bid = i;
+    }
+    __atomic_store_n(&bufRing->tail, (uint16_t)count, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void Uring::recycle(int id)
+{
+    uint16_t tail = bufRing->tail;
+    io_uring_buf &buf = entry(tail & (bufCount - 1));
+
+    buf.addr = (uint64_t)buffer(id);
+    buf.len = bufLen;
+    buf.bid = id;
+    __atomic_store_n(&bufRing->tail, (uint16_t)(tail + 1), __ATOMIC_RELEASE);
+}
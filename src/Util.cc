@@ -1,3 +1,9 @@
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+
 #include "Log.hh"
 #include "Util.hh"
 
@@ -22,6 +28,20 @@ sighandler signalNoRestart(int signum, sighandler handler)
     return oldAction.sa_sigaction;
 }
 
+const char CompactRecorder::MAGIC[] = "UNPREC02";
+
+CompactRecorder::CompactRecorder(): fd(-1), clock(COARSE), header(),
+    headerWritten(0), broken(0), encodeBuf(), chunks(), lanes(),
+    laneCount(0), dropped(0), chunkLock(), chunkCond(), freeChunks(),
+    fullChunks(), flushing(0), toExit(0), flusher()
+{
+}
+
+CompactRecorder::~CompactRecorder()
+{
+    close();
+}
+
 int CompactRecorder::init(const char *path)
 {
     int len = strlen(path);
@@ -49,10 +69,201 @@ int CompactRecorder::init(const char *path)
         }
     }
 
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MAGIC, sizeof(header.magic));
+    header.version = VERSION_2;
+    header.length = sizeof(header);
+    header.clock = clock;
+    header.blockRecords = 1 << CHUNK_LEVEL;
+    header.created = getNanoTime();
+    gethostname(header.host, sizeof(header.host) - 1);
+    headerWritten = 0;
+    broken = 0;
+
+    encodeBuf = std::make_unique<char[]>(maxBlockLen(1 << CHUNK_LEVEL));
+    chunks = std::make_unique<Chunk[]>(CHUNK_COUNT);
+    for (int i = 0; i < CHUNK_COUNT; ++i)
+    {
+        chunks[i].recs = std::make_unique<Record[]>(1 << CHUNK_LEVEL);
+        chunks[i].count = 0;
+        freeChunks.push_back(&chunks[i]);
+    }
+    lanes = std::make_unique<Lane[]>(MAX_LANES);
+    toExit = 0;
+    flusher = std::make_unique<std::thread>(flusherMain, this);
+
     return 0;
 }
 
-int CompactRecorder::write(long pakSeq, Type type)
+const char* CompactRecorder::clockName(Clock clock)
+{
+    static const char *names[] = {"coarse", "realtime", "software", 
+        "hardware"};
+
+    if (clock < COARSE || clock > HARDWARE)
+    {
+        return "unknown";
+    }
+    return names[clock];
+}
+
+int CompactRecorder::parseClock(const char *str, Clock &clock)
+{
+    for (int i = COARSE; i <= HARDWARE; ++i)
+    {
+        if (strcmp(str, clockName((Clock)i)) == 0)
+        {
+            clock = (Clock)i;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void CompactRecorder::setClock(Clock clock)
+{
+    this->clock = (clock == COARSE ? COARSE : REALTIME);
+    header.clock = clock;
+}
+
+void CompactRecorder::setRunInfo(int argc, char **argv)
+{
+    int len = 0;
+
+    header.params[0] = 0;
+    for (int i = 0; i < argc; ++i)
+    {
+        int n = snprintf(header.params + len, sizeof(header.params) - len,
+            "%s%s", i == 0 ? "" : " ", argv[i]);
+        if (n < 0 || len + n >= (int)sizeof(header.params))
+        {
+            break;
+        }
+        len += n;
+    }
+}
+
+static inline uint64_t zigzag(int64_t v)
+{
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t v)
+{
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static inline void putVarint(uint8_t *&p, uint64_t v)
+{
+    while (v >= 0x80)
+    {
+        *p++ = (uint8_t)v | 0x80;
+        v >>= 7;
+    }
+    *p++ = (uint8_t)v;
+}
+
+static inline int getVarint(const uint8_t *&p, const uint8_t *end, 
+    uint64_t &v)
+{
+    v = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7)
+    {
+        uint8_t b = *p++;
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+long CompactRecorder::encodeBlock(const Record *recs, int count, char *out)
+{
+    BlockHeader *hdr = (BlockHeader*)out;
+    uint8_t *begin = (uint8_t*)(out + sizeof(BlockHeader));
+    uint8_t *p = begin;
+
+    hdr->count = count;
+    hdr->minSeq = hdr->minTime = INT64_MAX;
+    hdr->maxSeq = hdr->maxTime = INT64_MIN;
+    for (int i = 0; i < count; ++i)
+    {
+        int64_t t = recs[i].sec * 1000000000L + recs[i].nanosec;
+        hdr->minSeq = std::min(hdr->minSeq, (int64_t)recs[i].pakSeq);
+        hdr->maxSeq = std::max(hdr->maxSeq, (int64_t)recs[i].pakSeq);
+        hdr->minTime = std::min(hdr->minTime, t);
+        hdr->maxTime = std::max(hdr->maxTime, t);
+    }
+
+    // deltas wrap around in unsigned arithmetic, so any value round-trips
+    uint64_t prev = hdr->minSeq;
+    for (int i = 0; i < count; ++i)
+    {
+        putVarint(p, zigzag((int64_t)((uint64_t)recs[i].pakSeq - prev)));
+        prev = recs[i].pakSeq;
+    }
+    int prevType = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        putVarint(p, (uint32_t)(recs[i].type ^ prevType));
+        prevType = recs[i].type;
+    }
+    prev = hdr->minTime;
+    for (int i = 0; i < count; ++i)
+    {
+        uint64_t t = recs[i].sec * 1000000000L + recs[i].nanosec;
+        putVarint(p, zigzag((int64_t)(t - prev)));
+        prev = t;
+    }
+
+    hdr->length = p - begin;
+    return sizeof(BlockHeader) + hdr->length;
+}
+
+int CompactRecorder::decodeBlock(const BlockHeader &hdr, const char *data,
+    Record *out)
+{
+    const uint8_t *p = (const uint8_t*)data;
+    const uint8_t *end = p + hdr.length;
+    uint64_t v;
+
+    uint64_t prev = hdr.minSeq;
+    for (int i = 0; i < hdr.count; ++i)
+    {
+        if (getVarint(p, end, v) != 0)
+        {
+            return 1;
+        }
+        prev += unzigzag(v);
+        out[i].pakSeq = prev;
+    }
+    int prevType = 0;
+    for (int i = 0; i < hdr.count; ++i)
+    {
+        if (getVarint(p, end, v) != 0)
+        {
+            return 1;
+        }
+        prevType ^= (int)v;
+        out[i].type = prevType;
+    }
+    prev = hdr.minTime;
+    for (int i = 0; i < hdr.count; ++i)
+    {
+        if (getVarint(p, end, v) != 0)
+        {
+            return 1;
+        }
+        prev += unzigzag(v);
+        out[i].sec = (int64_t)prev / 1000000000L;
+        out[i].nanosec = (int64_t)prev % 1000000000L;
+    }
+    return p != end;
+}
+
+int CompactRecorder::write(long pakSeq, Type type, int flow)
 {
     if (fd == -1)
     {
@@ -60,12 +271,244 @@ int CompactRecorder::write(long pakSeq, Type type)
     }
 
     struct timespec current;
-    clock_gettime(CLOCK_REALTIME_COARSE, &current);
+    clock_gettime(clock == COARSE ? CLOCK_REALTIME_COARSE : CLOCK_REALTIME, 
+        &current);
 
-    Record rec = {pakSeq, type, (int)current.tv_nsec, current.tv_sec};
+    return write(pakSeq, type, current, clock, flow);
+}
 
-    // we rely on the fact that write() is atomic after Linux 3.14
-    return ::write(fd, &rec, sizeof(Record)) < 0;
+int CompactRecorder::write(long pakSeq, Type type, const timespec &ts, 
+    Clock clock, int flow)
+{
+    if (fd == -1)
+    {
+        return -1;
+    }
+
+    Lane *lane = getLane();
+    if (lane == nullptr)
+    {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+        return 1;
+    }
+
+    Chunk *chunk = lane->chunk;
+    if (chunk == nullptr)
+    {
+        std::unique_lock<std::mutex> lock(chunkLock);
+        if (freeChunks.empty())
+        {
+            lock.unlock();
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return 1;
+        }
+        chunk = lane->chunk = freeChunks.back();
+        freeChunks.pop_back();
+    }
+
+    Record &rec = chunk->recs[chunk->count++];
+    rec.pakSeq = pakSeq;
+    rec.type = type | (clock << 8) | ((flow & 0xffff) << 16);
+    rec.nanosec = (int)ts.tv_nsec;
+    rec.sec = ts.tv_sec;
+
+    if (chunk->count == (1 << CHUNK_LEVEL))
+    {
+        lane->chunk = nullptr;
+        submit(chunk);
+    }
+    return 0;
+}
+
+CompactRecorder::Lane* CompactRecorder::getLane()
+{
+    static thread_local CompactRecorder *owner = nullptr;
+    static thread_local Lane *lane = nullptr;
+
+    if (owner != this)
+    {
+        int id = laneCount++;
+        if (id >= MAX_LANES)
+        {
+            log.error("CompactRecorder::getLane: More than %d writer "
+                "threads, records of this thread are dropped.", (int)MAX_LANES);
+            lane = nullptr;
+        }
+        else
+        {
+            lane = &lanes[id];
+        }
+        owner = this;
+    }
+    return lane;
+}
+
+void CompactRecorder::submit(Chunk *chunk)
+{
+    std::lock_guard<std::mutex> lock(chunkLock);
+    fullChunks.push_back(chunk);
+    chunkCond.notify_all();
+}
+
+int CompactRecorder::writeOut(const char *buf, long len)
+{
+    char errbuf[64];
+    long nwritten;
+
+    while (len > 0 && !broken)
+    {
+        if ((nwritten = ::write(fd, buf, len)) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            log.error("CompactRecorder::writeOut: write() "
+                "failed(%s), no more records are written.",
+                Log::strerror(errbuf));
+            broken = 1;
+            break;
+        }
+        len -= nwritten;
+        buf += nwritten;
+    }
+    return broken;
+}
+
+void CompactRecorder::writeHeader()
+{
+    if (!headerWritten)
+    {
+        writeOut((char*)&header, sizeof(header));
+        headerWritten = 1;
+    }
+}
+
+void CompactRecorder::flusherMain(CompactRecorder *rec)
+{
+    std::vector<Chunk*> todo;
+
+    while (1)
+    {
+        {
+            std::unique_lock<std::mutex> lock(rec->chunkLock);
+            rec->flushing = 0;
+            rec->chunkCond.notify_all();
+            rec->chunkCond.wait(lock, [&] 
+                { return !rec->fullChunks.empty() || rec->toExit; });
+            if (rec->fullChunks.empty())
+            {
+                return;
+            }
+            todo.swap(rec->fullChunks);
+            rec->flushing = 1;
+        }
+
+        // the run information is complete once records arrive
+        rec->writeHeader();
+        for (Chunk *chunk : todo)
+        {
+            long len = encodeBlock(chunk->recs.get(), chunk->count, 
+                rec->encodeBuf.get());
+            rec->writeOut(rec->encodeBuf.get(), len);
+            chunk->count = 0;
+        }
+
+        std::lock_guard<std::mutex> lock(rec->chunkLock);
+        rec->freeChunks.insert(rec->freeChunks.end(), todo.begin(), 
+            todo.end());
+        todo.clear();
+    }
+}
+
+void CompactRecorder::flush()
+{
+    if (fd == -1)
+    {
+        return;
+    }
+
+    int n = laneCount.load() < MAX_LANES ? laneCount.load() : MAX_LANES;
+    for (int i = 0; i < n; ++i)
+    {
+        if (lanes[i].chunk != nullptr)
+        {
+            submit(lanes[i].chunk);
+            lanes[i].chunk = nullptr;
+        }
+    }
+
+    std::unique_lock<std::mutex> lock(chunkLock);
+    chunkCond.wait(lock, [&] { return fullChunks.empty() && !flushing; });
+}
+
+void CompactRecorder::close()
+{
+    if (fd == -1)
+    {
+        return;
+    }
+
+    flush();
+    {
+        std::lock_guard<std::mutex> lock(chunkLock);
+        toExit = 1;
+        chunkCond.notify_all();
+    }
+    flusher->join();
+    flusher = nullptr;
+    // a run without records still gets its header
+    writeHeader();
+
+    if (dropped.load() > 0)
+    {
+        log.warning("CompactRecorder::close: %ld records dropped.", 
+            dropped.load());
+    }
+    if (fd != STDOUT_FILENO)
+    {
+        ::close(fd);
+    }
+    fd = -1;
+}
+
+RecordReader::RecordReader(): fd(-1), version(1), header(), map(nullptr),
+    mapLen(0), mapPos(0), streamBuf(), streamBytes(0), streamPos(0),
+    streamEnd(0), recs(nullptr), count(0), loaded(), pos(0), block(),
+    blockPos(0), byTime(), bySeq()
+{
+}
+
+RecordReader::~RecordReader()
+{
+    release();
+}
+
+void RecordReader::release()
+{
+    if (map != nullptr)
+    {
+        munmap((void*)map, mapLen);
+        map = nullptr;
+    }
+    if (fd > STDIN_FILENO)
+    {
+        ::close(fd);
+    }
+    fd = -1;
+    version = 1;
+    mapLen = mapPos = 0;
+    streamBuf.reset();
+    streamBytes = streamPos = 0;
+    streamEnd = 0;
+    recs = nullptr;
+    count = 0;
+    loaded.clear();
+    pos = 0;
+    block.clear();
+    blockPos = 0;
+    byTime.clear();
+    bySeq.clear();
 }
 
 int RecordReader::init(const char *path)
@@ -76,7 +519,8 @@ int RecordReader::init(const char *path)
         log.error("RecordReader::init: Empty input file name.");
         return 1;
     }
-    
+
+    release();
     if (path[0] == '-' && path[1] == 0)
     {
         fd = STDIN_FILENO;
@@ -95,26 +539,252 @@ int RecordReader::init(const char *path)
         }
     }
 
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr != MAP_FAILED)
+        {
+            madvise(addr, st.st_size, MADV_SEQUENTIAL);
+            map = (const char*)addr;
+            mapLen = st.st_size;
+        }
+    }
+    if (map == nullptr)
+    {
+        // not mappable, read it as a stream
+        streamBuf = std::make_unique<char[]>(STREAM_LEN);
+    }
+
+    const char *magic = nullptr;
+    if (map != nullptr)
+    {
+        magic = mapLen >= sizeof(header) ? map : nullptr;
+    }
+    else if (fill(sizeof(header)) >= (long)sizeof(header))
+    {
+        magic = streamBuf.get();
+    }
+    if (magic != nullptr && 
+        memcmp(magic, CompactRecorder::MAGIC, sizeof(header.magic)) == 0)
+    {
+        memcpy(&header, take(sizeof(header)), sizeof(header));
+        version = header.version;
+        if (version != CompactRecorder::VERSION_2 || 
+            header.length < (int)sizeof(header) ||
+            take(header.length - sizeof(header)) == nullptr)
+        {
+            log.error("RecordReader::init: Unsupported record file %s"
+                "(version %d).", path, version);
+            return 3;
+        }
+        return 0;
+    }
+
+    version = 1;
+    if (map != nullptr)
+    {
+        recs = (const Record*)map;
+        count = mapLen / sizeof(Record);
+        if (mapLen % sizeof(Record) != 0)
+        {
+            log.warning("RecordReader::init: Ignoring %ld trailing "
+                "bytes of %s.", (long)(mapLen % sizeof(Record)), path);
+        }
+    }
     return 0;
 }
 
-int RecordReader::next(CompactRecorder::Record &res)
+long RecordReader::fill(long need)
 {
-    if (read(fd, &res.pakSeq, sizeof(long)) < sizeof(long))
+    char *buf = streamBuf.get();
+    char errbuf[64];
+
+    memmove(buf, buf + streamPos, streamBytes - streamPos);
+    streamBytes -= streamPos;
+    streamPos = 0;
+
+    while (streamBytes < need && !streamEnd)
+    {
+        ssize_t nread = read(fd, buf + streamBytes, STREAM_LEN - streamBytes);
+
+        if (nread < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            log.error("RecordReader::fill: read() failed(%s).",
+                Log::strerror(errbuf));
+            streamEnd = 1;
+        }
+        else if (nread == 0)
+        {
+            streamEnd = 1;
+        }
+        else
+        {
+            streamBytes += nread;
+        }
+    }
+    return streamBytes;
+}
+
+const char* RecordReader::take(long len)
+{
+    const char *p;
+
+    if (map != nullptr)
+    {
+        if ((long)mapLen - mapPos < len)
+        {
+            return nullptr;
+        }
+        p = map + mapPos;
+        mapPos += len;
+        return p;
+    }
+    if (streamBuf == nullptr || len > STREAM_LEN)
+    {
+        return nullptr;
+    }
+    if (streamBytes - streamPos < len && fill(len) < len)
+    {
+        return nullptr;
+    }
+    p = streamBuf.get() + streamPos;
+    streamPos += len;
+    return p;
+}
+
+int RecordReader::nextBlock()
+{
+    CompactRecorder::BlockHeader hdr;
+    const char *data;
+
+    if ((data = take(sizeof(hdr))) == nullptr)
     {
         return 1;
     }
-    if (read(fd, &res.type, sizeof(int)) < sizeof(int))
+    memcpy(&hdr, data, sizeof(hdr));
+    if (hdr.count < 0 || hdr.length < 0 || 
+        hdr.count > header.blockRecords ||
+        (data = take(hdr.length)) == nullptr)
     {
+        log.error("RecordReader::nextBlock: Truncated or corrupted block.");
         return 1;
     }
-    if (read(fd, &res.nanosec, sizeof(int)) < sizeof(int))
+
+    block.resize(hdr.count);
+    blockPos = 0;
+    if (CompactRecorder::decodeBlock(hdr, data, block.data()) != 0)
+    {
+        log.error("RecordReader::nextBlock: Corrupted block.");
+        block.clear();
+        return 1;
+    }
+    return 0;
+}
+
+int RecordReader::next(Record &res)
+{
+    if (version >= CompactRecorder::VERSION_2)
+    {
+        // skip empty blocks
+        while (blockPos >= block.size())
+        {
+            if (nextBlock() != 0)
+            {
+                return 1;
+            }
+        }
+        res = block[blockPos++];
+        return 0;
+    }
+    if (map != nullptr)
+    {
+        if (pos >= count)
+        {
+            return 1;
+        }
+        res = recs[pos++];
+        return 0;
+    }
+
+    const char *p = take(sizeof(Record));
+    if (p == nullptr)
     {
         return 1;
     }
-    if (read(fd, &res.sec, sizeof(long)) < sizeof(long))
+    memcpy(&res, p, sizeof(Record));
+    return 0;
+}
+
+int RecordReader::load()
+{
+    Record rec;
+
+    if (recs != nullptr)
+    {
+        return 0;
+    }
+    if (fd == -1)
     {
         return 1;
     }
+
+    while (next(rec) == 0)
+    {
+        loaded.push_back(rec);
+    }
+    recs = loaded.data();
+    count = loaded.size();
+    pos = count;
     return 0;
 }
+
+std::pair<RecordReader::IndexIterator, RecordReader::IndexIterator> 
+    RecordReader::timeRange(long fromNs, long toNs)
+{
+    auto before = [](const Record *a, const Record *b)
+        { return nanoTime(*a) < nanoTime(*b); };
+
+    if (byTime.size() != (size_t)count)
+    {
+        byTime.resize(count);
+        for (long i = 0; i < count; ++i)
+        {
+            byTime[i] = recs + i;
+        }
+        // chunks are mostly ordered already
+        std::stable_sort(byTime.begin(), byTime.end(), before);
+    }
+
+    auto first = std::partition_point(byTime.cbegin(), byTime.cend(),
+        [=](const Record *r) { return nanoTime(*r) < fromNs; });
+    auto last = std::partition_point(first, byTime.cend(),
+        [=](const Record *r) { return nanoTime(*r) < toNs; });
+    return {first, last};
+}
+
+std::pair<RecordReader::IndexIterator, RecordReader::IndexIterator> 
+    RecordReader::seqRange(long from, long to)
+{
+    auto before = [](const Record *a, const Record *b)
+        { return a->pakSeq < b->pakSeq; };
+
+    if (bySeq.size() != (size_t)count)
+    {
+        // start from time order so that records of the same packet stay
+        // ordered by time
+        timeRange(0, 0);
+        bySeq = byTime;
+        std::stable_sort(bySeq.begin(), bySeq.end(), before);
+    }
+
+    auto first = std::partition_point(bySeq.cbegin(), bySeq.cend(),
+        [=](const Record *r) { return r->pakSeq < from; });
+    auto last = std::partition_point(first, bySeq.cend(),
+        [=](const Record *r) { return r->pakSeq < to; });
+    return {first, last};
+}
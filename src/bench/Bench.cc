@@ -0,0 +1,485 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include "Log.hh"
+#include "RWLock.hh"
+#include "SPSCQueue.hh"
+#include "Util.hh"
+
+static char usage[] =
+    "Usage: %s [OPTIONS]\n"
+    "  Time the hot paths of the probe, one benchmark after another, and\n"
+    "  print a CSV line for every benchmark and thread count to stdout:\n"
+    "  bench,threads,ops,seconds,mops,ns_per_op, where mops is the total\n"
+    "  rate in millions of operations per second and ns_per_op the time\n"
+    "  of one operation on one thread(on the consumer for queue_handoff).\n"
+    "  -d [seconds]\n"
+    "    Run every benchmark for [seconds].\n"
+    "    Default: 0.5\n"
+    "  -f [text]\n"
+    "    Run only the benchmarks whose names contain [text].\n"
+    "    Default: all\n"
+    "  -h\n"
+    "    Display this message and quit.\n"
+    "  -j [threads]\n"
+    "    Run the multi-threaded benchmarks with 1, 2, 4, ... up to\n"
+    "    [threads] threads.\n"
+    "    Default: the number of CPUs, at least 2\n"
+    "  -v\n"
+    "    Display version information.\n";
+
+static const int MAX_THREADS = 64;
+// operations between two looks at the clock
+static const int ROUND = 256;
+
+static double duration = 0.5;
+static const char *filter = "";
+static int maxThreads;
+
+static std::atomic<int> stop;
+static std::atomic<int> ready;
+// keeps what the benchmarks read from being optimized out
+static std::atomic<long> sink;
+
+// one thread of a benchmark: count operations in `ops` until `stop`.
+typedef void (*Body)(int id, long &ops);
+
+static int parseArguments(int argc, char **argv)
+{
+    char c;
+
+    maxThreads = std::thread::hardware_concurrency();
+    maxThreads = maxThreads < 2 ? 2 : maxThreads;
+    while ((c = getopt(argc, argv, "d:f:hj:v")) != EOF)
+    {
+        switch (c)
+        {
+        case 'd':
+            duration = atof(optarg);
+            break;
+        case 'f':
+            filter = optarg;
+            break;
+        case 'h':
+            log.longMessage(usage, argv[0]);
+            return -1;
+            break;
+        case 'j':
+            maxThreads = atoi(optarg);
+            break;
+        case 'v':
+            log.message("Version %s\n", VERSION);
+            return -1;
+            break;
+        default:
+            log.error("parseArguments: Unrecognized option %c", c);
+            return 2;
+            break;
+        }
+    }
+
+    if (duration <= 0)
+    {
+        log.error("parseArguments: Duration %.3fs too short.", duration);
+        return 4;
+    }
+    if (maxThreads < 1 || maxThreads > MAX_THREADS)
+    {
+        log.error("parseArguments: Number of threads %d out of range "
+            "[1, %d].", maxThreads, (int)MAX_THREADS);
+        return 4;
+    }
+
+    return 0;
+}
+
+static void runThread(Body body, int id, long *ops)
+{
+    ready.fetch_add(1);
+    // wait for the start, so that all threads are timed alike
+    while (ready.load() >= 0)
+    {
+        std::this_thread::yield();
+    }
+    // counted on the stack, not next to the counters of other threads
+    long n = 0;
+    body(id, n);
+    *ops = n;
+}
+
+static int isSelected(const char *name)
+{
+    return strstr(name, filter) != nullptr;
+}
+
+// run `body` on `threads` threads for `duration` seconds, and print the
+// result as `name`. `counting` is the number of threads counting
+// operations.
+static void run(const char *name, int threads, int counting, Body body)
+{
+    std::thread workers[MAX_THREADS];
+    long ops[MAX_THREADS] = {0};
+    long total = 0;
+
+    if (!isSelected(name))
+    {
+        return;
+    }
+    stop = 0;
+    ready = 0;
+    for (int i = 0; i < threads; ++i)
+    {
+        workers[i] = std::thread(runThread, body, i, &ops[i]);
+    }
+    while (ready.load() < threads)
+    {
+        std::this_thread::yield();
+    }
+
+    auto st = std::chrono::steady_clock::now();
+    ready = -1;
+    std::this_thread::sleep_for(std::chrono::microseconds(
+        (long)(duration * 1000000)));
+    stop = 1;
+    for (int i = 0; i < threads; ++i)
+    {
+        workers[i].join();
+        total += ops[i];
+    }
+    double secs = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - st).count();
+
+    printf("%s,%d,%ld,%.3f,%.3f,%.1f\n", name, threads, total, secs,
+        total / secs / 1e6, total == 0 ? 0 : secs * counting * 1e9 / total);
+    fflush(stdout);
+}
+
+// run `body` with 1, 2, 4, ... `maxThreads` threads.
+static void runScaled(const char *name, Body body)
+{
+    for (int threads = 1; threads <= maxThreads; threads *= 2)
+    {
+        run(name, threads, threads, body);
+    }
+}
+
+// Log: formatting a message and handing it to the worker, which writes
+// to /dev/null. the pools block when full, so what is timed is the rate
+// the worker keeps up with.
+static UniqueSmart<Log> benchLog;
+
+static void logMessage(int id, long &ops)
+{
+    while (!stop.load(std::memory_order_relaxed))
+    {
+        for (int i = 0; i < ROUND; ++i)
+        {
+            benchLog->message("bench: Packet %ld sent, RTT %ld ns.",
+                ops + i, (ops + i) * 3);
+        }
+        ops += ROUND;
+    }
+}
+
+static void benchLogIssue()
+{
+    int fd = open("/dev/null", O_WRONLY);
+
+    for (int deferred = 0; deferred <= 1; ++deferred)
+    {
+        const char *name = deferred ? "log_deferred" : "log_issue";
+        if (!isSelected(name))
+        {
+            continue;
+        }
+        benchLog = std::make_unique<Log>(fd);
+        benchLog->setDeferred(deferred);
+        benchLog->setFullPolicy(Log::FullPolicy::BLOCK);
+        runScaled(name, logMessage);
+        benchLog = nullptr;
+    }
+    close(fd);
+}
+
+// FixSizeMemoryPool: taking a slot and giving it back, with nothing
+// written.
+struct LogBench
+{
+    static UniqueSmart<Log::FixSizeMemoryPool> pool;
+
+    static void getRelease(int id, long &ops)
+    {
+        while (!stop.load(std::memory_order_relaxed))
+        {
+            for (int i = 0; i < ROUND; ++i)
+            {
+                char *p = pool->get();
+                if (p != nullptr)
+                {
+                    pool->release(p);
+                }
+            }
+            ops += ROUND;
+        }
+    }
+
+    static void run()
+    {
+        if (!isSelected("pool_get"))
+        {
+            return;
+        }
+        pool = std::make_unique<Log::FixSizeMemoryPool>(
+            (int)Log::DEF_SHORT_BUF_LEN_LEVEL, 
+            (int)Log::DEF_SHORT_BUF_CNT_LEVEL);
+        runScaled("pool_get", getRelease);
+        pool = nullptr;
+    }
+};
+
+UniqueSmart<Log::FixSizeMemoryPool> LogBench::pool;
+
+// CompactRecorder: appending records to the lane of the thread, flushed to
+// /dev/null. records dropped because the flusher fell behind are not
+// operations.
+static UniqueSmart<CompactRecorder> benchRec;
+
+static void recorderWrite(int id, long &ops)
+{
+    long seq = 0;
+
+    while (!stop.load(std::memory_order_relaxed))
+    {
+        for (int i = 0; i < ROUND; ++i)
+        {
+            ops += benchRec->write(seq++, CompactRecorder::Type::SENT) == 0;
+        }
+    }
+}
+
+static void benchRecorderWrite()
+{
+    if (!isSelected("recorder_write"))
+    {
+        return;
+    }
+    for (int threads = 1; threads <= maxThreads; threads *= 2)
+    {
+        benchRec = std::make_unique<CompactRecorder>();
+        if (benchRec->init("/dev/null") != 0)
+        {
+            return;
+        }
+        run("recorder_write", threads, threads, recorderWrite);
+        if (benchRec->getDropped() > 0)
+        {
+            log.warning("benchRecorderWrite: %ld records dropped and not "
+                "counted, the flusher fell behind.", benchRec->getDropped());
+        }
+        benchRec->close();
+        benchRec = nullptr;
+    }
+}
+
+// RecordReader: decoding a record file written by CompactRecorder, over
+// and over.
+static const long READER_RECORDS = 1 << 20;
+static char readerPath[64];
+
+static void readerNext(int id, long &ops)
+{
+    CompactRecorder::Record rec;
+
+    while (!stop.load(std::memory_order_relaxed))
+    {
+        RecordReader rd;
+        if (rd.init(readerPath) != 0)
+        {
+            return;
+        }
+        while (rd.next(rec) == 0)
+        {
+            if ((++ops & (ROUND - 1)) == 0 &&
+                stop.load(std::memory_order_relaxed))
+            {
+                return;
+            }
+        }
+    }
+}
+
+static void benchReaderNext()
+{
+    CompactRecorder rec;
+    int fd;
+
+    if (!isSelected("reader_next"))
+    {
+        return;
+    }
+    snprintf(readerPath, sizeof(readerPath), "/tmp/udpnetprobe-bench-XXXXXX");
+    if ((fd = mkstemp(readerPath)) < 0 || rec.init(readerPath) != 0)
+    {
+        log.error("benchReaderNext: Cannot create %s.", readerPath);
+        return;
+    }
+    close(fd);
+    // as the Sender would write them: a few packets in flight
+    for (long i = 0; i < READER_RECORDS / 2; ++i)
+    {
+        rec.write(i, CompactRecorder::Type::SENT);
+        rec.write(i - 4, CompactRecorder::Type::ACKED);
+        if ((i & 4095) == 0)
+        {
+            // do not outrun the flusher
+            rec.flush();
+        }
+    }
+    rec.close();
+    run("reader_next", 1, 1, readerNext);
+    unlink(readerPath);
+}
+
+// RWLock: shared and exclusive sections of a few instructions, all
+// threads on the same lock.
+static RWLock benchLock;
+static long guarded;
+
+static void rwlockRead(int id, long &ops)
+{
+    long sum = 0;
+
+    while (!stop.load(std::memory_order_relaxed))
+    {
+        for (int i = 0; i < ROUND; ++i)
+        {
+            benchLock.readLock();
+            sum += guarded;
+            benchLock.readRelease();
+        }
+        ops += ROUND;
+    }
+    sink.fetch_add(sum, std::memory_order_relaxed);
+}
+
+static void rwlockWrite(int id, long &ops)
+{
+    while (!stop.load(std::memory_order_relaxed))
+    {
+        for (int i = 0; i < ROUND; ++i)
+        {
+            benchLock.writeLock();
+            ++guarded;
+            benchLock.writeRelease();
+        }
+        ops += ROUND;
+    }
+}
+
+// one in 16 operations writes
+static void rwlockMixed(int id, long &ops)
+{
+    long sum = 0;
+
+    while (!stop.load(std::memory_order_relaxed))
+    {
+        for (int i = 0; i < ROUND; ++i)
+        {
+            if ((i & 15) == id % 16)
+            {
+                benchLock.writeLock();
+                ++guarded;
+                benchLock.writeRelease();
+            }
+            else
+            {
+                benchLock.readLock();
+                sum += guarded;
+                benchLock.readRelease();
+            }
+        }
+        ops += ROUND;
+    }
+    sink.fetch_add(sum, std::memory_order_relaxed);
+}
+
+// SPSCQueue: a receive thread handing requests of the size of the
+// Receiver's to the ACK thread. ops are requests popped.
+struct Request
+{
+    long seq;
+    long echoTime;
+    long recvTime;
+    int phase;
+    int ackRatio;
+    long readTime;
+};
+
+static SPSCQueue<Request> handoff(16);
+
+static void queueHandoff(int id, long &ops)
+{
+    Request req = {0, 0, 0, -1, 0, 0};
+
+    if (id == 0)
+    {
+        while (!stop.load(std::memory_order_relaxed))
+        {
+            if (!handoff.push(req))
+            {
+                std::this_thread::yield();
+                continue;
+            }
+            ++req.seq;
+        }
+        return;
+    }
+    while (!stop.load(std::memory_order_relaxed))
+    {
+        if (handoff.pop(req, 1000))
+        {
+            ++ops;
+        }
+    }
+    // leave nothing for the next run
+    while (handoff.pop(req))
+    {
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int ret;
+
+    log.message("This is UDPNetProbe Bench, Version %s", VERSION);
+
+    ret = parseArguments(argc, argv);
+    if (ret < 0)
+    {
+        return 0;
+    }
+    else if (ret > 0)
+    {
+        log.error("main: Not recoverable, exit.");
+        return 1;
+    }
+
+    printf("bench,threads,ops,seconds,mops,ns_per_op\n");
+    benchLogIssue();
+    LogBench::run();
+    benchRecorderWrite();
+    benchReaderNext();
+    runScaled("rwlock_read", rwlockRead);
+    runScaled("rwlock_write", rwlockWrite);
+    runScaled("rwlock_mixed", rwlockMixed);
+    run("queue_handoff", 2, 1, queueHandoff);
+
+    return 0;
+}
@@ -0,0 +1,86 @@
+#!/bin/bash
+# Loopback benchmark of the Sender and Receiver in [bin dir](default
+# ../bin). For every packet size, the Sender measures each rate in turn
+# for $SECS seconds(a test plan phase, after half a second of warm-up),
+# up to the first rate at which packets go missing or are not sent in
+# time. Prints a CSV line per size to stdout:
+#   size,max_pps,rtt_p50_us,rtt_p99_us,rtt_max_us,dwell_us
+# max_pps is the highest rate sustained without loss, 0 if none was, and
+# the latencies are those of the lowest rate, i.e. what the probe and the
+# loopback path add to an idle round trip. The steps are logged to stderr.
+#
+# SIZES, RATES(packets per second, ascending), SECS, PORT and LOSS(the
+# fraction of packets allowed to go unACKed) may be set in the environment.
+
+BIN=${1:-../bin}
+SIZES=${SIZES:-64 512 1400}
+RATES=${RATES:-1000 10000 20000 50000 100000 200000 500000 1000000}
+SECS=${SECS:-1}
+PORT=${PORT:-23456}
+LOSS=${LOSS:-0.001}
+LOG=`mktemp /tmp/udpnetprobe-loopback-XXXXXX`
+PLAN=`mktemp /tmp/udpnetprobe-loopback-XXXXXX`
+
+# run at rate $1 with packets of $2 bytes, and print
+#   sent acked rtt_p50 rtt_p99 rtt_max dwell
+step()
+{
+    local count=`awk "BEGIN { print int($1 * $SECS) }"`
+
+    echo "name=loopback rate=${1}pps size=$2 count=$count duration=$SECS" \
+        "warmup=0.5 cooldown=0.2" > $PLAN
+    $BIN/udpnetprobe-sender -l $PORT -P $PLAN > $LOG 2>&1 &
+    local sp=$!
+    sleep 0.2
+    $BIN/udpnetprobe-receiver -c 127.0.0.1 -p $PORT > /dev/null 2>&1 &
+    local rp=$!
+    # the Sender starts on the first START, 100ms in at the latest
+    sleep `awk "BEGIN { print $SECS + 1.2 }"`
+    kill -INT $rp
+    sleep 0.2
+    kill -INT $sp
+    wait $sp $rp 2> /dev/null
+
+    awk '
+        /\/loopback\]: Run of/ {
+            sent = $0; sub(/ sent\(.*/, "", sent); sub(/.* /, "", sent)
+            acked = $0; sub(/ acked.*/, "", acked); sub(/.* /, "", acked)
+        }
+        /\/loopback\]: RTT\(us\)/ {
+            for (i = 1; i < NF; ++i)
+            {
+                if ($i == "p50") p50 = $(i + 1)
+                if ($i == "p99") p99 = $(i + 1)
+                if ($i == "max") max = $(i + 1)
+            }
+            dwell = $NF; sub(/\.$/, "", dwell)
+        }
+        END { print sent + 0, acked + 0, p50 + 0, p99 + 0, max + 0,
+            dwell + 0 }' $LOG
+}
+
+echo "size,max_pps,rtt_p50_us,rtt_p99_us,rtt_max_us,dwell_us"
+for size in $SIZES
+do
+    max=0
+    latency=""
+    for rate in $RATES
+    do
+        read sent acked p50 p99 rttMax dwell <<< `step $rate $size`
+        ok=`awk "BEGIN { want = int($rate * $SECS);
+            print ($sent >= want && $acked >= want * (1 - $LOSS)) }"`
+        echo "loopback: size $size rate $rate: $sent sent, $acked acked," \
+            "RTT(us) p50 $p50 p99 $p99 max $rttMax, dwell $dwell" >&2
+        if [ -z "$latency" ]
+        then
+            latency="$p50,$p99,$rttMax,$dwell"
+        fi
+        if [ "$ok" != 1 ]
+        then
+            break
+        fi
+        max=$rate
+    done
+    echo "$size,$max,$latency"
+done
+rm -f $LOG $PLAN
@@ -0,0 +1,235 @@
+#ifndef __BATCH_HH__
+#define __BATCH_HH__
+
+#include <stdint.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include "Represent.hh"
+
+// Batched datagram transmitter.
+// packets are laid out in pre-allocated fixed-size slots and handed to the
+// kernel with as few sendmmsg() calls as possible. when GSO is enabled, runs
+// of same-sized packets to the same destination are further coalesced into a
+// single message carrying a UDP_SEGMENT control message, so the stack (or
+// the NIC) splits them into individual datagrams on the way out. when
+// SO_TXTIME is enabled, every message also carries the time the qdisc is
+// to release it; only packets with the same transmit time are coalesced.
+//
+// with MSG_ZEROCOPY, the kernel sends straight from the slots and keeps
+// referring to them until it posts a completion to the error queue. the
+// slots then live in a ring of page-locked frames, each as large as the
+// whole batch; every flush moves on to the next frame, which must not be
+// filled before `isBusy` turns false. completions are fed in through
+// `complete`(see `TxTimestamps::setZeroCopy`).
+//
+// typical usage:
+//
+// SendBatch batch(64, 1400);
+// for (...)
+// {
+//     Message *msg = (Message*)batch.add(dst, 1400);
+//     msg->value = seq++;
+// }
+// batch.flush(fd);
+class SendBatch
+{
+private:
+    // limits of the linux UDP GSO implementation
+    static const int MAX_GSO_SEGS = 64;
+    static const int MAX_GSO_BYTES = 65507;
+    static const int CMSG_LEN_MAX = 64;
+
+    struct Packet
+    {
+        sockaddr_in dst;
+        int len;
+        uint64_t txTime;
+    };
+
+    UniqueSmart<char[]> buf;
+    UniqueSmart<Packet[]> packets;
+    UniqueSmart<iovec[]> iovs;
+    UniqueSmart<mmsghdr[]> msgs;
+    UniqueSmart<int[]> msgPackets;
+    UniqueSmart<int[]> sentPackets;
+    UniqueSmart<char[]> cmsgs;
+    // slots of the packets being added
+    char *base;
+    int count;
+    int messages;
+    int gso;
+    int txtime;
+
+    // zero-copy frames. the sends of a frame got consecutive notification
+    // ids, of which `framePending` have not completed yet.
+    char *pool;
+    long poolLen;
+    int frames;
+    int frame;
+    UniqueSmart<uint32_t[]> frameFirst;
+    UniqueSmart<int[]> frameSends;
+    UniqueSmart<int[]> framePending;
+    uint32_t zcNext;
+    long zeroCopied;
+    long copied;
+
+    int build(int first);
+public:
+    const int capacity;
+    const int slotLen;
+
+    SendBatch(int capacity, int slotLen);
+    SendBatch(const SendBatch&) = delete;
+    ~SendBatch();
+
+    // try to enable UDP GSO on `fd`. return 0 on success.
+    int enableGSO(int fd);
+
+    inline int isGSO()
+    {
+        return gso;
+    }
+
+    // let the qdisc(fq or etf) release every message at the transmit time
+    // given to `add`, in ns of `clock`. fq expects CLOCK_MONOTONIC, etf the
+    // clock it was configured with(usually CLOCK_TAI). return 0 on
+    // success. transmit times are dropped again if the kernel rejects
+    // them, see `isTxTime`.
+    int enableTxTime(int fd, clockid_t clock);
+
+    inline int isTxTime()
+    {
+        return txtime;
+    }
+
+    // send with MSG_ZEROCOPY out of `frames` page-locked frames. return 0
+    // on success.
+    int enableZeroCopy(int fd, int frames);
+
+    inline int isZeroCopy()
+    {
+        return frames > 0;
+    }
+
+    // whether the frame to be filled next still waits for completions.
+    inline int isBusy()
+    {
+        return frames > 0 && framePending[frame] > 0;
+    }
+
+    // the kernel is done with the zero-copy sends numbered `lo` to `hi`.
+    // `copied` if it had to copy them after all, e.g. over loopback.
+    void complete(uint32_t lo, uint32_t hi, int copied);
+
+    // sends that went out zero-copy, and sends the kernel copied
+    inline long getZeroCopied()
+    {
+        return zeroCopied;
+    }
+
+    inline long getCopied()
+    {
+        return copied;
+    }
+
+    // append a packet of `len` bytes destined to `dst`, to be sent at
+    // `txTime` if SO_TXTIME is enabled. return its payload buffer
+    // (zero-filled at construction, reused afterwards), or nullptr if the
+    // batch is full.
+    char* add(const sockaddr_in &dst, int len, uint64_t txTime = 0);
+
+    inline char* at(int i)
+    {
+        return base + (long)i * slotLen;
+    }
+
+    inline int size()
+    {
+        return count;
+    }
+
+    inline void clear()
+    {
+        count = 0;
+    }
+
+    // send all queued packets and clear the batch. return the number of
+    // packets sent, or -1 with errno set if the socket is broken.
+    int flush(int fd);
+
+    // number of messages (i.e. sendmsg() calls as seen by the kernel) the
+    // last `flush` was split into, and the number of packets carried by the
+    // `i`-th of them. packets are in the order they were added.
+    inline int messageCount()
+    {
+        return messages;
+    }
+
+    inline int messagePackets(int i)
+    {
+        return sentPackets[i];
+    }
+};
+
+// Batched datagram receiver.
+// `receive` blocks until at least one datagram is readable (or the receive
+// timeout set by `setTimeout` expires), then drains up to `capacity`
+// datagrams with a single recvmmsg() call. datagrams longer than `slotLen`
+// are truncated; callers only look at the message header anyway. ancillary
+// data (e.g. kernel timestamps) is available through `header`.
+class RecvBatch
+{
+private:
+    static const int CONTROL_LEN = 256;
+
+    UniqueSmart<char[]> buf;
+    UniqueSmart<char[]> control;
+    UniqueSmart<sockaddr_in[]> addrs;
+    UniqueSmart<iovec[]> iovs;
+    UniqueSmart<mmsghdr[]> msgs;
+    int count;
+public:
+    const int capacity;
+    const int slotLen;
+
+    RecvBatch(int capacity, int slotLen);
+    RecvBatch(const RecvBatch&) = delete;
+
+    // bound the time `receive` may block on `fd`, so the caller can notice
+    // shutdown requests. return 0 on success.
+    static int setTimeout(int fd, int ms);
+
+    // return the number of datagrams received, 0 on timeout or interruption,
+    // or -1 with errno set if the socket is broken.
+    int receive(int fd);
+
+    inline int size()
+    {
+        return count;
+    }
+
+    inline char* data(int i)
+    {
+        return buf.get() + (long)i * slotLen;
+    }
+
+    inline int length(int i)
+    {
+        return msgs[i].msg_len;
+    }
+
+    inline const sockaddr_in& from(int i)
+    {
+        return addrs[i];
+    }
+
+    inline const msghdr* header(int i)
+    {
+        return &msgs[i].msg_hdr;
+    }
+};
+
+#endif
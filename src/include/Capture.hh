@@ -0,0 +1,118 @@
+#ifndef __CAPTURE_HH__
+#define __CAPTURE_HH__
+
+#include <stdint.h>
+#include <time.h>
+#include <netinet/in.h>
+
+#include "Represent.hh"
+#include "Util.hh"
+
+// Raw capture of probe packets through a TPACKET_V3 memory-mapped ring.
+// an AF_PACKET socket bound to one interface copies every matching UDP
+// datagram into a ring of blocks shared with userspace, stamped with the
+// time the kernel saw it. a classic BPF filter on the addresses and ports
+// of the probe keeps all other traffic out of the ring, and packets are
+// truncated to the probe header. the kernel hands over a whole block at a
+// time, so there is no system call per packet; `receive` only sleeps in
+// poll() when no block is ready.
+//
+// the interface can be anything that carries IPv4, loopback and veth
+// included. packets this host sends are skipped, so a Sender on the same
+// host is not captured on its way out.
+//
+// usage mirrors RecvBatch:
+//
+// PacketRing ring;
+// ring.open("eth0", sender, localPort, clock);
+// while (...)
+// {
+//     for (int i = 0, n = ring.receive(100); i < n; ++i)
+//     {
+//         Message *msg = (Message*)ring.data(i);
+//         ...
+//     }
+// }
+class PacketRing
+{
+private:
+    static const int BLOCK_SIZE = 1 << 20;
+    static const int BLOCK_NR = 64;
+    static const int FRAME_SIZE = 2048;
+    // bytes kept of every packet: IPv4(with options) and UDP headers, and
+    // the probe header
+    static const int SNAP_LEN = 60 + 8 + 64;
+
+    struct Frame
+    {
+        const char *data;
+        int len;
+        sockaddr_in from;
+        timespec ts;
+        CompactRecorder::Clock clock;
+    };
+
+    int fd;
+    char *map;
+    long mapLen;
+    // block being read, and whether it is still to be handed back
+    int block;
+    int held;
+    UniqueSmart<Frame[]> frames;
+    int count;
+
+    void release();
+public:
+    PacketRing();
+    PacketRing(const PacketRing&) = delete;
+    ~PacketRing();
+
+    // capture the UDP datagrams `sender` sends to local port `port` on
+    // interface `ifname`. `clock` HARDWARE asks for NIC timestamps, any
+    // other clock gives kernel software timestamps. return 0 on success.
+    int open(const char *ifname, const sockaddr_in &sender, int port,
+        CompactRecorder::Clock clock);
+
+    // make the UDP socket `fd` drop everything it receives, as its
+    // datagrams are taken from the ring instead. return 0 on success.
+    static int mute(int fd);
+
+    // hand the last block back to the kernel, and wait up to `ms` for the
+    // next one. return the number of packets in it, 0 on timeout or
+    // interruption, or -1 with errno set if the socket is broken.
+    int receive(int ms);
+
+    inline int size()
+    {
+        return count;
+    }
+
+    // UDP payload of the `i`-th packet, and its length(truncated to what
+    // was captured).
+    inline const char* data(int i)
+    {
+        return frames[i].data;
+    }
+
+    inline int length(int i)
+    {
+        return frames[i].len;
+    }
+
+    inline const sockaddr_in& from(int i)
+    {
+        return frames[i].from;
+    }
+
+    inline const timespec& timestamp(int i, CompactRecorder::Clock &clock)
+    {
+        clock = frames[i].clock;
+        return frames[i].ts;
+    }
+
+    // packets seen and dropped for lack of ring space since the last call.
+    // return 0 on success.
+    int getStats(long &packets, long &drops);
+};
+
+#endif
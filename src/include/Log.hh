@@ -6,15 +6,98 @@
 #include <unistd.h>
 #include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
-#include <list>
 #include <thread>
+#include <tuple>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
+#include "MPSCQueue.hh"
 #include "Represent.hh"
 #include "RWLock.hh"
-#include "Semaphore.hh"
+
+// Argument codec for deferred log entries.
+// arithmetic values, enums and pointers are copied bit by bit. C strings are
+// copied by content, since they often live in a caller's stack buffer or in
+// a static buffer(e.g. inet_ntoa()) that is gone by the time the entry is
+// formatted. anything else cannot be deferred.
+template <typename T>
+struct LogArg
+{
+    typedef T Decoded;
+    static const bool deferrable = std::is_arithmetic<T>::value ||
+        std::is_enum<T>::value || std::is_pointer<T>::value;
+
+    static inline bool encode(char *&p, char *end, const T &val)
+    {
+        if (end - p < (long)sizeof(T))
+        {
+            return false;
+        }
+        memcpy(p, &val, sizeof(T));
+        p += sizeof(T);
+        return true;
+    }
+    static inline T decode(const char *&p)
+    {
+        T val;
+        memcpy(&val, p, sizeof(T));
+        p += sizeof(T);
+        return val;
+    }
+};
+
+template <>
+struct LogArg<const char*>
+{
+    typedef const char* Decoded;
+    static const bool deferrable = true;
+
+    // the string is stored NUL-terminated, truncated to what fits.
+    static inline bool encode(char *&p, char *end, const char *val)
+    {
+        if (end - p < 1)
+        {
+            return false;
+        }
+        if (val == nullptr)
+        {
+            val = "(null)";
+        }
+        int len = strnlen(val, end - p - 1);
+        memcpy(p, val, len);
+        p[len] = 0;
+        p += len + 1;
+        return true;
+    }
+    static inline const char* decode(const char *&p)
+    {
+        const char *val = p;
+        p += strlen(p) + 1;
+        return val;
+    }
+};
+
+template <>
+struct LogArg<char*> : LogArg<const char*> {};
+
+template <typename ... Args>
+struct LogArgs;
+
+template <>
+struct LogArgs<>
+{
+    static const bool deferrable = true;
+};
+
+template <typename T, typename ... Args>
+struct LogArgs<T, Args...>
+{
+    static const bool deferrable = LogArg<T>::deferrable && 
+        LogArgs<Args...>::deferrable;
+};
 
 // Asynchronous logger for hsrvdn
 // this class uses custom memory allocator to support high-performance &
@@ -31,7 +114,9 @@
 // }
 //
 // it is obvious that we must maintain enough number of buffers, or conflicts
-// would happen when load is heavy. the problem is, `LOGBUF_LEN` should be as
+// would happen when load is heavy. a slot is only reused after the worker
+// has written it; what happens when the next slot is still in use is
+// decided by `FullPolicy`. the problem is, `LOGBUF_LEN` should be as
 // large as possible to hold arbitrary user message, but this would not be
 // memory-efficient when `LOGBUF_LEVEL` is large. 
 // in this class, we use two kinds of buffers(`short`/`long` buffer) for
@@ -40,6 +125,14 @@
 // value for it to survive high load. `long` buffer is designed for users to 
 // dump large objects(e.g. BakedException/RawException). we use a small 
 // `LOGBUF_LEVEL` value for it to reduce memory usage.
+//
+// in deferred mode(the default), the calling thread does not format
+// anything. it only stores the format string pointer, a formatter
+// instantiated for the argument types, the raw arguments, its cached TID
+// and a raw timestamp into the buffer, and the worker thread produces the
+// text. the format string must therefore outlive the entry(string literals
+// and static buffers do). calls with arguments that cannot be deferred
+// (see `LogArg`) are formatted immediately as before.
 class Log
 {
 private:
@@ -53,12 +146,33 @@ private:
     {
     private:
         UniqueSmart<char[]> buf;
+        // set while a slot is handed out and not yet written by the worker
+        UniqueSmart<std::atomic<char>[]> busy;
         std::atomic<int> seq;
     public:
         const int len;
         const int count;
         FixSizeMemoryPool(int lenLevel, int countLevel);
+
+        // return the next slot, or nullptr if its previous occupant has not
+        // been written yet.
         char* get();
+
+        inline void release(char *p)
+        {
+            busy[(p - buf.get()) / len].store(0, std::memory_order_release);
+        }
+    };
+
+    // the microbenchmarks(bench/Bench.cc) time the pools directly
+    friend struct LogBench;
+
+    struct PendingEntry
+    {
+        char *buf;
+        // length of the line, or -1 for a deferred entry
+        int len;
+        FixSizeMemoryPool *pool;
     };
 
     class Worker : public std::thread
@@ -74,9 +188,9 @@ private:
     UniqueSmart<Worker> worker;
     FixSizeMemoryPool shortBuf;
     FixSizeMemoryPool longBuf;
-    RWLock pendLock;
-    std::list<std::pair<char*, int>> pending;
-    Semaphore sem;
+    // entries in the order they were issued. the worker is only woken up
+    // if it is asleep.
+    MPSCQueue<PendingEntry> pending;
     timespec tst;
 
     struct PrefixString
@@ -87,22 +201,164 @@ private:
     RWLock prefixLock;
     std::vector<PrefixString> prefixes;
 
+    // layout of a deferred entry. the encoded arguments follow.
+    struct DeferredEntry
+    {
+        int (*format)(char *buf, int len, const char *fmt, const char *args);
+        const char *fmt;
+        timespec ts;
+        // capacity of the buffer holding the entry, which is also the
+        // maximum length of the formatted line
+        int len;
+        unsigned short tid;
+        char prefix[TYPE_LEN];
+    };
+
+public:
+    // what to do when the next slot of a pool is still in use.
+    // BLOCK waits for the worker, DROP discards the message and FALLBACK
+    // retries once on the long pool before dropping.
+    enum class FullPolicy
+    {
+        BLOCK,
+        DROP,
+        FALLBACK
+    };
+
+private:
+    // the worker formats deferred entries into the staging buffer and
+    // writes up to IOV_BATCH lines with a single writev().
+    static const int STAGING_LEN = 1 << 16;
+    static const int IOV_BATCH = 256;
+
+    int deferred;
+    UniqueSmart<char[]> staging;
+    int stagingLen;
+    FullPolicy fullPolicy;
+    std::atomic<long> dropped;
+
 	int toExit;
 
+    template <typename Tuple, size_t ... I>
+    static int formatTuple(char *buf, int len, const char *fmt, 
+        const Tuple &args, std::index_sequence<I...>)
+    {
+        return snprintf(buf, len, fmt, std::get<I>(args) ..., "");
+    }
+
     template <typename ... Args>
-    void issue(char *buf, int len, 
+    static int formatDeferred(char *buf, int len, const char *fmt, 
+        const char *args)
+    {
+        // no arguments to decode leaves `args` unused
+        (void)args;
+        // braced initialization decodes the arguments left to right
+        std::tuple<typename LogArg<Args>::Decoded ...> decoded{
+            LogArg<Args>::decode(args) ...};
+        return formatTuple(buf, len, fmt, decoded, 
+            std::index_sequence_for<Args...>());
+    }
+
+    static inline bool encodeArgs(char *&, char *)
+    {
+        return true;
+    }
+
+    template <typename T, typename ... Args>
+    static inline bool encodeArgs(char *&p, char *end, T &&val, 
+        Args&& ... args)
+    {
+        return LogArg<std::decay_t<T>>::encode(p, end, val) &&
+            encodeArgs(p, end, std::forward<Args>(args) ...);
+    }
+
+    // format `buf` into a complete log line(prefix, message, newline) of at
+    // most `len` bytes. return its length.
+    int formatEntry(char *out, char *buf);
+
+    // get a slot according to `fullPolicy`. `pool` is switched to the long
+    // pool on fallback. return nullptr if the message is to be dropped.
+    char* acquire(FixSizeMemoryPool *&pool);
+
+    // write `batch` and everything pending, reusing `batch` as the drained
+    // queue.
+    void drain(std::vector<PendingEntry> &batch);
+    void writeAll(iovec *iov, int niov);
+
+    inline void push(char *buf, int len, FixSizeMemoryPool *pool)
+    {
+        // every queued entry holds a slot of a pool, and the ring has room
+        // for all of them, so this only spins if a slot was given back
+        // before the worker took its entry
+        while (!pending.push({buf, len, pool}))
+        {
+            std::this_thread::yield();
+        }
+    }
+
+    template <typename ... Args>
+    void issueDeferred(std::true_type, FixSizeMemoryPool *pool, char *buf,
+        const char *prefix, const char *fmt, Args&& ... args)
+    {
+        DeferredEntry *entry = (DeferredEntry*)buf;
+        char *p = buf + sizeof(DeferredEntry);
+
+        if (!encodeArgs(p, buf + pool->len, std::forward<Args>(args) ...))
+        {
+            issue(pool, buf, prefix, fmt, std::forward<Args>(args) ...);
+            return;
+        }
+        entry->format = formatDeferred<std::decay_t<Args>...>;
+        entry->fmt = fmt;
+        clock_gettime(CLOCK_REALTIME_COARSE, &entry->ts);
+        entry->len = pool->len;
+        entry->tid = gettid();
+        strncpy(entry->prefix, prefix, TYPE_LEN - 1);
+        entry->prefix[TYPE_LEN - 1] = 0;
+
+        push(buf, -1, pool);
+    }
+
+    template <typename ... Args>
+    void issueDeferred(std::false_type, FixSizeMemoryPool *pool, char *buf,
+        const char *prefix, const char *fmt, Args&& ... args)
+    {
+        issue(pool, buf, prefix, fmt, std::forward<Args>(args) ...);
+    }
+
+    template <typename ... Args>
+    inline void dispatch(FixSizeMemoryPool *pool,
+        const char *prefix, const char *fmt, Args&& ... args)
+    {
+        char *buf = acquire(pool);
+
+        if (buf == nullptr)
+        {
+            return;
+        }
+        if (deferred)
+        {
+            issueDeferred(std::integral_constant<bool, 
+                    LogArgs<std::decay_t<Args>...>::deferrable>(), 
+                pool, buf, prefix, fmt, std::forward<Args>(args) ...);
+        }
+        else
+        {
+            issue(pool, buf, prefix, fmt, std::forward<Args>(args) ...);
+        }
+    }
+
+    template <typename ... Args>
+    void issue(FixSizeMemoryPool *pool, char *buf,
         const char *prefix, const char *fmt, Args&& ... args)
     {
         sprintf(buf, PREFIX_FMT, prefix, gettid(), getTimestamp());
-        snprintf(buf + PREFIX_LEN, len - PREFIX_LEN - 2, fmt,
+        snprintf(buf + PREFIX_LEN, pool->len - PREFIX_LEN - 2, fmt,
             std::forward<Args>(args) ..., "");
 
 		int slen = strlen(buf);
 		buf[slen] = '\n';
-        pendLock.writeLock();
-        pending.push_back({buf, slen + 1});
-        pendLock.writeRelease();
-        sem.release();
+        push(buf, slen + 1, pool);
     }
 
     inline double getTimestamp()
@@ -114,26 +370,33 @@ private:
     }
     inline unsigned short gettid()
     {
+        // a thread keeps its ID, so ask the kernel only once per thread
+        static thread_local unsigned short tid = 0;
+
+        if (tid == 0)
+        {
         // OK for c++11, maybe BUGGY in later c++ standards.
-    #ifdef SYS_gettid
-        return (unsigned)syscall(SYS_gettid);
-    #else
+        #ifdef SYS_gettid
+            tid = (unsigned)syscall(SYS_gettid);
+        #else
         #warning \
             "SYS_gettid unavailable on this system, using pthread_self instead"
-        return (unsigned)pthread_self();
-    #endif
+            tid = (unsigned)pthread_self();
+        #endif
+        }
+        return tid;
     }
     template <typename ... Args>
     inline void shortLog(const char *prefix, const char *fmt, Args&& ... args)
     {
-        issue(shortBuf.get(), shortBuf.len,
+        dispatch(&shortBuf,
             prefix, fmt, std::forward<Args>(args) ...);
     }
     
     template <typename ... Args>
     inline void longLog(const char *prefix, const char *fmt, Args&& ... args)
     {
-        issue(longBuf.get(), longBuf.len,
+        dispatch(&longBuf,
             prefix, fmt, std::forward<Args>(args) ...);
     }
 public:
@@ -161,13 +424,13 @@ public:
     template <typename ... Args>
     inline void shortLog(int prefixNum, const char *fmt, Args&& ... args)
     {
-        issue(shortBuf.get(), shortBuf.len,
+        dispatch(&shortBuf,
             getPrefix(prefixNum), fmt, std::forward<Args>(args) ...);
     }
     template <typename ... Args>
     inline void longLog(int prefixNum, const char *fmt, Args&& ... args)
     {
-        issue(longBuf.get(), longBuf.len,
+        dispatch(&longBuf,
             getPrefix(prefixNum), fmt, std::forward<Args>(args) ...);
     }
 
@@ -257,6 +520,29 @@ public:
         this->fd = fd;
     }
 
+    inline void setVerboseLevel(int level)
+    {
+        verboseLevel = level;
+    }
+
+    // switch deferred formatting on(default) or off.
+    inline void setDeferred(int deferred)
+    {
+        this->deferred = deferred;
+    }
+
+    // default: FALLBACK
+    inline void setFullPolicy(FullPolicy policy)
+    {
+        fullPolicy = policy;
+    }
+
+    // number of messages dropped because their pool was full.
+    inline long getDropped()
+    {
+        return dropped.load(std::memory_order_relaxed);
+    }
+
     static inline char *strerror(char *buf)
     {
         int num = errno;
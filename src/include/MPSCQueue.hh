@@ -0,0 +1,164 @@
+#ifndef __MPSCQUEUE_HH__
+#define __MPSCQUEUE_HH__
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+#include "Represent.hh"
+
+// Bounded lock-free multi-producer/single-consumer ring.
+// every slot carries a sequence number telling whose turn it is: a
+// producer claims slot `t` by advancing `tail` with a CAS once the slot is
+// free for round `t`, fills it in and publishes it by bumping the sequence
+// number. the consumer owns `head` and takes slots in order, so elements
+// come out in the order their producers claimed them.
+//
+// the consumer may block in `pop(T&, long)`. producers only touch the mutex
+// when the consumer has announced it is going to sleep, so the fast path is
+// one CAS and two stores.
+//
+// the hot members are kept apart by padding rather than alignas, so that
+// heap instances(operator new does not honour over-alignment before
+// c++17) do not share cache lines either.
+template <typename T>
+class MPSCQueue
+{
+private:
+    static const int CACHE_LINE = 64;
+    // how many times the consumer re-checks before going to sleep
+    static const int SPIN_COUNT = 256;
+
+    struct Slot
+    {
+        std::atomic<unsigned long> seq;
+        T val;
+    };
+
+    char padHead[CACHE_LINE];
+    // consumer side
+    unsigned long head;
+    char padTail[CACHE_LINE];
+    // producer side
+    std::atomic<unsigned long> tail;
+    std::atomic<long> overflow;
+    char padSleeping[CACHE_LINE];
+    std::atomic<int> sleeping;
+    char padEnd[CACHE_LINE];
+    std::mutex mutex;
+    std::condition_variable cv;
+
+    UniqueSmart<Slot[]> buf;
+    const unsigned long mask;
+
+    inline bool tryPop(T &res)
+    {
+        Slot &slot = buf[head & mask];
+        if (slot.seq.load(std::memory_order_acquire) != head + 1)
+        {
+            // empty, or its producer is not done yet
+            return false;
+        }
+        res = slot.val;
+        slot.seq.store(head + mask + 1, std::memory_order_release);
+        ++head;
+        return true;
+    }
+public:
+    MPSCQueue(int sizeLevel): head(0), tail(0), overflow(0), sleeping(0),
+        mutex(), cv(), buf(), mask((1ul << sizeLevel) - 1)
+    {
+        buf = std::make_unique<Slot[]>(1ul << sizeLevel);
+        for (unsigned long i = 0; i <= mask; ++i)
+        {
+            buf[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    MPSCQueue(const MPSCQueue&) = delete;
+
+    // any thread. return false(and count an overflow) if the ring is full.
+    inline bool push(const T &val)
+    {
+        unsigned long t = tail.load(std::memory_order_relaxed);
+        Slot *slot;
+        while (1)
+        {
+            slot = &buf[t & mask];
+            long diff = (long)(slot->seq.load(std::memory_order_acquire) - t);
+            if (diff == 0)
+            {
+                if (tail.compare_exchange_weak(t, t + 1,
+                    std::memory_order_relaxed))
+                {
+                    break;
+                }
+            }
+            else if (diff < 0)
+            {
+                // the consumer has not taken the previous round yet
+                overflow.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            else
+            {
+                t = tail.load(std::memory_order_relaxed);
+            }
+        }
+        slot->val = val;
+        slot->seq.store(t + 1, std::memory_order_release);
+
+        // pairs with the fence in pop(): either we see the consumer
+        // sleeping, or it sees our slot before it sleeps.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleeping.load(std::memory_order_relaxed))
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            cv.notify_one();
+        }
+        return true;
+    }
+
+    // consumer only, non-blocking.
+    inline bool pop(T &res)
+    {
+        return tryPop(res);
+    }
+
+    // consumer only. wait up to `us` microseconds for an element.
+    bool pop(T &res, long us)
+    {
+        for (int i = 0; i < SPIN_COUNT; ++i)
+        {
+            if (tryPop(res))
+            {
+                return true;
+            }
+        }
+
+        std::unique_lock<std::mutex> lock(mutex);
+        sleeping.store(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!tryPop(res))
+        {
+            cv.wait_for(lock, std::chrono::microseconds(us));
+            sleeping.store(0, std::memory_order_relaxed);
+            return tryPop(res);
+        }
+        sleeping.store(0, std::memory_order_relaxed);
+        return true;
+    }
+
+    inline long capacity()
+    {
+        return mask + 1;
+    }
+
+    inline long getOverflow()
+    {
+        return overflow.load(std::memory_order_relaxed);
+    }
+};
+
+#endif
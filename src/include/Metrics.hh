@@ -0,0 +1,148 @@
+#ifndef __METRICS_HH__
+#define __METRICS_HH__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <atomic>
+
+// Live counters of a running probe, in POSIX shared memory.
+// every thread that counts something takes a slot of its own, so writers
+// never share a cache line and need no atomic read-modify-write: a slot is
+// a seqlock, bumped to odd before an update and back to even after it.
+// readers(UDPNetProbe-Stat) copy a slot until they see the same even
+// sequence before and after, and sum all slots. updating costs a few
+// plain stores, and no system call.
+//
+// without `create`, the counters live in process memory and nobody sees
+// them.
+//
+// Metrics::Slot *slot = metrics.getSlot();
+// slot->begin();
+// slot->add(Metrics::SENT, n);
+// slot->end();
+class Metrics
+{
+public:
+    enum Counter
+    {
+        SENT,
+        RECEIVED,
+        ACK_SENT,
+        ACKED,
+        IGNORED,
+        // pacing error: sends accounted for, and the sum of their lateness
+        PACED,
+        PACE_ERROR_NS,
+        COUNTERS
+    };
+
+    // bucket i counts RTTs in [2^i, 2^(i+1)) us, the first one everything
+    // below 2 us and the last one everything above
+    static const int RTT_BUCKETS = 24;
+    // two per worker of the Sender at most, and a few to spare
+    static const int MAX_SLOTS = 2 * 64 + 8;
+
+    struct alignas(64) Slot
+    {
+        std::atomic<unsigned> seq;
+        std::atomic<long> counters[COUNTERS];
+        std::atomic<long> rtt[RTT_BUCKETS];
+
+        inline void begin()
+        {
+            seq.store(seq.load(std::memory_order_relaxed) + 1,
+                std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+        }
+
+        inline void end()
+        {
+            seq.store(seq.load(std::memory_order_relaxed) + 1,
+                std::memory_order_release);
+        }
+
+        inline void add(Counter counter, long n)
+        {
+            counters[counter].store(
+                counters[counter].load(std::memory_order_relaxed) + n,
+                std::memory_order_relaxed);
+        }
+
+        inline void addRtt(long ns)
+        {
+            long us = ns / 1000;
+            int i = us < 2 ? 0 : 63 - __builtin_clzl(us);
+            i = i < RTT_BUCKETS ? i : RTT_BUCKETS - 1;
+            rtt[i].store(rtt[i].load(std::memory_order_relaxed) + 1,
+                std::memory_order_relaxed);
+        }
+    };
+
+    struct Header
+    {
+        char magic[8];
+        int32_t version;
+        // local UDP port of the probe, for the drop counters of the kernel
+        int32_t port;
+        int64_t pid;
+        // CLOCK_REALTIME ns when the segment was created
+        int64_t created;
+        char program[32];
+        std::atomic<int> slotCount;
+    };
+
+    struct Segment
+    {
+        Header header;
+        Slot slots[MAX_SLOTS];
+    };
+
+    // sum of all slots
+    struct Snapshot
+    {
+        long counters[COUNTERS];
+        long rtt[RTT_BUCKETS];
+    };
+
+    static const char MAGIC[];
+    static const int VERSION_2 = 2;
+
+private:
+    Segment *seg;
+    int owner;
+    char name[64];
+
+public:
+    Metrics();
+    Metrics(const Metrics&) = delete;
+    ~Metrics();
+
+    // publish the counters of `program` as shared memory object `name`
+    // (/dev/shm/`name`), which must not exist yet. the object is removed
+    // again on destruction. return 0 on success.
+    int create(const char *name, const char *program);
+
+    // map shared memory object `name` read-only. return 0 on success.
+    int attach(const char *name);
+
+    inline void setPort(int port)
+    {
+        seg->header.port = port;
+    }
+
+    inline const Header& getHeader()
+    {
+        return seg->header;
+    }
+
+    // slot of the calling thread, taken on first use. a seqlock has a
+    // single writer, so threads beyond MAX_SLOTS get a slot of their own
+    // that is not published.
+    Slot* getSlot();
+
+    // a consistent copy of every slot, summed up.
+    void read(Snapshot &snap);
+};
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef __PACER_HH__
+#define __PACER_HH__
+
+#include <time.h>
+
+#include "Stats.hh"
+
+// Send pacing on CLOCK_MONOTONIC.
+// a plain sleep wakes up tens of microseconds late, depending on timer
+// slack and scheduler latency. `waitUntil` therefore sleeps until `spinNs`
+// before the deadline and busy-waits for the rest. the lateness of every
+// send relative to its schedule is kept in a histogram, so that sender
+// jitter can be told apart from network jitter.
+//
+// pacing can also be left to the fq or etf qdisc: packets are then handed
+// to the kernel ahead of time, either with a transmit time each(SO_TXTIME,
+// see `SendBatch::enableTxTime`) or with a per-socket rate limit
+// (SO_MAX_PACING_RATE, fq only).
+class Pacer
+{
+public:
+    static const long DEF_SPIN_NS = 20000;
+    // bytes fq counts for a UDP packet on top of its payload: Ethernet,
+    // IPv4 and UDP headers
+    static const int WIRE_OVERHEAD = 42;
+
+private:
+    long spinNs;
+    Histogram error;
+
+public:
+    // must be constructed by the pacing thread, whose timer slack is
+    // lowered.
+    Pacer(long spinNs = DEF_SPIN_NS);
+    Pacer(const Pacer&) = delete;
+
+    static inline long now()
+    {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000L + ts.tv_nsec;
+    }
+
+    // `clock` minus CLOCK_MONOTONIC, in ns.
+    static long clockOffset(clockid_t clock);
+
+    // let fq pace `fd` at `bytesPerSec`. the kernel only ever lowers this
+    // limit. return 0 on success.
+    static int setMaxRate(int fd, double bytesPerSec);
+
+    // parse a packet rate. plain numbers and the suffixes pps, kpps and
+    // Mpps give packets per second; bps, kbps, Mbps and Gbps give payload
+    // bits per second of `pakSize`-byte packets. return 0 on success.
+    static int parseRate(const char *str, int pakSize, double &pps);
+
+    // return at `deadline`(CLOCK_MONOTONIC ns) or right after it, or
+    // earlier if a signal interrupts the sleep.
+    void waitUntil(long deadline);
+
+    // account for a send scheduled at `scheduled` that happened at
+    // `actual`.
+    inline void record(long scheduled, long actual)
+    {
+        error.record(actual - scheduled);
+    }
+
+    inline const Histogram& getError() const
+    {
+        return error;
+    }
+
+    // log the pacing error distribution, labelled with `name`.
+    void report(const char *name) const;
+};
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef __RUNTIME_HH__
+#define __RUNTIME_HH__
+
+#include <sched.h>
+
+#include <atomic>
+#include <vector>
+
+// Low-jitter runtime profile of the probe threads.
+// by default the probe threads float across all CPUs with normal
+// scheduling, and their page faults, migrations and wakeups end up in the
+// measured latencies. the profile is a comma separated list of
+//   cpus=[list]    pin the probe threads, in the order they start, to the
+//                  CPUs of [list], e.g. 2-3:6 for CPUs 2, 3 and 6. threads
+//                  beyond the list wrap around.
+//   node=[node]    keep the memory(and threads not pinned by cpus) on NUMA
+//                  node [node].
+//   fifo[=prio]    run the probe threads SCHED_FIFO at [prio].
+//   busypoll=[us]  busy poll the sockets for up to [us] microseconds before
+//                  sleeping in a receive(SO_BUSY_POLL).
+//   mlock          fault in and lock all current and future memory, thread
+//                  stacks and record buffers included.
+// nothing a setting needs is checked beforehand: every step is tried, and
+// what did and did not take effect is logged, since most of them need
+// privileges or limits the user may not have.
+class Runtime
+{
+public:
+    static const int DEF_FIFO_PRIO = 50;
+
+private:
+    std::vector<int> cpus;
+    int node;
+    int fifoPrio;
+    int busyPollUs;
+    int lock;
+    // CPUs of `node`
+    cpu_set_t nodeCpus;
+    // threads started so far
+    std::atomic<int> threads;
+
+    int parseCpus(const char *str);
+    int loadNode();
+
+public:
+    Runtime();
+    Runtime(const Runtime&) = delete;
+
+    // parse a profile(modified in place). return 0 on success.
+    int parse(char *str);
+
+    // whether anything was requested
+    inline int isEmpty() const
+    {
+        return cpus.empty() && node < 0 && fifoPrio == 0 &&
+            busyPollUs == 0 && !lock;
+    }
+
+    // process wide settings(memory policy and locking). call from the main
+    // thread before any probe thread starts.
+    void applyProcess();
+
+    // per-socket settings.
+    void applySocket(int fd);
+
+    // per-thread settings(CPU and scheduling class). call first thing in
+    // every probe thread, `name` labels it in the log.
+    void applyThread(const char *name);
+};
+
+#endif
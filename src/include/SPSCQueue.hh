@@ -0,0 +1,160 @@
+#ifndef __SPSCQUEUE_HH__
+#define __SPSCQUEUE_HH__
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+#include "Represent.hh"
+
+// Bounded lock-free single-producer/single-consumer ring.
+// the producer owns `tail`, the consumer owns `head`. each side keeps a
+// private copy of the other side's index and only reloads it when the ring
+// looks full/empty, so in steady state no cache line bounces between the
+// two threads except the slots themselves.
+//
+// the consumer may block in `pop(T&, long)`. the producer only touches the
+// mutex when the consumer has announced it is going to sleep, so the fast
+// path stays lock-free.
+//
+// members are cache-line aligned, so instances should have static storage
+// (operator new does not honour over-alignment before c++17).
+template <typename T>
+class SPSCQueue
+{
+private:
+    static const int CACHE_LINE = 64;
+    // how many times the consumer re-checks before going to sleep
+    static const int SPIN_COUNT = 256;
+
+    // consumer side
+    alignas(CACHE_LINE) std::atomic<unsigned long> head;
+    unsigned long cachedTail;
+    std::atomic<long> maxOccupancy;
+
+    // producer side
+    alignas(CACHE_LINE) std::atomic<unsigned long> tail;
+    unsigned long cachedHead;
+    std::atomic<long> overflow;
+
+    alignas(CACHE_LINE) std::atomic<int> sleeping;
+    std::mutex mutex;
+    std::condition_variable cv;
+
+    UniqueSmart<T[]> buf;
+    const unsigned long mask;
+
+    inline bool tryPop(T &res)
+    {
+        unsigned long h = head.load(std::memory_order_relaxed);
+        if (h == cachedTail)
+        {
+            cachedTail = tail.load(std::memory_order_acquire);
+            if (h == cachedTail)
+            {
+                return false;
+            }
+            if ((long)(cachedTail - h) > 
+                maxOccupancy.load(std::memory_order_relaxed))
+            {
+                maxOccupancy.store(cachedTail - h, 
+                    std::memory_order_relaxed);
+            }
+        }
+        res = buf[h & mask];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+public:
+    SPSCQueue(int sizeLevel): head(0), cachedTail(0), maxOccupancy(0),
+        tail(0), cachedHead(0), overflow(0), sleeping(0), mutex(), cv(),
+        buf(), mask((1ul << sizeLevel) - 1)
+    {
+        buf = std::make_unique<T[]>(1ul << sizeLevel);
+    }
+
+    SPSCQueue(const SPSCQueue&) = delete;
+
+    // producer only. return false(and count an overflow) if the ring is full.
+    inline bool push(const T &val)
+    {
+        unsigned long t = tail.load(std::memory_order_relaxed);
+        if (t - cachedHead > mask)
+        {
+            cachedHead = head.load(std::memory_order_acquire);
+            if (t - cachedHead > mask)
+            {
+                overflow.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+        }
+        buf[t & mask] = val;
+        tail.store(t + 1, std::memory_order_release);
+
+        // pairs with the fence in pop(): either we see the consumer
+        // sleeping, or it sees our new tail before it sleeps.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleeping.load(std::memory_order_relaxed))
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            cv.notify_one();
+        }
+        return true;
+    }
+
+    // consumer only, non-blocking.
+    inline bool pop(T &res)
+    {
+        return tryPop(res);
+    }
+
+    // consumer only. wait up to `us` microseconds for an element.
+    bool pop(T &res, long us)
+    {
+        for (int i = 0; i < SPIN_COUNT; ++i)
+        {
+            if (tryPop(res))
+            {
+                return true;
+            }
+        }
+
+        std::unique_lock<std::mutex> lock(mutex);
+        sleeping.store(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!tryPop(res))
+        {
+            cv.wait_for(lock, std::chrono::microseconds(us));
+            sleeping.store(0, std::memory_order_relaxed);
+            return tryPop(res);
+        }
+        sleeping.store(0, std::memory_order_relaxed);
+        return true;
+    }
+
+    // approximate number of queued elements; safe from any thread.
+    inline long size()
+    {
+        return tail.load(std::memory_order_relaxed) -
+            head.load(std::memory_order_relaxed);
+    }
+
+    inline long capacity()
+    {
+        return mask + 1;
+    }
+
+    inline long getOverflow()
+    {
+        return overflow.load(std::memory_order_relaxed);
+    }
+
+    // peak occupancy as observed by the consumer
+    inline long getMaxOccupancy()
+    {
+        return maxOccupancy.load(std::memory_order_relaxed);
+    }
+};
+
+#endif
@@ -0,0 +1,329 @@
+#ifndef __STATS_HH__
+#define __STATS_HH__
+
+#include <stdint.h>
+
+#include <atomic>
+
+// HDR-style log-linear histogram of non-negative values(usually ns).
+// values below 2^(SUB_BITS + 1) have their own bucket; above that every
+// power of two is split into 2^SUB_BITS linear sub-buckets, so the relative
+// error of any reported value is below 2^-SUB_BITS(~3%). recording is O(1)
+// and never allocates.
+class Histogram
+{
+public:
+    static const int SUB_BITS = 5;
+    // values up to 2^MAX_BITS - 1(~18 minutes in ns) are tracked exactly,
+    // larger ones are clamped.
+    static const int MAX_BITS = 40;
+    static const int BUCKETS = (MAX_BITS - SUB_BITS + 1) << SUB_BITS;
+
+private:
+    long counts[BUCKETS];
+    long total;
+    long minValue;
+    long maxValue;
+    double sum;
+
+public:
+    Histogram();
+
+    static inline int indexOf(long v)
+    {
+        if (v < (2L << SUB_BITS))
+        {
+            return v < 0 ? 0 : (int)v;
+        }
+        if (v >= (1L << MAX_BITS))
+        {
+            v = (1L << MAX_BITS) - 1;
+        }
+        int shift = 63 - __builtin_clzl(v) - SUB_BITS;
+        return ((shift + 1) << SUB_BITS) + (int)(v >> shift) -
+            (1 << SUB_BITS);
+    }
+
+    // lowest value falling into bucket `idx`
+    static inline long valueOf(int idx)
+    {
+        if (idx < (2 << SUB_BITS))
+        {
+            return idx;
+        }
+        int shift = (idx >> SUB_BITS) - 1;
+        return (long)((idx & ((1 << SUB_BITS) - 1)) + (1 << SUB_BITS)) <<
+            shift;
+    }
+
+    inline void record(long v)
+    {
+        if (v < 0)
+        {
+            v = 0;
+        }
+        ++counts[indexOf(v)];
+        ++total;
+        sum += v;
+        if (v < minValue)
+        {
+            minValue = v;
+        }
+        if (v > maxValue)
+        {
+            maxValue = v;
+        }
+    }
+
+    // value at quantile `q`(0 <= q <= 1), reported as the midpoint of its
+    // bucket. return 0 if empty.
+    long percentile(double q) const;
+
+    void merge(const Histogram &other);
+    void reset();
+
+    inline long count() const
+    {
+        return total;
+    }
+
+    inline long getMin() const
+    {
+        return total == 0 ? 0 : minValue;
+    }
+
+    inline long getMax() const
+    {
+        return maxValue;
+    }
+
+    inline double mean() const
+    {
+        return total == 0 ? 0 : sum / total;
+    }
+
+    inline long bucket(int idx) const
+    {
+        return counts[idx];
+    }
+};
+
+// Arrival order of a stream of sequence numbers, in constant time and
+// without allocation. a bitmap over the 2^WINDOW_LEVEL numbers up to the
+// highest one seen tells which have arrived; an arrival is NEW if it is
+// above the highest, DUPLICATE if its bit is set, LATE(by the distance to
+// the highest) if not, and TOO_OLD if it is below the window.
+//
+// numbers missing when they slide out of the window are lost for good.
+// they are counted in runs of consecutive numbers, and the run lengths
+// kept in a histogram, as are the distances of LATE arrivals. numbers
+// below the first arrival are not counted as lost.
+class SeqTracker
+{
+public:
+    static const int WINDOW_LEVEL = 16;
+
+    enum Arrival
+    {
+        NEW,
+        DUPLICATE,
+        LATE,
+        TOO_OLD,
+        ARRIVALS
+    };
+
+private:
+    static const long WINDOW = 1L << WINDOW_LEVEL;
+
+    long first;
+    long highest;
+    uint64_t window[WINDOW / 64];
+    long counts[ARRIVALS];
+    // missing numbers that left the window, and the run being counted
+    long lost;
+    long run;
+    Histogram lossRuns;
+    Histogram reorder;
+
+    inline int isSet(long seq) const
+    {
+        return (window[(seq & (WINDOW - 1)) >> 6] >> (seq & 63)) & 1;
+    }
+
+    inline void evict(long seq, int present)
+    {
+        if (seq < first)
+        {
+            return;
+        }
+        if (!present)
+        {
+            ++run;
+        }
+        else if (run > 0)
+        {
+            lossRuns.record(run);
+            lost += run;
+            run = 0;
+        }
+    }
+
+    void slide(long seq);
+
+public:
+    SeqTracker();
+
+    // classify the arrival of `seq`. `distance` is how far a LATE one is
+    // behind the highest, 0 otherwise.
+    inline Arrival onArrival(long seq, long &distance)
+    {
+        distance = 0;
+        if (seq > highest)
+        {
+            slide(seq);
+            ++counts[NEW];
+            return NEW;
+        }
+        if (seq <= highest - WINDOW)
+        {
+            ++counts[TOO_OLD];
+            return TOO_OLD;
+        }
+        if (isSet(seq))
+        {
+            ++counts[DUPLICATE];
+            return DUPLICATE;
+        }
+        window[(seq & (WINDOW - 1)) >> 6] |= 1ul << (seq & 63);
+        distance = highest - seq;
+        reorder.record(distance);
+        ++counts[LATE];
+        return LATE;
+    }
+
+    // count what is still missing in the window as lost. arrivals after
+    // this are not tracked correctly.
+    void finish();
+
+    // add the counters and histograms of `other` to this one.
+    void merge(const SeqTracker &other);
+
+    // log the counters and histograms, labelled with `name`. `lossName`
+    // names what is missing(e.g. "lost" or "unacked").
+    void report(const char *name, const char *lossName) const;
+
+    inline long count(Arrival arrival) const
+    {
+        return counts[arrival];
+    }
+
+    inline long getHighest() const
+    {
+        return highest;
+    }
+
+    inline long getLost() const
+    {
+        return lost;
+    }
+
+    inline const Histogram& getLossRuns() const
+    {
+        return lossRuns;
+    }
+
+    inline const Histogram& getReorder() const
+    {
+        return reorder;
+    }
+};
+
+// Live statistics of a probe run, kept by the Sender.
+// `onSent` is called by the sending thread, everything else by the thread
+// receiving ACKs. ACKs are classified by a SeqTracker: duplicates are
+// dropped, LATE ones count as reordered and TOO_OLD ones as stale.
+class RunStats
+{
+public:
+    // layout of the binary summary written by `dump`. the header is
+    // followed by `buckets` (index, count) pairs of int32/int64 for the
+    // non-empty RTT buckets.
+    struct Summary
+    {
+        char magic[8];
+        int32_t version;
+        int32_t subBits;
+        int64_t elapsedNs;
+        int64_t sent;
+        int64_t acked;
+        int64_t duplicates;
+        int64_t reordered;
+        int64_t stale;
+        int64_t rttMin;
+        int64_t rttMax;
+        double rttMean;
+        double dwellMean;
+        int32_t buckets;
+        int32_t reserved;
+    };
+
+private:
+    std::atomic<long> sent;
+    // payload bytes of the packets sent
+    std::atomic<long> bytes;
+    long acked;
+    SeqTracker acks;
+    Histogram rtt;
+    Histogram dwell;
+
+    long startTime;
+    long lastTime;
+    long lastSent;
+    long lastBytes;
+    long lastAcked;
+
+public:
+    RunStats();
+
+    // start the clock(CLOCK_REALTIME ns).
+    void start(long now);
+
+    // forget everything, as if just constructed.
+    void reset();
+
+    // account for `n` packets of `size` bytes sent.
+    inline void onSent(long n, int size)
+    {
+        sent.fetch_add(n, std::memory_order_relaxed);
+        bytes.fetch_add(n * size, std::memory_order_relaxed);
+    }
+
+    // account for an ACK of `seq`. `rttNs`/`dwellNs` < 0 if unknown.
+    void onAck(long seq, long rttNs, long dwellNs);
+
+    // add the counters and histograms of `other` to this one. the start of
+    // the run becomes the earlier of both.
+    void merge(const RunStats &other);
+
+    // log the progress since the last call and the cumulative RTT
+    // distribution, labelled with `name`.
+    void report(const char *name, long now);
+
+    // log the final summary of the run, labelled with `name`.
+    void finish(const char *name, long now);
+
+    // write the binary summary to `path`. return 0 on success.
+    int dump(const char *path, long now);
+
+    inline const Histogram& getRtt() const
+    {
+        return rtt;
+    }
+
+    inline const SeqTracker& getAcks() const
+    {
+        return acks;
+    }
+};
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef __TESTPLAN_HH__
+#define __TESTPLAN_HH__
+
+#include <vector>
+
+// Multi-phase test plan of the Sender.
+// every receiver runs through the phases back to back on the same sockets
+// and buffers. a plan file holds one phase per line, given as whitespace
+// separated key=value pairs; '#' starts a comment. keys:
+//   name=[str]      label of the phase in its summary(default phase[N])
+//   rate=[rate]     packet rate, as -R
+//   interval=[us]   time between two packets, as -i
+//   size=[bytes]    packet size, as -s
+//   count=[num]     packets to measure
+//   duration=[s]    seconds to measure
+//   ack=[num]       have the receiver ACK every [num]-th packet(default:
+//                   its own -n)
+//   warmup=[s]      seconds of unmeasured traffic before measuring
+//   cooldown=[s]    seconds of silence after measuring, so that the last
+//                   ACKs make it into the summary
+// a phase measures until `count` or `duration` runs out, whichever comes
+// first, and needs at least one of them. rate, interval and size default
+// to the command line options.
+class TestPlan
+{
+public:
+    static const int MAX_PHASES = 64;
+
+    struct Phase
+    {
+        char name[32];
+        double intervalNs;
+        int size;
+        // 0 for no limit
+        long count;
+        long durationNs;
+        // 0 to leave the receiver's setting alone
+        int ackRatio;
+        long warmupNs;
+        long cooldownNs;
+    };
+
+private:
+    std::vector<Phase> phases;
+
+public:
+    // read the phases of `path`, taking unset fields from `defaults`.
+    // return 0 on success.
+    int load(const char *path, const Phase &defaults);
+
+    inline void add(const Phase &phase)
+    {
+        phases.push_back(phase);
+    }
+
+    inline int size() const
+    {
+        return phases.size();
+    }
+
+    inline const Phase& operator[](int i) const
+    {
+        return phases[i];
+    }
+
+    // largest packet size of all phases
+    int maxSize() const;
+};
+
+#endif
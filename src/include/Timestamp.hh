@@ -0,0 +1,126 @@
+#ifndef __TIMESTAMP_HH__
+#define __TIMESTAMP_HH__
+
+#include <sys/socket.h>
+#include <time.h>
+
+#include "Represent.hh"
+#include "Util.hh"
+
+// Kernel/NIC packet timestamps(SO_TIMESTAMPING) for CompactRecorder.
+//
+// RX timestamps arrive as ancillary data of the datagram itself. TX
+// timestamps are looped back through the socket error queue, tagged with a
+// per-socket counter(SOF_TIMESTAMPING_OPT_ID) that the kernel increments on
+// every sendmsg() call. `TxTimestamps` mirrors that counter: every send is
+// announced with `sent` in order, and `reap` matches the looped-back
+// timestamps to the announced packets and writes their records. `reap` also
+// counts the SO_TXTIME errors the etf qdisc reports through the same queue,
+// and passes MSG_ZEROCOPY completions on to the batch that sent them.
+
+class SendBatch;
+
+// enable SO_TIMESTAMPING on `fd` for the given clock source. must be called
+// before the first send on `fd`. COARSE and REALTIME need no socket
+// support, so 0 is returned for them as well.
+int enableTimestamping(int fd, CompactRecorder::Clock clock);
+
+// extract the RX timestamp carried by a received message. return 0 if one
+// is found.
+int getRxTimestamp(const msghdr *hdr, timespec &ts,
+    CompactRecorder::Clock &clock);
+
+// the time(CLOCK_REALTIME ns) a received message arrived at: its RX
+// timestamp if it carries a software one, `fallback` otherwise. hardware
+// timestamps are on the clock of the NIC and cannot be compared with the
+// times carried in messages.
+long getRxTime(const msghdr *hdr, long fallback);
+
+// record a received packet, using its kernel timestamp if present.
+void recordRx(CompactRecorder &rec, long pakSeq, CompactRecorder::Type type,
+    const msghdr *hdr, int flow = 0);
+
+class TxTimestamps
+{
+private:
+    static const int RING_LEVEL = 14;
+
+    struct Pending
+    {
+        unsigned key;
+        int packets;
+        int type;
+        int flow;
+        int valid;
+        long pakSeq;
+        timespec sent;
+    };
+
+    CompactRecorder &rec;
+    UniqueSmart<Pending[]> ring;
+    unsigned key;
+    int enabled;
+    int watchTxTime;
+    SendBatch *zeroCopy;
+    long missed;
+    long txTimeMissed;
+    long txTimeInvalid;
+
+    void settle(Pending &p, const timespec &ts, CompactRecorder::Clock clock);
+public:
+    TxTimestamps(CompactRecorder &rec);
+    TxTimestamps(const TxTimestamps&) = delete;
+
+    // route records through the error queue of `fd` if kernel timestamps
+    // are enabled for the recorder's clock. otherwise records are written
+    // as soon as packets are announced. return 1 if the clock asks for
+    // kernel timestamps but `fd` does not have them.
+    int init(int fd, CompactRecorder::Clock clock);
+
+    // also drain the error queue for SO_TXTIME reports when kernel
+    // timestamps are not enabled.
+    inline void setWatchTxTime(int watch)
+    {
+        watchTxTime = watch;
+    }
+
+    // hand zero-copy completions to `batch`, which must send on the
+    // socket given to `reap`.
+    inline void setZeroCopy(SendBatch *batch)
+    {
+        zeroCopy = batch;
+    }
+
+    // announce one sendmsg() call carrying `packets` packets with sequence
+    // numbers starting at `pakSeq`. `type` < 0 marks packets that are not
+    // to be recorded(e.g. instructions), which still consume a counter.
+    void sent(long pakSeq, int packets, int type, int flow = 0);
+
+    // collect all timestamps currently in the error queue of `fd`. return
+    // the number of messages settled.
+    int reap(int fd);
+
+    // settle everything still pending, using the userspace send time for
+    // packets whose timestamps never arrived.
+    void finish(int fd);
+
+    inline long getMissed()
+    {
+        return missed;
+    }
+
+    // packets the qdisc dropped because their transmit time had passed
+    inline long getTxTimeMissed()
+    {
+        return txTimeMissed;
+    }
+
+    // packets the qdisc dropped because their transmit time was invalid,
+    // e.g. given in the wrong clock
+    inline long getTxTimeInvalid()
+    {
+        return txTimeInvalid;
+    }
+};
+
+#endif
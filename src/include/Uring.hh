@@ -0,0 +1,153 @@
+#ifndef __URING_HH__
+#define __URING_HH__
+
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+// Minimal io_uring, straight on the system calls.
+// the submission and completion rings are mapped into userspace: requests
+// are queued with `getSqe` and handed over with `submit`, which also waits
+// for completions if asked to; completions are read with `peek`/`seen`.
+// with SQPOLL, a kernel thread picks up queued requests by itself, and
+// `submit` only enters the kernel to wake it up or to wait.
+//
+// received data can land in provided buffers: a ring of buffers
+// registered with the kernel(IORING_REGISTER_PBUF_RING), from which every
+// completion of a multishot receive takes one. the buffer id comes with
+// the completion, and the buffer must be given back with `recycle`.
+class Uring
+{
+public:
+    static const int DEF_ENTRIES = 256;
+
+private:
+    int fd;
+    unsigned features;
+    int sqpoll;
+    // the registered file, or -1
+    int file;
+    long enters;
+
+    void *sqMap;
+    long sqMapLen;
+    void *cqMap;
+    long cqMapLen;
+    io_uring_sqe *sqes;
+    long sqesLen;
+
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned *sqFlags;
+    unsigned sqMask;
+    unsigned sqEntries;
+    unsigned *sqArray;
+    // tail as written by us, ahead of `*sqTail` until `submit`
+    unsigned sqLocal;
+
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned cqMask;
+    io_uring_cqe *cqes;
+
+    io_uring_buf_ring *bufRing;
+    long bufRingLen;
+    char *bufs;
+    int bufCount;
+    int bufLen;
+    int bufGroup;
+
+    // not bufRing->bufs: in C++, the empty struct in front of that flexible
+    // array takes space, and moves it off the ring entries
+    inline io_uring_buf& entry(int i)
+    {
+        return ((io_uring_buf*)bufRing)[i];
+    }
+
+public:
+    Uring();
+    Uring(const Uring&) = delete;
+    ~Uring();
+
+    // set up a ring of `entries` submissions, with a SQPOLL thread if
+    // `sqpoll` and allowed. return 0 on success; on failure the caller
+    // falls back to plain system calls.
+    int init(unsigned entries, int sqpoll);
+
+    inline int isSqPoll()
+    {
+        return sqpoll;
+    }
+
+    inline unsigned getFeatures()
+    {
+        return features;
+    }
+
+    // io_uring_enter() calls made so far.
+    inline long getEnters()
+    {
+        return enters;
+    }
+
+    // register socket `fd`, so that requests on it skip the file table
+    // lookup. return 0 on success.
+    int registerFile(int fd);
+
+    // make `sqe` a request on `fd`.
+    inline void setFile(io_uring_sqe *sqe, int fd)
+    {
+        if (fd == file)
+        {
+            sqe->fd = 0;
+            sqe->flags |= IOSQE_FIXED_FILE;
+        }
+        else
+        {
+            sqe->fd = fd;
+        }
+    }
+
+    // a zeroed submission entry, or nullptr if the queue is full.
+    io_uring_sqe* getSqe();
+
+    // hand queued entries to the kernel and wait until `wait` completions
+    // are there, or `timeoutNs` has passed. return the number of entries
+    // submitted, or -errno(-ETIME on timeout, -EINTR if interrupted).
+    int submit(unsigned wait, long timeoutNs);
+
+    // the oldest unread completion, or nullptr.
+    inline io_uring_cqe* peek()
+    {
+        unsigned head = *cqHead;
+        if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+        {
+            return nullptr;
+        }
+        return &cqes[head & cqMask];
+    }
+
+    // done with the completion `peek` returned.
+    inline void seen()
+    {
+        __atomic_store_n(cqHead, *cqHead + 1, __ATOMIC_RELEASE);
+    }
+
+    // register `count`(a power of 2) provided buffers of `len` bytes as
+    // buffer group `group`. return 0 on success.
+    int setupBuffers(int count, int len, int group);
+
+    inline char* buffer(int id)
+    {
+        return bufs + (long)id * bufLen;
+    }
+
+    inline int bufferLength()
+    {
+        return bufLen;
+    }
+
+    // give provided buffer `id` back to the kernel.
+    void recycle(int id);
+};
+
+#endif
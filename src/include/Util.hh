@@ -2,6 +2,8 @@
 #define __UTIL_HH__
 
 #include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <time.h>
 #include <unistd.h>
@@ -9,6 +11,15 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "Represent.hh"
+
 #ifndef VERSION 
 #define VERSION "Undefined"
 #endif
@@ -18,7 +29,8 @@ enum MessageType
     RAW,
     DATA,
     ACK,
-    INSTRUCTION
+    INSTRUCTION,
+    SACK
 };
 
 enum Instructions
@@ -33,9 +45,92 @@ struct Message
     long value;
 };
 
+// all in-band times are CLOCK_REALTIME nanoseconds of the host that took
+// them. `sendTime` and `echoTime` are sender time, `recvTime` and `ackTime`
+// are receiver time, so RTT and receiver dwell time need no clock sync.
+
+// DATA packet(padded to the packet size)
+struct DataMessage
+{
+    Message hdr;
+    long sendTime;
+    // test plan phase the packet is measured in, -1 if none
+    int phase;
+    // ACK every `ackRatio`-th packet, 0 for the receiver's default
+    int ackRatio;
+};
+
+// ACK packet
+struct AckMessage
+{
+    Message hdr;
+    // `sendTime` of the acknowledged DATA packet
+    long echoTime;
+    // when the receiver got the DATA packet
+    long recvTime;
+    // when the receiver sent this ACK
+    long ackTime;
+    // `phase` of the acknowledged DATA packet
+    int phase;
+};
+
+// selective ACK packet(Receiver -a), acknowledging DATA packets of `phase`
+// from `hdr.value` on: bit i of `received` stands for packet hdr.value + i,
+// whose times are in `entries[i]`. bit 0 is always set, and only the
+// entries up to the highest bit set are sent.
+struct SackMessage
+{
+    static const int MAX_PACKETS = 64;
+
+    struct Entry
+    {
+        // `sendTime` of the DATA packet
+        long echoTime;
+        // its `recvTime` minus `baseTime`
+        int recvDelta;
+        int reserved;
+    };
+
+    Message hdr;
+    uint64_t received;
+    // `recvTime` of packet `hdr.value`
+    long baseTime;
+    // when the receiver sent this ACK
+    long ackTime;
+    int phase;
+    // bits set in `received`
+    int packets;
+    Entry entries[MAX_PACKETS];
+
+    // bytes on the wire
+    inline int length() const
+    {
+        return offsetof(SackMessage, entries) + 
+            (64 - __builtin_clzl(received)) * sizeof(Entry);
+    }
+};
+
+inline long toNanoTime(const timespec &ts)
+{
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+inline long getNanoTime()
+{
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return toNanoTime(ts);
+}
+
+// Compact binary performance log.
+// records are not written one by one. every writer thread appends to its
+// own chunk(a "lane"), and full chunks are handed to a background flusher
+// thread that writes them out. this keeps the packet path free of system
+// calls and locks, at the price that records from different threads are
+// interleaved chunk by chunk instead of record by record. when the flusher
+// falls behind and no free chunk is left, records are dropped and counted.
 class CompactRecorder
 {
-    int fd;
 public:
     enum Type
     {
@@ -46,29 +141,303 @@ public:
         IGNORED
     };
 
+    // where the timestamp of a record comes from.
+    enum Clock
+    {
+        // CLOCK_REALTIME_COARSE read in userspace(tick granularity)
+        COARSE,
+        // CLOCK_REALTIME read in userspace
+        REALTIME,
+        // SO_TIMESTAMPING software timestamp taken by the kernel
+        SOFTWARE,
+        // SO_TIMESTAMPING raw hardware timestamp taken by the NIC
+        HARDWARE
+    };
+
+    // `type` holds the record type in bits 0-7, the clock source in bits
+    // 8-15 and the flow(i.e. receiver of a multi-client Sender) in bits
+    // 16-31. files written before these were recorded read as COARSE and
+    // flow 0.
     struct Record
     {
         long pakSeq;
         int type;
         int nanosec;
         long sec;
+
+        inline Type getType() const
+        {
+            return (Type)(type & 0xff);
+        }
+
+        inline Clock getClock() const
+        {
+            return (Clock)((type >> 8) & 0xff);
+        }
+
+        inline int getFlow() const
+        {
+            return (type >> 16) & 0xffff;
+        }
+    };
+
+    // v2 file layout: a `FileHeader`, then one block per flushed chunk. a
+    // block is a `BlockHeader` followed by three columns of `count`
+    // varints: zigzag deltas of pakSeq, `type` XORed with the previous
+    // `type`, and zigzag deltas of the timestamp in ns. the first deltas
+    // are taken from the block minimums. the ranges in the block header
+    // let readers skip blocks without decoding them.
+    // v1 files are headerless arrays of `Record` in host layout.
+    struct FileHeader
+    {
+        char magic[8];
+        int32_t version;
+        // size of the header, readers skip what they do not know
+        int32_t length;
+        int32_t clock;
+        int32_t blockRecords;
+        // CLOCK_REALTIME ns when the file was created
+        int64_t created;
+        char host[64];
+        // command line of the writing program
+        char params[416];
+    };
+
+    struct BlockHeader
+    {
+        int32_t count;
+        // bytes of column data following the header
+        int32_t length;
+        int64_t minSeq;
+        int64_t maxSeq;
+        int64_t minTime;
+        int64_t maxTime;
     };
 
-    inline CompactRecorder(): fd(-1) {}
+    static const char MAGIC[];
+    static const int VERSION_2 = 2;
+    // writer threads, records of any more are dropped
+    static const int MAX_LANES = 64;
+
+    static const char* clockName(Clock clock);
+    static int parseClock(const char *str, Clock &clock);
+
+    // largest encoded size of a block of `count` records
+    static inline long maxBlockLen(int count)
+    {
+        return sizeof(BlockHeader) + count * 25L;
+    }
+
+    // encode `count` records into `out` as a block, header included.
+    // return its size.
+    static long encodeBlock(const Record *recs, int count, char *out);
+
+    // decode the columns of a block into `out`. return 0 on success.
+    static int decodeBlock(const BlockHeader &hdr, const char *data,
+        Record *out);
+
+private:
+    // 4096 records(96KB) per chunk, 12MB in total: every lane may hold
+    // one while as many more are written out
+    static const int CHUNK_LEVEL = 12;
+    static const int CHUNK_COUNT = 2 * MAX_LANES;
+
+    struct Chunk
+    {
+        UniqueSmart<Record[]> recs;
+        int count;
+    };
+
+    struct alignas(64) Lane
+    {
+        Chunk *chunk;
+    };
+
+    int fd;
+    Clock clock;
+    FileHeader header;
+    int headerWritten;
+    int broken;
+    UniqueSmart<char[]> encodeBuf;
+    UniqueSmart<Chunk[]> chunks;
+    UniqueSmart<Lane[]> lanes;
+    std::atomic<int> laneCount;
+    std::atomic<long> dropped;
+    std::mutex chunkLock;
+    std::condition_variable chunkCond;
+    std::vector<Chunk*> freeChunks;
+    std::vector<Chunk*> fullChunks;
+    int flushing;
+    int toExit;
+    UniqueSmart<std::thread> flusher;
+
+    Lane* getLane();
+    void submit(Chunk *chunk);
+    int writeOut(const char *buf, long len);
+    void writeHeader();
+    static void flusherMain(CompactRecorder *rec);
+
+public:
+    CompactRecorder();
+    CompactRecorder(const CompactRecorder&) = delete;
+    ~CompactRecorder();
 
     int init(const char *path);
 
-    int write(long pakSeq, Type type);
+    // describe the run in the file header. must be called before the first
+    // record is written out.
+    void setRunInfo(int argc, char **argv);
+
+    // write out everything recorded so far and wait for it to complete.
+    // writer threads must be quiescent(e.g. joined) while this runs.
+    void flush();
+
+    // flush and stop the flusher. further records are discarded.
+    void close();
+
+    inline long getDropped()
+    {
+        return dropped.load(std::memory_order_relaxed);
+    }
+
+    // choose the userspace clock used by `write(long, Type)`. SOFTWARE and
+    // HARDWARE are only meaningful for timestamps supplied by the caller,
+    // so for them REALTIME is used as the fallback.
+    void setClock(Clock clock);
+
+    inline Clock getClock()
+    {
+        return clock;
+    }
+
+    int write(long pakSeq, Type type, int flow = 0);
+    int write(long pakSeq, Type type, const timespec &ts, Clock clock,
+        int flow = 0);
 };
 
+// Reader of CompactRecorder files, v1 and v2.
+// regular files are mmap()ed. records of v1 files are used in place, so the
+// whole file is a contiguous array of records that can be iterated or
+// indexed without copying. v2 files are decoded block by block. streams
+// (stdin, pipes) are read in large blocks. `load` decodes or reads the
+// whole input into memory when random access is needed.
+//
+// records of different writer threads are interleaved chunk by chunk, so
+// the file is neither ordered by time nor by sequence number. `timeRange`
+// and `seqRange` sort an index of the records the first time they are
+// used and binary search it afterwards.
 class RecordReader
 {
+public:
+    typedef CompactRecorder::Record Record;
+    typedef std::vector<const Record*> Index;
+    typedef Index::const_iterator IndexIterator;
+
+private:
+    // bytes read per system call from a stream
+    static const long STREAM_LEN = 1 << 21;
+
     int fd;
+    int version;
+    CompactRecorder::FileHeader header;
+
+    const char *map;
+    size_t mapLen;
+    long mapPos;
+
+    UniqueSmart<char[]> streamBuf;
+    long streamBytes;
+    long streamPos;
+    int streamEnd;
+
+    // records available for random access
+    const Record *recs;
+    long count;
+    // backing store of loaded records
+    std::vector<Record> loaded;
+    // next record of a mapped v1 file
+    long pos;
+
+    // current decoded v2 block
+    std::vector<Record> block;
+    size_t blockPos;
+
+    Index byTime;
+    Index bySeq;
+
+    // make `need` unread bytes available in the stream buffer. return the
+    // number of bytes available.
+    long fill(long need);
+    // consume `len` bytes of input. return nullptr at the end of input.
+    const char* take(long len);
+    int nextBlock();
+    void release();
 public:
-    inline RecordReader(): fd(-1) {}
+    RecordReader();
+    RecordReader(const RecordReader&) = delete;
+    ~RecordReader();
 
     int init(const char *path);
-    int next(CompactRecorder::Record &res);
+
+    // 1 or 2
+    inline int getVersion() const
+    {
+        return version;
+    }
+
+    // header of a v2 file, nullptr for v1
+    inline const CompactRecorder::FileHeader* getHeader() const
+    {
+        return version >= CompactRecorder::VERSION_2 ? &header : nullptr;
+    }
+
+    // copy the next record into `res`. return 0 on success, 1 at the end.
+    int next(Record &res);
+
+    // make the whole input available for random access. mapped v1 files
+    // are available right after `init`, everything else is read to the
+    // end. records that have been consumed by `next` are not included.
+    // return 0 on success.
+    int load();
+
+    inline bool isLoaded() const
+    {
+        return recs != nullptr;
+    }
+
+    // the loaded records, in file order
+    inline const Record* begin() const
+    {
+        return recs;
+    }
+
+    inline const Record* end() const
+    {
+        return recs + count;
+    }
+
+    inline long size() const
+    {
+        return count;
+    }
+
+    inline const Record& operator[](long idx) const
+    {
+        return recs[idx];
+    }
+
+    // loaded records with `fromNs` <= timestamp < `toNs`(CLOCK_REALTIME
+    // ns), ordered by timestamp.
+    std::pair<IndexIterator, IndexIterator> timeRange(long fromNs, long toNs);
+
+    // loaded records with `from` <= pakSeq < `to`, ordered by pakSeq and
+    // timestamp.
+    std::pair<IndexIterator, IndexIterator> seqRange(long from, long to);
+
+    static inline long nanoTime(const Record &rec)
+    {
+        return rec.sec * 1000000000L + rec.nanosec;
+    }
 };
 
 typedef void (*sighandler)(int, siginfo_t*, void*);